@@ -0,0 +1,10 @@
+#!/usr/bin/env python3
+# CGI script of the benchmarks: reads the body, answers with its length
+import os
+import sys
+
+n = int(os.environ.get('CONTENT_LENGTH') or 0)
+body = sys.stdin.buffer.read(n) if n > 0 else b''
+out = b'%d bytes\n' % len(body)
+sys.stdout.buffer.write(b'HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n'
+                        b'Content-Length: %d\r\n\r\n' % len(out) + out)
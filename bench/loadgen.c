@@ -0,0 +1,681 @@
+/** @file loadgen.c
+ *  @brief HTTP load generator for the benchmarks of lisod
+ *
+ *  Each thread drives its share of the connections with epoll. A connection
+ *  sends a batch of --pipeline requests, reads the responses, and sends the
+ *  next batch, so there are at most that many requests in flight on it. With
+ *  --close, each request has its own connection. With --tls, connections are
+ *  HTTPS, and --resume reuses the TLS session of the previous connection of
+ *  the thread.
+ *
+ *  Responses are framed by Content-Length, or by the end of the connection.
+ *  Latency runs from the write of a batch to the end of each of its responses,
+ *  and is counted in a log-linear histogram like the one of metrics.c.
+ *
+ *  The result is one JSON object on stdout, see print_result().
+ *
+ *  @author Chao Xin(cxin)
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define MAX_PIPELINE 256
+#define INBUF_SIZE (64 * 1024)
+
+/* Histogram buckets, as in metrics.h but with 32 buckets per power of 2 */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Connection states */
+#define S_CONNECT 0         //connect() in progress
+#define S_HANDSHAKE 1       //TLS handshake in progress
+#define S_ACTIVE 2          //sending requests and reading responses
+
+/* Body of the current response */
+#define B_HEADER (-1)       //the headers are not complete yet
+#define B_EOF (-2)          //the body ends with the connection
+
+/** @brief Counters of a thread, summed at the end */
+typedef struct {
+    unsigned long requests;         //<!responses with a 2xx or 3xx status
+    unsigned long errors;           //<!other statuses, resets, bad responses
+    unsigned long connects;         //<!connections opened
+    unsigned long resumed;          //<!TLS sessions resumed
+    unsigned long long bytes;       //<!bytes of responses received
+    unsigned long hist[HIST_BUCKETS];
+    long long max_us;
+} result_t;
+
+/** @brief A connection to the server */
+typedef struct {
+    int fd;
+    SSL *ssl;
+    int state;
+    int want_write;             //<!waiting for the socket to be writable
+    char *out;                  //<!the batch being written
+    int out_len, out_off;
+    int outstanding;            //<!requests of the batch not answered yet
+    int answered;               //<!responses of the batch read
+    struct timespec sent;       //<!when the batch was written
+    long long body_left;        //<!B_HEADER, B_EOF or bytes of body to skip
+    int status;                 //<!status of the current response
+    int server_close;           //<!the response said Connection: close
+    int in_len;
+    char in[INBUF_SIZE];
+} conn_t;
+
+/** @brief A thread and its connections */
+typedef struct {
+    pthread_t tid;
+    int epfd;
+    int nconns;
+    conn_t *conns;
+    SSL_SESSION *session;       //<!session to resume, with --resume
+    result_t result;
+} worker_t;
+
+static struct sockaddr_in server_addr;
+static char *host = "127.0.0.1";
+static int port = 8080;
+static int nconns = 16;
+static int nthreads = 2;
+static double duration = 5;
+static int pipeline = 1;
+static int close_each = 0;
+static int use_tls = 0;
+static int resume = 0;
+static int post_len = -1;
+static char *name = "bench";
+static char *path = "/";
+
+static SSL_CTX *ssl_ctx;
+static char *batch;             //<!pipeline copies of the request
+static int batch_len;
+static struct timespec deadline;
+
+static struct option long_options[] = {
+    { "host", required_argument, NULL, 'H' },
+    { "port", required_argument, NULL, 'P' },
+    { "connections", required_argument, NULL, 'c' },
+    { "threads", required_argument, NULL, 't' },
+    { "duration", required_argument, NULL, 'd' },
+    { "pipeline", required_argument, NULL, 'p' },
+    { "close", no_argument, NULL, 'C' },
+    { "tls", no_argument, NULL, 's' },
+    { "resume", no_argument, NULL, 'r' },
+    { "post", required_argument, NULL, 'b' },
+    { "name", required_argument, NULL, 'n' },
+    { NULL, 0, NULL, 0 }
+};
+
+static void usage() {
+    fprintf(stderr, "Usage: loadgen [options] <path>\n");
+    fprintf(stderr, "	--host <ip> – server address(default 127.0.0.1)\n");
+    fprintf(stderr, "	--port <n> – server port(default 8080)\n");
+    fprintf(stderr, "	--connections <n> – concurrent connections(default 16)\n");
+    fprintf(stderr, "	--threads <n> – threads sharing the connections(default 2)\n");
+    fprintf(stderr, "	--duration <s> – seconds to run(default 5)\n");
+    fprintf(stderr, "	--pipeline <n> – requests sent at once on a connection");
+    fprintf(stderr, "(default 1)\n");
+    fprintf(stderr, "	--close – one request per connection\n");
+    fprintf(stderr, "	--tls – HTTPS\n");
+    fprintf(stderr, "	--resume – resume the TLS session of the previous ");
+    fprintf(stderr, "connection\n");
+    fprintf(stderr, "	--post <n> – POST a body of n bytes instead of GET\n");
+    fprintf(stderr, "	--name <s> – name of the scenario in the result\n");
+}
+
+/** @brief The bucket of a value */
+static int bucket(long long v) {
+    int e;
+
+    if (v < HIST_SUB)
+        return v < 0 ? 0 : v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/** @brief The lowest value of a bucket */
+static long long bucket_low(int i) {
+    int e;
+
+    if (i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (long long)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/** @brief The value below which a fraction p of the latencies are */
+static long long percentile(result_t *r, double p) {
+    unsigned long rank, seen = 0, count = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; ++i)
+        count += r->hist[i];
+    if (count == 0)
+        return 0;
+    rank = p * count;
+    if (rank >= count)
+        rank = count - 1;
+    for (i = 0; i < HIST_BUCKETS - 1; ++i) {
+        seen += r->hist[i];
+        if (seen > rank)
+            break;
+    }
+    if (i >= HIST_BUCKETS - 1 || bucket_low(i + 1) > r->max_us)
+        return r->max_us;
+    return (bucket_low(i) + bucket_low(i + 1)) / 2;
+}
+
+/** @brief Microseconds from a to b */
+static long long elapsed_us(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000LL +
+           (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/** @brief The deadline has passed */
+static int expired(struct timespec *now) {
+    return now->tv_sec > deadline.tv_sec ||
+           (now->tv_sec == deadline.tv_sec && now->tv_nsec >= deadline.tv_nsec);
+}
+
+/** @brief Build the request, and the batch of pipelined copies */
+static void build_batch() {
+    char head[1024];
+    int head_len, req_len, i;
+    char *req;
+
+    if (post_len >= 0)
+        head_len = snprintf(head, sizeof(head), "POST %s HTTP/1.1\r\n"
+                            "Host: %s\r\nContent-Length: %d\r\n"
+                            "Content-Type: application/octet-stream\r\n%s\r\n",
+                            path, host, post_len,
+                            close_each ? "Connection: close\r\n" : "");
+    else
+        head_len = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\n"
+                            "Host: %s\r\n%s\r\n", path, host,
+                            close_each ? "Connection: close\r\n" : "");
+
+    req_len = head_len + (post_len > 0 ? post_len : 0);
+    req = malloc(req_len);
+    memcpy(req, head, head_len);
+    if (post_len > 0)
+        memset(req + head_len, 'x', post_len);
+
+    batch_len = req_len * pipeline;
+    batch = malloc(batch_len);
+    for (i = 0; i < pipeline; ++i)
+        memcpy(batch + i * req_len, req, req_len);
+    free(req);
+}
+
+/** @brief Watch a connection for reading, and for writing if it waits */
+static void watch(worker_t *w, conn_t *c, int op) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | (c->want_write ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(w->epfd, op, c->fd, &ev);
+}
+
+/** @brief Open a connection. The previous one is closed already
+ *
+ *  @return 0 if ok. -1 if error
+ */
+static int open_conn(worker_t *w, conn_t *c) {
+    int one = 1;
+
+    memset(c, 0, offsetof(conn_t, in));
+    c->body_left = B_HEADER;
+    if ((c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1)
+        return -1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (struct sockaddr *)&server_addr,
+                sizeof(server_addr)) == -1 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    c->state = S_CONNECT;
+    c->want_write = 1;
+    w->result.connects += 1;
+    watch(w, c, EPOLL_CTL_ADD);
+    return 0;
+}
+
+/** @brief Close a connection
+ *
+ *  It is reset rather than closed, so thousands of closed connections do not
+ *  wait in TIME_WAIT for the ports. A TLS session is kept to be resumed.
+ */
+static void close_conn(worker_t *w, conn_t *c) {
+    struct linger lg = { 1, 0 };
+
+    if (c->fd == -1)
+        return;
+    if (c->ssl != NULL) {
+        // Without close_notify, OpenSSL marks the session not resumable
+        SSL_shutdown(c->ssl);
+        if (resume && SSL_SESSION_is_resumable(SSL_get_session(c->ssl))) {
+            if (w->session != NULL)
+                SSL_SESSION_free(w->session);
+            w->session = SSL_get1_session(c->ssl);
+        }
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+/** @brief Close a connection and open another one */
+static void reopen_conn(worker_t *w, conn_t *c) {
+    close_conn(w, c);
+    if (open_conn(w, c) == -1)
+        w->result.errors += 1;
+}
+
+/** @brief Write what is left of the batch
+ *
+ *  @return 0 if ok. -1 if error
+ */
+static int send_batch(worker_t *w, conn_t *c) {
+    int n, err;
+
+    while (c->out_off < c->out_len) {
+        if (c->ssl != NULL) {
+            n = SSL_write(c->ssl, c->out + c->out_off, c->out_len - c->out_off);
+            if (n <= 0) {
+                err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ)
+                    break;
+                return -1;
+            }
+        } else {
+            n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                     MSG_NOSIGNAL);
+            if (n == -1) {
+                if (errno == EAGAIN)
+                    break;
+                return -1;
+            }
+        }
+        c->out_off += n;
+    }
+
+    if (c->want_write != (c->out_off < c->out_len)) {
+        c->want_write = !c->want_write;
+        watch(w, c, EPOLL_CTL_MOD);
+    }
+    return 0;
+}
+
+/** @brief Start the next batch of requests */
+static int start_batch(worker_t *w, conn_t *c) {
+    c->out = batch;
+    c->out_len = batch_len;
+    c->out_off = 0;
+    c->outstanding = pipeline;
+    c->answered = 0;
+    clock_gettime(CLOCK_MONOTONIC, &c->sent);
+    return send_batch(w, c);
+}
+
+/** @brief A response is complete. Count it
+ *
+ *  @return 1 if the connection should be closed. 0 if not
+ */
+static int response_done(worker_t *w, conn_t *c) {
+    struct timespec now;
+    long long us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!expired(&now)) {
+        us = elapsed_us(&c->sent, &now);
+        w->result.hist[bucket(us)] += 1;
+        if (us > w->result.max_us)
+            w->result.max_us = us;
+        if (c->status >= 200 && c->status < 400)
+            w->result.requests += 1;
+        else
+            w->result.errors += 1;
+    }
+
+    c->outstanding -= 1;
+    c->answered += 1;
+    c->body_left = B_HEADER;
+    return close_each || c->server_close;
+}
+
+/** @brief Find a header in the headers of a response
+ *
+ *  @return Its value. NULL if there is none
+ */
+static char* find_header(char *head, char *end, char *key) {
+    int len = strlen(key);
+    char *p;
+
+    for (p = head; p != NULL && p < end; p = memchr(p, '\n', end - p)) {
+        if (*p == '\n')
+            ++p;
+        if (end - p > len && strncasecmp(p, key, len) == 0 && p[len] == ':')
+            return p + len + 1;
+    }
+    return NULL;
+}
+
+/** @brief Parse what has been received
+ *
+ *  @return 1 if the connection should be closed. 0 if not. -1 if error
+ */
+static int parse(worker_t *w, conn_t *c) {
+    char *end, *val;
+    int pos = 0, head_len;
+    long long n;
+
+    while (pos < c->in_len) {
+        if (c->body_left == B_HEADER) {
+            end = memmem(c->in + pos, c->in_len - pos, "\r\n\r\n", 4);
+            if (end == NULL)
+                break;
+            head_len = end + 4 - (c->in + pos);
+            *end = '\0';
+            if (sscanf(c->in + pos, "HTTP/%*d.%*d %d", &c->status) != 1)
+                return -1;
+            val = find_header(c->in + pos, end, "Content-Length");
+            c->body_left = val == NULL ? B_EOF : atoll(val);
+            val = find_header(c->in + pos, end, "Connection");
+            c->server_close = val != NULL && strstr(val, "close") != NULL;
+            w->result.bytes += head_len;
+            pos += head_len;
+            if (c->body_left == 0 && response_done(w, c))
+                return 1;
+            continue;
+        }
+
+        n = c->in_len - pos;
+        if (c->body_left >= 0 && n > c->body_left)
+            n = c->body_left;
+        w->result.bytes += n;
+        pos += n;
+        if (c->body_left >= 0) {
+            c->body_left -= n;
+            if (c->body_left == 0 && response_done(w, c))
+                return 1;
+        }
+    }
+
+    if (pos == 0 && c->in_len == INBUF_SIZE)
+        return -1;      // Headers larger than the buffer
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return 0;
+}
+
+/** @brief Read from a connection and handle the responses */
+static void receive(worker_t *w, conn_t *c) {
+    int n, err, ret;
+
+    for (;;) {
+        if (c->ssl != NULL) {
+            n = SSL_read(c->ssl, c->in + c->in_len, INBUF_SIZE - c->in_len);
+            if (n <= 0) {
+                err = SSL_get_error(c->ssl, n);
+                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                    return;
+                n = err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+            }
+        } else {
+            n = recv(c->fd, c->in + c->in_len, INBUF_SIZE - c->in_len, 0);
+            if (n == -1 && errno == EAGAIN)
+                return;
+        }
+
+        if (n <= 0) {
+            // The end of the connection ends a body without Content-Length
+            if (n == 0 && c->body_left == B_EOF)
+                response_done(w, c);
+            else if (c->outstanding > 0)
+                w->result.errors += 1;
+            reopen_conn(w, c);
+            return;
+        }
+
+        c->in_len += n;
+        if ((ret = parse(w, c)) != 0) {
+            if (ret == -1 || c->outstanding > 0)
+                w->result.errors += 1;
+            reopen_conn(w, c);
+            return;
+        }
+        if (c->outstanding == 0 && start_batch(w, c) == -1) {
+            w->result.errors += 1;
+            reopen_conn(w, c);
+            return;
+        }
+    }
+}
+
+/** @brief Make progress on a connection whose socket is ready */
+static void handle(worker_t *w, conn_t *c, int events) {
+    int err, ret;
+
+    if (c->state == S_CONNECT) {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            w->result.errors += 1;
+            reopen_conn(w, c);
+            return;
+        }
+        if (!use_tls) {
+            c->state = S_ACTIVE;
+            if (start_batch(w, c) == -1) {
+                w->result.errors += 1;
+                reopen_conn(w, c);
+            }
+            return;
+        }
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        if (resume && w->session != NULL)
+            SSL_set_session(c->ssl, w->session);
+        c->state = S_HANDSHAKE;
+    }
+
+    if (c->state == S_HANDSHAKE) {
+        if ((ret = SSL_connect(c->ssl)) != 1) {
+            err = SSL_get_error(c->ssl, ret);
+            if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) {
+                w->result.errors += 1;
+                reopen_conn(w, c);
+                return;
+            }
+            if (c->want_write != (err == SSL_ERROR_WANT_WRITE)) {
+                c->want_write = !c->want_write;
+                watch(w, c, EPOLL_CTL_MOD);
+            }
+            return;
+        }
+        if (SSL_session_reused(c->ssl))
+            w->result.resumed += 1;
+        c->state = S_ACTIVE;
+        if (start_batch(w, c) == -1) {
+            w->result.errors += 1;
+            reopen_conn(w, c);
+        }
+        return;
+    }
+
+    if ((events & EPOLLOUT) && send_batch(w, c) == -1) {
+        w->result.errors += 1;
+        reopen_conn(w, c);
+        return;
+    }
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        receive(w, c);
+}
+
+/** @brief Main function of a thread */
+static void* run(void *arg) {
+    worker_t *w = arg;
+    struct epoll_event events[64];
+    struct timespec now;
+    int i, n;
+
+    w->epfd = epoll_create1(0);
+    for (i = 0; i < w->nconns; ++i)
+        if (open_conn(w, &w->conns[i]) == -1)
+            w->result.errors += 1;
+
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (expired(&now))
+            break;
+        n = epoll_wait(w->epfd, events, 64, 100);
+        for (i = 0; i < n; ++i)
+            handle(w, events[i].data.ptr, events[i].events);
+    }
+
+    for (i = 0; i < w->nconns; ++i)
+        close_conn(w, &w->conns[i]);
+    close(w->epfd);
+    return NULL;
+}
+
+/** @brief Print the sum of the results as JSON
+ *
+ *  Latencies are in microseconds. mb_per_s counts the bytes of the
+ *  responses, headers included.
+ */
+static void print_result(result_t *r, double seconds) {
+    printf("{\"name\": \"%s\", \"path\": \"%s\", \"connections\": %d, "
+           "\"pipeline\": %d, \"tls\": %d, \"resume\": %d, \"close\": %d, "
+           "\"seconds\": %.2f, \"requests\": %lu, \"errors\": %lu, "
+           "\"connects\": %lu, \"resumed\": %lu, \"rps\": %.0f, "
+           "\"bytes\": %llu, \"mb_per_s\": %.2f, \"latency_us\": {\"p50\": %lld, "
+           "\"p99\": %lld, \"p999\": %lld, \"max\": %lld}}\n",
+           name, path, nconns, pipeline, use_tls, resume, close_each, seconds,
+           r->requests, r->errors, r->connects, r->resumed,
+           r->requests / seconds, r->bytes, r->bytes / seconds / 1e6,
+           percentile(r, 0.5), percentile(r, 0.99), percentile(r, 0.999),
+           r->max_us);
+}
+
+int main(int argc, char* argv[]) {
+    struct addrinfo hints, *ai;
+    struct timespec start;
+    worker_t *workers;
+    result_t total;
+    int c, i, j;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'H': host = optarg; break;
+        case 'P': port = atoi(optarg); break;
+        case 'c': nconns = atoi(optarg); break;
+        case 't': nthreads = atoi(optarg); break;
+        case 'd': duration = atof(optarg); break;
+        case 'p': pipeline = atoi(optarg); break;
+        case 'C': close_each = 1; break;
+        case 's': use_tls = 1; break;
+        case 'r': resume = 1; break;
+        case 'b': post_len = atoi(optarg); break;
+        case 'n': name = optarg; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (optind < argc)
+        path = argv[optind];
+    if (nconns < 1 || nthreads < 1 || pipeline < 1 || pipeline > MAX_PIPELINE ||
+        duration <= 0) {
+        usage();
+        return 1;
+    }
+    if (close_each)
+        pipeline = 1;
+    if (nthreads > nconns)
+        nthreads = nconns;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &ai) != 0) {
+        fprintf(stderr, "Unknown host %s\n", host);
+        return 1;
+    }
+    server_addr = *(struct sockaddr_in *)ai->ai_addr;
+    server_addr.sin_port = htons(port);
+    freeaddrinfo(ai);
+
+    if (use_tls) {
+        SSL_library_init();
+        SSL_load_error_strings();
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_session_cache_mode(ssl_ctx, SSL_SESS_CACHE_CLIENT);
+    }
+    build_batch();
+    signal(SIGPIPE, SIG_IGN);
+
+    workers = calloc(nthreads, sizeof(worker_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += (long)duration;
+    deadline.tv_nsec += (duration - (long)duration) * 1e9;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec += 1;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    for (i = 0; i < nthreads; ++i) {
+        workers[i].nconns = nconns / nthreads + (i < nconns % nthreads);
+        workers[i].conns = malloc(sizeof(conn_t) * workers[i].nconns);
+        for (j = 0; j < workers[i].nconns; ++j)
+            workers[i].conns[j].fd = -1;
+        pthread_create(&workers[i].tid, NULL, run, &workers[i]);
+    }
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < nthreads; ++i) {
+        pthread_join(workers[i].tid, NULL);
+        total.requests += workers[i].result.requests;
+        total.errors += workers[i].result.errors;
+        total.connects += workers[i].result.connects;
+        total.resumed += workers[i].result.resumed;
+        total.bytes += workers[i].result.bytes;
+        for (j = 0; j < HIST_BUCKETS; ++j)
+            total.hist[j] += workers[i].result.hist[j];
+        if (workers[i].result.max_us > total.max_us)
+            total.max_us = workers[i].result.max_us;
+    }
+
+    // Responses after the deadline are not counted
+    print_result(&total, duration);
+    return 0;
+}
@@ -0,0 +1,310 @@
+/** @file parsebench.c
+ *  @brief Microbenchmark of the request parser and the input buffer
+ *
+ *  Request captures from bench/corpus are fed to http_parse() through a fake
+ *  client, in process and without sockets. Each capture is fed whole, then
+ *  trickled in segments of a few bytes or one byte at a time, like data
+ *  arriving in several recv(). After each segment the parser runs as the
+ *  server loop does: until it stops making progress, then the input buffer is
+ *  shrunk if it is mostly consumed.
+ *
+ *  The request handlers are replaced by stubs which only count the requests,
+ *  so the time is the one of http_parse(), client_readline(), parse_header()
+ *  and of the buf_t functions. The stubs answer nothing; the error responses
+ *  of the parser itself are dropped after each capture.
+ *
+ *  The objects of the server are linked with --wrap, see the Makefile, so that
+ *  their calls to malloc(), realloc(), free(), strdup() and to the copying
+ *  functions are counted here. Copies inside libc, e.g. the one of strdup(),
+ *  are counted by the wrapper of the caller.
+ *
+ *  The result is one JSON object on stdout, with per request: the time in ns,
+ *  the allocations, frees, reallocations and bytes copied.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "../src/config.h"
+#include "../src/io.h"
+#include "../src/http_client.h"
+#include "../src/http_parser.h"
+#include "../src/request_handler.h"
+
+#define MAX_CAPTURE (64 * 1024)
+
+/** @brief Counters of the wrappers */
+typedef struct {
+    unsigned long allocs;           //<!malloc(), calloc(), strdup()
+    unsigned long frees;
+    unsigned long reallocs;         //<!buffers grown or shrunk
+    unsigned long long copied;      //<!bytes copied by memcpy() and the like
+} counters_t;
+
+static counters_t counters;
+static unsigned long handled;       //<!requests given to a handler
+
+static double seconds = 1;
+static char *corpus_dir = "bench/corpus";
+
+/* Captures of the corpus */
+static char *captures[] = { "curl", "browser", "post_form", "chunked",
+                            "pipelined" };
+/* Segment sizes. 0 feeds a capture whole */
+static int steps[] = { 0, 16, 1 };
+
+static struct option long_options[] = {
+    { "duration", required_argument, NULL, 'd' },
+    { "corpus", required_argument, NULL, 'c' },
+    { NULL, 0, NULL, 0 }
+};
+
+/*
+ * Wrappers of the calls made by the objects of the server. The __real_
+ * functions are the ones of libc.
+ */
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+char* __real_strdup(const char *s);
+void* __real_memcpy(void *dst, const void *src, size_t n);
+void* __real_memmove(void *dst, const void *src, size_t n);
+char* __real_strcpy(char *dst, const char *src);
+char* __real_strncpy(char *dst, const char *src, size_t n);
+
+void* __wrap_malloc(size_t size) {
+    counters.allocs += 1;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+    counters.allocs += 1;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    if (ptr == NULL)
+        counters.allocs += 1;
+    else
+        counters.reallocs += 1;
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr) {
+    if (ptr != NULL)
+        counters.frees += 1;
+    __real_free(ptr);
+}
+
+char* __wrap_strdup(const char *s) {
+    counters.allocs += 1;
+    counters.copied += strlen(s) + 1;
+    return __real_strdup(s);
+}
+
+void* __wrap_memcpy(void *dst, const void *src, size_t n) {
+    counters.copied += n;
+    return __real_memcpy(dst, src, n);
+}
+
+void* __wrap_memmove(void *dst, const void *src, size_t n) {
+    counters.copied += n;
+    return __real_memmove(dst, src, n);
+}
+
+char* __wrap_strcpy(char *dst, const char *src) {
+    counters.copied += strlen(src) + 1;
+    return __real_strcpy(dst, src);
+}
+
+/* strncpy() writes n bytes, padding with '\0' */
+char* __wrap_strncpy(char *dst, const char *src, size_t n) {
+    counters.copied += n;
+    return __real_strncpy(dst, src, n);
+}
+
+/*
+ * Stubs of the request handlers: the request is counted and the client is
+ * ready for the next one.
+ */
+int handle_get(http_client_t *client) {
+    handled += 1;
+    client->status = C_IDLE;
+    return 0;
+}
+
+int handle_head(http_client_t *client) {
+    handled += 1;
+    client->status = C_IDLE;
+    return 0;
+}
+
+int handle_post(http_client_t *client) {
+    handled += 1;
+    client->status = C_IDLE;
+    return 0;
+}
+
+int precheck_post(http_client_t *client) {
+    return 0;
+}
+
+char** setup_envp(http_client_t* client) {
+    return NULL;
+}
+
+void free_envp(char **envp) {
+}
+
+int cgi_launch(http_client_t *client, pid_t *pid_out) {
+    return -1;
+}
+
+/** @brief Nanoseconds from a to b */
+static long long elapsed_ns(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+/** @brief Read a capture of the corpus
+ *
+ *  @return Its length. -1 if it cannot be read
+ */
+static int load(char *name, char *data) {
+    char path[1024];
+    int fd, len;
+
+    snprintf(path, sizeof(path), "%s/%s.txt", corpus_dir, name);
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        perror(path);
+        return -1;
+    }
+    len = read(fd, data, MAX_CAPTURE);
+    close(fd);
+    return len;
+}
+
+/** @brief Run the parser like the server loop, until it needs more data
+ *
+ *  @return 0 if ok. -1 if the parser failed
+ */
+static int parse(http_client_t *client) {
+    int pos, status;
+
+    while (client->in->pos < client->in->datasize) {
+        pos = client->in->pos;
+        status = client->status;
+        if (http_parse(client) == -1)
+            return -1;
+        if (client->in->pos == pos && client->status == status)
+            break;
+    }
+    if (empty(client->in))
+        io_shrink(client->in);
+    return 0;
+}
+
+/** @brief Feed a capture to a client, step bytes at a time
+ *
+ *  @return 0 if ok. -1 if the parser failed
+ */
+static int feed(http_client_t *client, char *data, int len, int step) {
+    int off, n;
+
+    for (off = 0; off < len; off += n) {
+        n = step == 0 || len - off < step ? len - off : step;
+        buf_write(client->in, data + off, n);
+        if (parse(client) == -1)
+            return -1;
+    }
+
+    // Drop the error responses, and log what they had
+    access_sent(client, client->bytes_written - client->bytes_sent);
+    client->out->pos = client->out->datasize = 0;
+    return 0;
+}
+
+/** @brief Benchmark a capture fed in steps of a size
+ *
+ *  Each run goes on the same client, like requests on a keep-alive
+ *  connection. The first runs warm the buffers up and are not counted.
+ */
+static void bench(char *name, char *data, int len, int step, int first) {
+    struct timespec start, now;
+    http_client_t *client;
+    counters_t before;
+    unsigned long runs = 0, requests;
+    long long ns;
+    int i, fd;
+
+    fd = open("/dev/null", O_RDWR);
+    client = new_client(fd);
+    for (i = 0; i < 100; ++i)
+        if (feed(client, data, len, step) == -1) {
+            fprintf(stderr, "%s: the parser failed\n", name);
+            exit(EXIT_FAILURE);
+        }
+
+    before = counters;
+    handled = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (i = 0; i < 100; ++i)
+            feed(client, data, len, step);
+        runs += 100;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ns(&start, &now) < seconds * 1e9);
+    ns = elapsed_ns(&start, &now);
+
+    requests = handled > 0 ? handled : runs;
+    printf("%s  {\"capture\": \"%s\", \"step\": %d, \"bytes\": %d, "
+           "\"requests\": %lu, \"ns_per_request\": %.0f, "
+           "\"allocs_per_request\": %.2f, \"frees_per_request\": %.2f, "
+           "\"reallocs_per_request\": %.2f, \"copied_per_request\": %.0f}",
+           first ? "" : ",\n", name, step, len, requests,
+           (double)ns / requests,
+           (double)(counters.allocs - before.allocs) / requests,
+           (double)(counters.frees - before.frees) / requests,
+           (double)(counters.reallocs - before.reallocs) / requests,
+           (double)(counters.copied - before.copied) / requests);
+    fflush(stdout);
+
+    deinit_client(client);
+}
+
+int main(int argc, char* argv[]) {
+    static char data[MAX_CAPTURE];
+    int c, i, j, len;
+
+    while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'd': seconds = atof(optarg); break;
+        case 'c': corpus_dir = optarg; break;
+        default:
+            fprintf(stderr, "Usage: parsebench [--duration <s>] "
+                    "[--corpus <dir>]\n");
+            return 1;
+        }
+    }
+
+    // As in lisod.c
+    http_version = "HTTP/1.1";
+    conn_buf_limit = 1024;
+    total_buf_limit = 256;
+    access_log_format = "combined";
+
+    printf("{\"benchmark\": \"parser\", \"scenarios\": [\n");
+    for (i = 0; i < sizeof(captures) / sizeof(captures[0]); ++i) {
+        if ((len = load(captures[i], data)) == -1)
+            return 1;
+        for (j = 0; j < sizeof(steps) / sizeof(steps[0]); ++j)
+            bench(captures[i], data, len, steps[j], i == 0 && j == 0);
+    }
+    printf("\n]}\n");
+    return 0;
+}
@@ -0,0 +1,79 @@
+#!/bin/bash
+# Benchmark scenarios: start lisod on loopback and load it with loadgen
+#
+# Usage: bench/run.sh [scenario...]     (from the top directory, see make bench)
+#
+# Prints a JSON object with a result per scenario, see bench/loadgen.c. The
+# environment may set:
+#   BENCH_SECONDS   duration of each scenario(default 5)
+#   BENCH_PORT      HTTP port, HTTPS is the next one(default 18480)
+#   LISOD_OPTS      options of lisod, e.g. "--io-engine uring"
+set -e
+
+seconds=${BENCH_SECONDS:-5}
+port=${BENCH_PORT:-18480}
+tls_port=$((port + 1))
+top=$(pwd)
+dir=$(mktemp -d)
+
+stop() {
+    if [ -s "$dir/lisod.lock" ]; then
+        pid=$(cat "$dir/lisod.lock")
+        kill $pid 2>/dev/null
+        while kill -0 $pid 2>/dev/null; do sleep 0.1; done
+    fi
+    rm -rf "$dir"
+}
+trap stop EXIT
+
+mkdir "$dir/www"
+head -c 1024 /dev/zero | tr '\0' 'a' > "$dir/www/small.html"
+head -c $((16 * 1024 * 1024)) /dev/urandom > "$dir/www/large.bin"
+# The key in the top directory is too weak for current OpenSSL
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+    -keyout "$dir/key.pem" -out "$dir/cert.pem" 2>/dev/null
+
+./lisod $LISOD_OPTS $port $tls_port "$dir/lisod.log" "$dir/lisod.lock" \
+    "$dir/www" "$top/bench/cgi.py" "$dir/key.pem" "$dir/cert.pem"
+i=0
+while ! (exec 3<>/dev/tcp/127.0.0.1/$port) 2>/dev/null; do
+    i=$((i + 1))
+    [ $i -lt 50 ] || { echo "lisod did not start" >&2; exit 1; }
+    sleep 0.1
+done
+
+# name, then loadgen options
+scenario() {
+    name=$1
+    shift
+    ./bench/loadgen --name "$name" --duration "$seconds" "$@"
+}
+
+run() {
+    case $1 in
+    small_keepalive) scenario $1 --port $port --connections 32 /small.html ;;
+    small_close) scenario $1 --port $port --connections 32 --close /small.html ;;
+    small_pipeline) scenario $1 --port $port --connections 32 --pipeline 16 /small.html ;;
+    large_file) scenario $1 --port $port --connections 8 /large.bin ;;
+    cgi_get) scenario $1 --port $port --connections 8 "/cgi/bench?x=1" ;;
+    cgi_post) scenario $1 --port $port --connections 8 --post 4096 /cgi/bench ;;
+    https_keepalive) scenario $1 --port $tls_port --connections 32 --tls /small.html ;;
+    https_full) scenario $1 --port $tls_port --connections 16 --tls --close /small.html ;;
+    https_resumed)
+        scenario $1 --port $tls_port --connections 16 --tls --close --resume /small.html ;;
+    *) echo "Unknown scenario $1" >&2; exit 1 ;;
+    esac
+}
+
+[ $# -gt 0 ] || set -- small_keepalive small_close small_pipeline large_file \
+    cgi_get cgi_post https_keepalive https_full https_resumed
+
+printf '{"build": "%s", "lisod_opts": "%s", "scenarios": [\n' \
+    "$(git describe --always --dirty 2>/dev/null || echo unknown)" "$LISOD_OPTS"
+sep=""
+for s in "$@"; do
+    printf '%s  %s' "$sep" "$(run $s)"
+    sep=",
+"
+done
+printf '\n]}\n'
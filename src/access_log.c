@@ -0,0 +1,284 @@
+/** @file access_log.c
+ *  @brief Access log, written when a response has been sent
+ *
+ *  A record is opened when the response of a request starts, i.e. its status
+ *  line is written or a CGI script is given the request, and closed when the
+ *  whole response is in the output of the connection. Responses are queued in
+ *  order(see the pipe queue in http_client.c), so each one is a range of the
+ *  output of the connection: from begin to end, counted by bytes_written.
+ *  A CGI response is closed when its pipe reaches EOF, since its length is
+ *  unknown before. As bytes_sent grows, the records whose first byte went out
+ *  get their time to first byte, and those whose last byte went out are
+ *  written to the log.
+ *
+ *  Records are kept without --access-log too, since the method, the status
+ *  and the total time of every response are counted in metrics.c. Then the
+ *  request line and headers are not copied.
+ *
+ *  The record goes through the ring of log.c, so writing it costs no system
+ *  call on the server loop. Only TCP_INFO is read with getsockopt(), for the
+ *  RTT and the retransmissions of the connection.
+ *
+ *  The combined format is the one of Apache, followed by the time to first
+ *  byte and the total time in microseconds, whether the TLS session was
+ *  resumed, the RTT in microseconds and the retransmitted segments:
+ *
+ *  127.0.0.1 - - [10/Oct/2026:13:55:36 +0000] "GET / HTTP/1.1" 200 2326
+ *  "-" "curl/8.0" ttfb=120 total=135 resumed=0 rtt=45 retrans=0
+ *
+ *  The binary format is a sequence of access_bin_t records.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include "config.h"
+#include "log.h"
+#include "http_client.h"
+#include "access_log.h"
+#include "metrics.h"
+#include "probes.h"
+
+/** @brief Microseconds from a to b */
+static long long elapsed_us(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000LL +
+           (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/** @brief A copy of a request header. NULL if there is none */
+static char* copy_header(http_request_t *req, char *key) {
+    char *val = get_request_header(req, key);
+
+    return val == NULL ? NULL : strdup(val);
+}
+
+/** @brief Copy a string for a quoted field, "-" if NULL
+ *
+ *  Quotes and backslashes are escaped, control characters replaced.
+ */
+static void quote(char *dst, char *src, int size) {
+    int i = 0;
+
+    if (src == NULL)
+        src = "-";
+    for (; *src != '\0' && i < size - 2; ++src) {
+        if (*src == '"' || *src == '\\')
+            dst[i++] = '\\';
+        dst[i++] = (unsigned char)*src < 0x20 ? '?' : *src;
+    }
+    dst[i] = '\0';
+}
+
+/** @brief Count a finished record, and write it to the log
+ *
+ *  @param incomplete The connection closed before the response was sent
+ */
+static void emit(http_client_t *client, access_rec_t *rec,
+                 struct timespec *now, int incomplete) {
+    char buf[LOG_LINE_MAX], line[512], referer[128], agent[256], stamp[64],
+         status[8];
+    access_bin_t *bin = (access_bin_t *)buf;
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    long long bytes, ttfb, total;
+    int resumed, len;
+    struct tm tm;
+
+    bytes = (rec->end == -1 || rec->end > client->bytes_sent ?
+             client->bytes_sent : rec->end) - rec->begin;
+    if (bytes < 0)
+        bytes = 0;
+    total = elapsed_us(&rec->start, now);
+    PROBE4(response_done, client->fd, rec->id, rec->status, bytes);
+    metrics_response(rec->method, rec->status, total);
+    if (access_log_file == NULL)
+        return;
+
+    ttfb = rec->first_byte.tv_sec == 0 ? total :
+           elapsed_us(&rec->start, &rec->first_byte);
+    resumed = client->ssl_context != NULL &&
+              SSL_session_reused(client->ssl_context);
+
+    memset(&info, 0, sizeof(info));
+    getsockopt(client->fd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+
+    if (strcmp(access_log_format, "binary") == 0) {
+        len = rec->line == NULL ? 0 : strlen(rec->line);
+        if (len > LOG_LINE_MAX - sizeof(access_bin_t))
+            len = LOG_LINE_MAX - sizeof(access_bin_t);
+        memset(bin, 0, sizeof(access_bin_t));
+        bin->size = sizeof(access_bin_t) + len;
+        bin->status = rec->status;
+        bin->method = rec->method < 0 ? 255 : rec->method;
+        bin->flags = (client->ssl_context != NULL ? ACCESS_TLS : 0) |
+                     (resumed ? ACCESS_RESUMED : 0) |
+                     (incomplete ? ACCESS_INCOMPLETE : 0);
+        bin->line_len = len;
+        bin->addr = ntohl(client->remote_addr.s_addr);
+        bin->time = rec->received;
+        bin->bytes = bytes;
+        bin->ttfb_us = ttfb;
+        bin->total_us = total;
+        bin->rtt_us = info.tcpi_rtt;
+        bin->retrans = info.tcpi_total_retrans;
+        if (len > 0)
+            memcpy(buf + sizeof(access_bin_t), rec->line, len);
+        log_access(buf, bin->size);
+        return;
+    }
+
+    localtime_r(&rec->received, &tm);
+    strftime(stamp, sizeof(stamp), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    if (rec->status == 0)
+        strcpy(status, "-");
+    else
+        snprintf(status, sizeof(status), "%d", rec->status);
+    quote(line, rec->line, sizeof(line));
+    quote(referer, rec->referer, sizeof(referer));
+    quote(agent, rec->agent, sizeof(agent));
+
+    len = snprintf(buf, sizeof(buf), "%s - - [%s] \"%s\" %s %lld \"%s\" \"%s\" "
+                   "ttfb=%lld total=%lld resumed=%d rtt=%u retrans=%u%s\n",
+                   client->remote_ip, stamp, line, status, bytes, referer,
+                   agent, ttfb, total, resumed, info.tcpi_rtt,
+                   info.tcpi_total_retrans, incomplete ? " incomplete" : "");
+    log_access(buf, len < sizeof(buf) ? len : sizeof(buf) - 1);
+}
+
+/** @brief Free a record */
+static void free_rec(access_rec_t *rec) {
+    free(rec->line);
+    free(rec->referer);
+    free(rec->agent);
+    free(rec);
+}
+
+/** @brief Time the first bytes and log the responses sent completely */
+static void progress(http_client_t *client) {
+    access_rec_t *rec;
+    struct timespec now;
+
+    if (client->access_head == NULL)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (rec = client->access_head; rec != NULL &&
+         rec->begin < client->bytes_sent; rec = rec->next)
+        if (rec->first_byte.tv_sec == 0) {
+            rec->first_byte = now;
+            PROBE2(first_byte, client->fd, rec->id);
+        }
+
+    while ((rec = client->access_head) != NULL && rec->end != -1 &&
+           rec->end <= client->bytes_sent) {
+        emit(client, rec, &now, 0);
+        client->access_head = rec->next;
+        if (client->access_head == NULL)
+            client->access_tail = NULL;
+        free_rec(rec);
+    }
+}
+
+/** @brief The response of the current request starts
+ *
+ *  If the response was started already, e.g. a CGI request which fails
+ *  before the script runs, only the status is set.
+ *
+ *  @param status HTTP status code. 0 if not known yet
+ */
+void access_open(http_client_t *client, int status) {
+    http_request_t *req = client->req;
+    access_rec_t *rec = client->access_tail;
+
+    if (rec != NULL && rec->end == -1) {
+        if (status != 0)
+            rec->status = status;
+        return;
+    }
+
+    rec = calloc(1, sizeof(access_rec_t));
+    rec->status = status;
+    rec->method = -1;
+    rec->begin = client->bytes_written;
+    rec->end = -1;
+    /* An error before the request line is read answers no request */
+    if (req != NULL && !req->logged) {
+        req->logged = 1;
+        rec->method = req->method;
+        rec->id = req->id;
+        if (access_log_file != NULL) {
+            rec->line = strdup(req->line);
+            rec->referer = copy_header(req, "Referer");
+            rec->agent = copy_header(req, "User-Agent");
+        }
+        rec->received = req->received;
+        rec->start = req->start;
+    } else {
+        rec->received = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &rec->start);
+    }
+
+    if (client->access_tail == NULL)
+        client->access_head = rec;
+    else
+        client->access_tail->next = rec;
+    client->access_tail = rec;
+}
+
+/** @brief The response of the current request is all in the output */
+void access_close(http_client_t *client) {
+    access_rec_t *rec = client->access_tail;
+
+    if (rec == NULL || rec->end != -1)
+        return;
+    rec->end = client->bytes_written;
+    progress(client);
+}
+
+/** @brief n more bytes of the output were sent to the client */
+void access_sent(http_client_t *client, long long n) {
+    client->bytes_sent += n;
+    metrics_get()->bytes_out += n;
+    progress(client);
+}
+
+/** @brief Find the status of a response produced by a CGI script
+ *
+ *  @param buf, len The first bytes of the output of the script
+ */
+void access_sniff(http_client_t *client, char *buf, int len) {
+    access_rec_t *rec = client->access_tail;
+    char head[32];
+    int status;
+
+    if (rec == NULL || rec->end != -1 || rec->status != 0 || len <= 0)
+        return;
+
+    if (len > sizeof(head) - 1)
+        len = sizeof(head) - 1;
+    memcpy(head, buf, len);
+    head[len] = '\0';
+    if (sscanf(head, "HTTP/%*s %d", &status) == 1 ||
+        sscanf(head, "Status: %d", &status) == 1)
+        rec->status = status;
+}
+
+/** @brief The connection is closing. Log the responses left as incomplete */
+void access_finish(http_client_t *client) {
+    access_rec_t *rec;
+    struct timespec now;
+
+    progress(client);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while ((rec = client->access_head) != NULL) {
+        emit(client, rec, &now, 1);
+        client->access_head = rec->next;
+        free_rec(rec);
+    }
+    client->access_tail = NULL;
+}
@@ -0,0 +1,63 @@
+/** @file access_log.h
+ *  @brief Access log, written when a response has been sent
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __ACCESS_LOG_H__
+#define __ACCESS_LOG_H__
+
+#include <stdint.h>
+#include <time.h>
+
+struct http_client;
+
+/** @brief A response on its way to the client
+ *
+ *  begin and end are offsets in the output of the connection, counted by
+ *  bytes_written and bytes_sent of the client.
+ */
+typedef struct access_rec {
+    int status;                 //<!0 until known, e.g. CGI output not seen
+    int method;                 //<!M_GET... -1 if the request line is bad
+    unsigned long id;           //<!id of the request. 0 if there is none
+    char *line;                 //<!request line. NULL if there is none
+    char *referer, *agent;      //<!headers for the combined format
+    time_t received;            //<!wall clock time of the request line
+    struct timespec start;      //<!when the request line was read
+    struct timespec first_byte; //<!when the first byte was sent. 0 if not yet
+    long long begin;            //<!offset of the first byte of the response
+    long long end;              //<!offset after the last byte. -1 if unknown
+    struct access_rec *next;
+} access_rec_t;
+
+/* flags of a binary record */
+#define ACCESS_TLS 0x1          //The connection is HTTPS
+#define ACCESS_RESUMED 0x2      //The TLS session was resumed
+#define ACCESS_INCOMPLETE 0x4   //The connection closed before the end
+
+/** @brief A record of the binary format, in host byte order
+ *
+ *  It is followed by line_len bytes of the request line.
+ */
+typedef struct {
+    uint16_t size;              //<!size of the record, request line included
+    uint16_t status;
+    uint8_t method;             //<!M_GET, M_HEAD, M_POST. 255 if unknown
+    uint8_t flags;
+    uint16_t line_len;
+    uint32_t addr;              //<!IPv4 address of the client
+    uint32_t time;              //<!unix time of the request line
+    uint64_t bytes;             //<!bytes of the response sent
+    uint32_t ttfb_us;           //<!request line to first byte sent
+    uint32_t total_us;          //<!request line to last byte sent
+    uint32_t rtt_us;            //<!smoothed RTT from TCP_INFO
+    uint32_t retrans;           //<!retransmitted segments of the connection
+} access_bin_t;
+
+void access_open(struct http_client *client, int status);
+void access_close(struct http_client *client);
+void access_sent(struct http_client *client, long long n);
+void access_sniff(struct http_client *client, char *buf, int len);
+void access_finish(struct http_client *client);
+
+#endif
@@ -0,0 +1,322 @@
+/** @file admin.c
+ *  @brief Admin commands on a UNIX socket
+ *
+ *  With --admin-socket, the server listens on a UNIX socket, readable by its
+ *  user only, for commands of one line each. They let a running server be
+ *  looked at and tuned without a restart:
+ *
+ *  connections         one line per connection: fd, remote ip, status,
+ *                      buffered input and output, queued pipes, age and the
+ *                      request in progress
+ *  log-mask [mask]     show the log mask, or set it. mask is a number, or
+ *                      names among error, info, io and http separated by ','
+ *  drain               refuse new connections, close the clients once their
+ *                      responses are sent, then exit
+ *  stats               the counters of /server-status
+ *  help, quit
+ *
+ *  For example: echo connections | socat - UNIX-CONNECT:/run/lisod.sock
+ *
+ *  The socket is served by the server loop like the clients, without
+ *  blocking. A command runs when its line is complete, its output is sent as
+ *  the socket takes it.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#define _GNU_SOURCE         // accept4
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "config.h"
+#include "log.h"
+#include "io.h"
+#include "http_client.h"
+#include "server.h"
+#include "metrics.h"
+#include "admin.h"
+
+static int listen_fd = -1;
+static admin_conn_t conns[ADMIN_MAX_CONNS];
+
+/* Names of the bits of log_mask */
+static char *mask_names[] = { "error", "info", "io", "http" };
+static int mask_bits[] = { L_ERROR, L_INFO, L_IO_DEBUG, L_HTTP_DEBUG };
+
+/** @brief Write the log mask, as a number and by names */
+static void show_log_mask(buf_t *out) {
+    int i, first = 1;
+
+    bprintf(out, "log-mask 0x%x", log_mask);
+    for (i = 0; i < sizeof(mask_bits) / sizeof(mask_bits[0]); ++i)
+        if (log_mask & mask_bits[i]) {
+            bprintf(out, "%s%s", first ? " " : ",", mask_names[i]);
+            first = 0;
+        }
+    bprintf(out, "\n");
+}
+
+/** @brief Parse a log mask: a number, or names separated by ','
+ *
+ *  @return The mask. -1 if a name is unknown
+ */
+static int parse_log_mask(char *arg) {
+    char *name, *end;
+    int i, mask;
+
+    mask = strtol(arg, &end, 0);
+    if (end != arg && *end == '\0')
+        return mask;
+
+    mask = 0;
+    for (name = strtok(arg, ","); name != NULL; name = strtok(NULL, ",")) {
+        for (i = 0; i < sizeof(mask_bits) / sizeof(mask_bits[0]); ++i)
+            if (strcasecmp(name, mask_names[i]) == 0)
+                break;
+        if (i == sizeof(mask_bits) / sizeof(mask_bits[0]))
+            return -1;
+        mask |= mask_bits[i];
+    }
+    return mask;
+}
+
+/** @brief One line per connection */
+static void show_connections(buf_t *out) {
+    http_client_t *client;
+    struct timespec now;
+    char *line;
+    int fd;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bprintf(out, "%d connections%s\n", client_count(),
+            server_draining() ? ", draining" : "");
+    bprintf(out, "%5s %-15s %-9s %3s %-15s %-15s %5s %9s  %s\n", "fd", "remote",
+            "status", "tls", "in", "out", "pipes", "age(s)", "request");
+
+    for (fd = 0; fd < FD_SETSIZE; ++fd) {
+        client = client_lookup(fd);
+        if (client == NULL || client->fd != fd)
+            continue;
+
+        // The line of the request being parsed or answered
+        line = client->status == C_IDLE || client->status == C_HANDSHAKE ||
+               client->req->line[0] == '\0' ? "-" : client->req->line;
+        bprintf(out, "%5d %-15s %-9s %3s %7d/%-7d %7d/%-7d %5d %9.1f  %s\n",
+                fd, client->remote_ip, client_status_name(client->status),
+                client->ssl_context != NULL ? "yes" : "no",
+                client->in->datasize - client->in->pos, client->in->bufsize,
+                client->out->datasize - client->out->pos, client->out->bufsize,
+                client->npipes,
+                (now.tv_sec - client->since.tv_sec) +
+                (now.tv_nsec - client->since.tv_nsec) / 1e9, line);
+    }
+}
+
+/** @brief Run a command line, its output goes to the connection */
+static void run_command(admin_conn_t *conn, char *line) {
+    buf_t *out = conn->out;
+    char *cmd, *arg;
+    int mask;
+
+    cmd = strtok(line, " \t");
+    arg = strtok(NULL, " \t");
+    if (cmd == NULL)
+        return;
+    log_msg(L_INFO, "Admin command: %s %s\n", cmd, arg != NULL ? arg : "");
+
+    if (strcmp(cmd, "connections") == 0)
+        show_connections(out);
+    else if (strcmp(cmd, "log-mask") == 0) {
+        if (arg != NULL) {
+            if ((mask = parse_log_mask(arg)) == -1) {
+                bprintf(out, "error: unknown log type, use a number or "
+                        "error,info,io,http\n");
+                return;
+            }
+            log_mask = mask;
+        }
+        show_log_mask(out);
+    } else if (strcmp(cmd, "drain") == 0)
+        bprintf(out, "draining, %d connections left\n", server_drain());
+    else if (strcmp(cmd, "stats") == 0)
+        metrics_status(out);
+    else if (strcmp(cmd, "help") == 0)
+        bprintf(out, "connections | log-mask [mask] | drain | stats | quit\n");
+    else if (strcmp(cmd, "quit") == 0)
+        conn->eof = 1;
+    else
+        bprintf(out, "error: unknown command %s, try help\n", cmd);
+}
+
+/** @brief Run the complete lines received on a connection
+ *
+ *  @return 0 if ok. -1 if a line is too long
+ */
+static int run_commands(admin_conn_t *conn) {
+    buf_t *in = conn->in;
+    char line[ADMIN_LINE_MAX], *nl;
+    int len;
+
+    while (!conn->eof && in->pos < in->datasize) {
+        nl = memchr(in->buf + in->pos, '\n', in->datasize - in->pos);
+        if (nl == NULL)
+            return in->datasize - in->pos < ADMIN_LINE_MAX ? 0 : -1;
+
+        len = nl - (in->buf + in->pos);
+        if (len >= ADMIN_LINE_MAX)
+            return -1;
+        memcpy(line, in->buf + in->pos, len);
+        line[len] = '\0';
+        if (len > 0 && line[len - 1] == '\r')
+            line[len - 1] = '\0';
+        in->pos += len + 1;
+        run_command(conn, line);
+    }
+
+    if (empty(in))
+        io_shrink(in);
+    return 0;
+}
+
+static void close_conn(admin_conn_t *conn) {
+    remove_read_fd(conn->fd);
+    remove_write_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    deinit_buf(conn->in);
+    deinit_buf(conn->out);
+}
+
+/** @brief Give an accepted connection a free slot, or close it */
+static void admin_accept(int fd) {
+    static char busy[] = "error: too many admin connections\n";
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CONNS; ++i)
+        if (conns[i].fd == -1) {
+            conns[i].fd = fd;
+            conns[i].in = init_buf();
+            conns[i].out = init_buf();
+            conns[i].eof = 0;
+            add_read_fd(fd);
+            return;
+        }
+
+    if (write(fd, busy, sizeof(busy) - 1) == -1)
+        log_error("Failed answering an admin connection");
+    close(fd);
+}
+
+/** @brief Listen on admin_socket(see config.h)
+ *
+ *  A socket left there by a previous run is replaced. The socket is readable
+ *  and writable by the user of the server only.
+ *
+ *  @return 0 if success. -1 if error
+ */
+int admin_init() {
+    struct sockaddr_un addr;
+    struct stat st;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX_CONNS; ++i)
+        conns[i].fd = -1;
+
+    if (strlen(admin_socket) >= sizeof(addr.sun_path)) {
+        log_msg(L_ERROR, "Admin socket path too long: %s\n", admin_socket);
+        return -1;
+    }
+    if (lstat(admin_socket, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(admin_socket);
+
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            0)) == -1) {
+        log_error("Failed creating admin socket.");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, admin_socket);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        chmod(admin_socket, 0600) == -1 ||
+        listen(listen_fd, ADMIN_MAX_CONNS) == -1) {
+        log_error("Failed setting up admin socket.");
+        close(listen_fd);
+        listen_fd = -1;
+        return -1;
+    }
+
+    add_read_fd(listen_fd);
+    log_msg(L_INFO, "Admin commands on %s\n", admin_socket);
+    return 0;
+}
+
+/** @brief Accept admin connections, run their commands and send the output
+ *
+ *  Called by the server loop after each select().
+ */
+void admin_process() {
+    admin_conn_t *conn;
+    int fd, i, n;
+
+    if (listen_fd == -1) return;
+
+    if (test_read_fd(listen_fd))
+        while ((fd = accept4(listen_fd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+            admin_accept(fd);
+
+    for (i = 0; i < ADMIN_MAX_CONNS; ++i) {
+        conn = conns + i;
+        if (conn->fd == -1) continue;
+
+        if (!conn->eof && test_read_fd(conn->fd)) {
+            n = io_recv(conn->fd, conn->in, NULL);
+            if (n == -1) {
+                close_conn(conn);
+                continue;
+            }
+            // Commands sent before the end are still run
+            if (run_commands(conn) == -1) {
+                bprintf(conn->out, "error: line too long\n");
+                conn->eof = 1;
+            }
+            if (n == 0)
+                conn->eof = 1;
+            if (conn->eof)
+                remove_read_fd(conn->fd);
+        }
+
+        if (conn->out->pos < conn->out->datasize &&
+            io_send(conn->fd, conn->out, NULL) == -1) {
+            close_conn(conn);
+            continue;
+        }
+        if (conn->out->pos < conn->out->datasize)
+            add_write_fd(conn->fd);
+        else if (conn->eof)
+            close_conn(conn);
+        else
+            remove_write_fd(conn->fd);
+    }
+}
+
+/** @brief Close the admin connections and remove the socket */
+void admin_finalize() {
+    int i;
+
+    if (listen_fd == -1) return;
+
+    for (i = 0; i < ADMIN_MAX_CONNS; ++i)
+        if (conns[i].fd != -1)
+            close_conn(conns + i);
+    remove_read_fd(listen_fd);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(admin_socket);
+}
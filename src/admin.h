@@ -0,0 +1,25 @@
+/** @file admin.h
+ *  @brief Admin commands on a UNIX socket
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "io.h"
+
+#define ADMIN_MAX_CONNS 4       //Admin connections at the same time
+#define ADMIN_LINE_MAX 256      //Longest command line
+
+/** @brief A connection to the admin socket */
+typedef struct {
+    int fd;             //<!-1 if the slot is free
+    buf_t *in, *out;
+    int eof;            //<!the peer is done, close once out is sent
+} admin_conn_t;
+
+int admin_init();
+void admin_process();
+void admin_finalize();
+
+#endif
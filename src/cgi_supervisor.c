@@ -0,0 +1,282 @@
+/** @file cgi_supervisor.c
+ *  @brief Limit, queue and watch the CGI processes
+ *
+ *  At most cgi_max_children scripts run at the same time. Requests beyond
+ *  that wait in a FIFO queue of at most cgi_queue_len entries. When the queue
+ *  is full, the request is answered with 503.
+ *
+ *  Each script gets a wall-clock deadline of cgi_timeout seconds. A script
+ *  still running after its deadline is killed, and its client connection is
+ *  closed once the output pipe reaches EOF. CPU time and address space of
+ *  a script are limited by cgi_cpu_limit and cgi_mem_limit, set by
+ *  cgi_launch() before the script starts.
+ *
+ *  Terminated children are reaped here, from the server loop, so the
+ *  supervisor knows which slot becomes free. The SIGCHLD handler only
+ *  interrupts select().
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "config.h"
+#include "log.h"
+#include "http_client.h"
+#include "request_handler.h"
+#include "cgi_supervisor.h"
+
+static cgi_proc_t *procs = NULL;
+static cgi_waiter_t *queue_head = NULL, *queue_tail = NULL;
+static cgi_stats_t stats;
+
+/** @brief Microseconds from a to b */
+static long long elapsed_us(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000LL +
+           (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/** @brief Launch the script for a client and start watching it
+ *
+ *  @return 0 if ok. HTTP status code if something goes wrong
+ */
+static int start(http_client_t *client) {
+    cgi_proc_t *proc;
+    pid_t pid;
+    int ret;
+
+    if ((ret = cgi_launch(client, &pid)) != 0)
+        return ret;
+
+    proc = malloc(sizeof(cgi_proc_t));
+    proc->pid = pid;
+    proc->client = client;
+    proc->killed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &proc->start);
+    proc->deadline = proc->start;
+    proc->deadline.tv_sec += cgi_timeout;
+    proc->next = procs;
+    procs = proc;
+
+    stats.running += 1;
+    stats.launched += 1;
+    return 0;
+}
+
+/** @brief Submit a CGI request
+ *
+ *  The script is launched at once if there is a free slot. Otherwise the
+ *  request is queued and the client waits in C_PIPING status.
+ *
+ *  @return 0 if the script is launched or the request is queued. HTTP status
+ *          code if something goes wrong
+ */
+int cgi_submit(http_client_t *client) {
+    cgi_waiter_t *waiter;
+
+    if (stats.running < cgi_max_children && queue_head == NULL)
+        return start(client);
+
+    if (stats.queued >= cgi_queue_len) {
+        log_msg(L_ERROR, "CGI queue full, %d waiting\n", stats.queued);
+        stats.rejected += 1;
+        return SERVICE_UNAVAILABLE;
+    }
+
+    waiter = malloc(sizeof(cgi_waiter_t));
+    waiter->client = client;
+    /*
+     * The body points into the input buffer of the client, which may be
+     * moved before the request leaves the queue.
+     */
+    waiter->body = NULL;
+    if (client->req->method == M_POST) {
+        waiter->body = malloc(client->req->content_length + 1);
+        memcpy(waiter->body, client->req->body, client->req->content_length);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &waiter->enqueued);
+    waiter->next = NULL;
+
+    if (queue_tail == NULL)
+        queue_head = waiter;
+    else
+        queue_tail->next = waiter;
+    queue_tail = waiter;
+
+    stats.queued += 1;
+    if (stats.queued > stats.max_queued)
+        stats.max_queued = stats.queued;
+
+    log_msg(L_INFO, "CGI request queued, %d waiting\n", stats.queued);
+    return 0;
+}
+
+/** @brief Launch queued requests while there are free slots */
+static void start_waiting() {
+    cgi_waiter_t *waiter;
+    http_client_t *client;
+    struct timespec now;
+    long long wait_us;
+    int ret;
+
+    while (queue_head != NULL && stats.running < cgi_max_children) {
+        waiter = queue_head;
+        queue_head = waiter->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        stats.queued -= 1;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_us = elapsed_us(&waiter->enqueued, &now);
+        stats.wait_us += wait_us;
+        if (wait_us > stats.max_wait_us)
+            stats.max_wait_us = wait_us;
+
+        client = waiter->client;
+        client->req->body = waiter->body;
+        if ((ret = start(client)) != 0)
+            end_request(client, ret);
+        client->req->body = NULL;
+        client_wake(client);
+
+        free(waiter->body);
+        free(waiter);
+    }
+}
+
+/** @brief Reap terminated children and update the counters */
+static void reap() {
+    cgi_proc_t *proc, **link;
+    struct timespec now;
+    long long run_us;
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (link = &procs; *link != NULL; link = &(*link)->next)
+            if ((*link)->pid == pid)
+                break;
+
+        if ((proc = *link) == NULL) {
+            log_msg(L_INFO, "Reap child process %d\n", pid);
+            continue;
+        }
+        *link = proc->next;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        run_us = elapsed_us(&proc->start, &now);
+        stats.running -= 1;
+        stats.finished += 1;
+        stats.run_us += run_us;
+        if (run_us > stats.max_run_us)
+            stats.max_run_us = run_us;
+
+        log_msg(L_INFO, "Reap child process %d, ran %lld ms, %d running, "
+                "%d queued\n", pid, run_us / 1000, stats.running,
+                stats.queued);
+        free(proc);
+    }
+}
+
+/** @brief Kill scripts which have run past their deadline */
+static void kill_overdue() {
+    cgi_proc_t *proc;
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (proc = procs; proc != NULL; proc = proc->next) {
+        if (proc->killed || elapsed_us(&proc->deadline, &now) < 0)
+            continue;
+
+        log_msg(L_ERROR, "CGI process %d timed out, killed\n", proc->pid);
+        kill(proc->pid, SIGKILL);
+        proc->killed = 1;
+        stats.timed_out += 1;
+        /* The response is incomplete. Close once the pipe is drained */
+        if (proc->client != NULL) {
+            proc->client->alive = 0;
+            client_wake(proc->client);
+        }
+    }
+}
+
+/** @brief Reap, enforce deadlines and start queued requests
+ *
+ *  Called by the server loop after each select().
+ */
+void cgi_supervise() {
+    reap();
+    kill_overdue();
+    start_waiting();
+}
+
+/** @brief Time until the nearest deadline
+ *
+ *  @param timeout The struct which stores the time left
+ *  @return 1 if there is a deadline. 0 if no script is running
+ */
+int cgi_next_timeout(struct timeval *timeout) {
+    cgi_proc_t *proc;
+    struct timespec now;
+    long long left, min = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (proc = procs; proc != NULL; proc = proc->next) {
+        if (proc->killed) continue;
+        left = elapsed_us(&now, &proc->deadline);
+        if (left < 0) left = 0;
+        if (min == -1 || left < min)
+            min = left;
+    }
+
+    if (min == -1)
+        return 0;
+
+    timeout->tv_sec = min / 1000000;
+    timeout->tv_usec = min % 1000000;
+    return 1;
+}
+
+/** @brief Forget a client that is going away
+ *
+ *  A queued request is dropped. A running script is killed since nobody will
+ *  read its output.
+ */
+void cgi_detach(http_client_t *client) {
+    cgi_waiter_t *waiter, **link;
+    cgi_proc_t *proc;
+
+    for (link = &queue_head; *link != NULL; ) {
+        waiter = *link;
+        if (waiter->client != client) {
+            link = &waiter->next;
+            continue;
+        }
+        *link = waiter->next;
+        if (queue_tail == waiter)
+            queue_tail = NULL;
+        free(waiter->body);
+        free(waiter);
+        stats.queued -= 1;
+    }
+    /* Fix up the tail if the last element was removed */
+    if (queue_tail == NULL)
+        for (waiter = queue_head; waiter != NULL; waiter = waiter->next)
+            queue_tail = waiter;
+
+    for (proc = procs; proc != NULL; proc = proc->next) {
+        if (proc->client != client) continue;
+        proc->client = NULL;
+        if (!proc->killed) {
+            kill(proc->pid, SIGKILL);
+            proc->killed = 1;
+        }
+    }
+}
+
+/** @brief Get the counters */
+cgi_stats_t* cgi_get_stats() {
+    return &stats;
+}
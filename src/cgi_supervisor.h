@@ -0,0 +1,52 @@
+/** @file cgi_supervisor.h
+ *  @brief Limit, queue and watch the CGI processes
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __CGI_SUPERVISOR_H__
+#define __CGI_SUPERVISOR_H__
+
+#include <sys/types.h>
+#include <time.h>
+#include "http_client.h"
+
+/** @brief A running CGI process */
+typedef struct cgi_proc {
+    pid_t pid;
+    http_client_t *client;      //<!NULL if the client went away
+    struct timespec start;      //<!when the process was launched
+    struct timespec deadline;   //<!when the process will be killed
+    int killed;                 //<!SIGKILL has been sent
+    struct cgi_proc *next;
+} cgi_proc_t;
+
+/** @brief A request waiting for a free slot */
+typedef struct cgi_waiter {
+    http_client_t *client;
+    char *body;                 //<!copy of the request body
+    struct timespec enqueued;   //<!when the request was queued
+    struct cgi_waiter *next;
+} cgi_waiter_t;
+
+/** @brief Counters. Times are in microseconds */
+typedef struct {
+    int running;                //<!processes alive now
+    int queued;                 //<!requests waiting now
+    int max_queued;             //<!highest queue depth seen
+    long launched;              //<!processes launched
+    long rejected;              //<!requests refused with 503
+    long timed_out;             //<!processes killed for running too long
+    long finished;              //<!processes reaped
+    long long wait_us;          //<!total time spent in the queue
+    long long run_us;           //<!total run time of reaped processes
+    long long max_wait_us;
+    long long max_run_us;
+} cgi_stats_t;
+
+int cgi_submit(http_client_t *client);
+void cgi_supervise();
+int cgi_next_timeout(struct timeval *timeout);
+void cgi_detach(http_client_t *client);
+cgi_stats_t* cgi_get_stats();
+
+#endif
@@ -16,4 +16,41 @@ char *log_file_name,
      *private_key_file,
      *certificate_file;
 
+/* FastCGI. When fcgi_socket is NULL, CGI scripts are fork()ed */
+char *fcgi_socket;      //UNIX socket the FastCGI workers listen on
+int fcgi_conns;         //Number of persistent connections to the workers
+int fcgi_mpx;           //Maximum requests in flight on one connection
+
+/* CGI process supervision. See cgi_supervisor.c */
+int cgi_max_children;   //Maximum CGI processes running at the same time
+int cgi_queue_len;      //Maximum requests waiting for a free slot
+int cgi_timeout;        //Seconds a CGI process may run before being killed
+int cgi_cpu_limit;      //CPU seconds of a CGI process. 0 means unlimited
+int cgi_mem_limit;      //Address space of a CGI process in MB. 0: unlimited
+
+/* TLS session resumption. See tls.c */
+int tls_cache_size;     //Sessions kept in the server side cache
+int tls_ticket_rotate;  //Seconds before the session ticket key is replaced
+int tls_workers;        //Handshake worker threads. 0: handshake in the loop
+
+/* Client deadlines in seconds. See the timer wheel in timer.c */
+int keepalive_timeout;  //Idle time between two requests
+int header_timeout;     //Time to receive a whole request line and headers
+int body_timeout;       //Time without progress while receiving a body
+int write_timeout;      //Time without progress while sending a response
+
+/* Memory budgets of buffers. See may_read() in server.c */
+int conn_buf_limit;     //KB of pending input or output of a connection
+int total_buf_limit;    //MB held by all buffers of the server
+
+char *io_engine;        //"select" or "uring", how the server waits for fds
+
+/* Access log. See access_log.c */
+char *access_log_file;      //NULL: no access log
+char *access_log_format;    //"combined" or "binary"
+
+int server_status;      //Serve /server-status and /metrics. See metrics.c
+
+char *admin_socket;     //UNIX socket for admin commands. NULL: none. See admin.c
+
 #endif
\ No newline at end of file
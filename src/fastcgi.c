@@ -0,0 +1,525 @@
+/** @file fastcgi.c
+ *  @brief FastCGI client for /cgi/ requests
+ *
+ *  Instead of forking a process for each CGI request, the server keeps a
+ *  pool of persistent connections to FastCGI workers listening on a UNIX
+ *  socket(fcgi_socket in config.h). Each connection carries up to fcgi_mpx
+ *  requests at the same time, told apart by their request id.
+ *
+ *  A request is turned into BEGIN_REQUEST, PARAMS and STDIN records which are
+ *  queued in the output buffer of the connection. The server loop calls
+ *  fcgi_process() to send pending records and to read records coming back.
+ *  Content of STDOUT records is appended to the output buffer of the client
+ *  that owns the request id, so it is sent like any other response data.
+ *  END_REQUEST puts the client back to C_IDLE.
+ *
+ *  Like the fork()ed CGI scripts, workers are expected to write a complete
+ *  HTTP response(status line included) to their stdout, within cgi_timeout
+ *  seconds. A request which misses its deadline is aborted and answered
+ *  with 504, or its client is closed if the response has started. A worker
+ *  which does not end an aborted request within FCGI_ABORT_GRACE seconds is
+ *  taken as hung and its connection is closed, which frees the request ids.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "config.h"
+#include "log.h"
+#include "io.h"
+#include "http_client.h"
+#include "request_handler.h"
+#include "timer.h"
+#include "fastcgi.h"
+
+static fcgi_conn_t *pool = NULL;
+
+/** @brief Append a record to the output buffer of a connection
+ *
+ *  Content is padded to a multiple of 8 bytes as the specification
+ *  recommends.
+ */
+static void write_record(fcgi_conn_t *conn, int type, int id, char *content,
+                         int len) {
+    unsigned char header[FCGI_HEADER_LEN];
+    static char padding[8];
+    int padding_len = (8 - (len & 7)) & 7;
+
+    header[0] = FCGI_VERSION_1;
+    header[1] = type;
+    header[2] = (id >> 8) & 0xff;
+    header[3] = id & 0xff;
+    header[4] = (len >> 8) & 0xff;
+    header[5] = len & 0xff;
+    header[6] = padding_len;
+    header[7] = 0;
+
+    buf_write(conn->out, (char *)header, FCGI_HEADER_LEN);
+    if (len > 0)
+        buf_write(conn->out, content, len);
+    if (padding_len > 0)
+        buf_write(conn->out, padding, padding_len);
+}
+
+/** @brief Write a stream(PARAMS, STDIN) and its terminating empty record */
+static void write_stream(fcgi_conn_t *conn, int type, int id, char *data,
+                         int len) {
+    int n;
+
+    while (len > 0) {
+        n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+        write_record(conn, type, id, data, n);
+        data += n;
+        len -= n;
+    }
+    write_record(conn, type, id, NULL, 0);
+}
+
+/** @brief Encode the length of a name or a value in a name-value pair */
+static void write_length(buf_t *bp, int len) {
+    unsigned char b[4];
+
+    if (len < 128) {
+        b[0] = len;
+        buf_write(bp, (char *)b, 1);
+    } else {
+        b[0] = ((len >> 24) & 0x7f) | 0x80;
+        b[1] = (len >> 16) & 0xff;
+        b[2] = (len >> 8) & 0xff;
+        b[3] = len & 0xff;
+        buf_write(bp, (char *)b, 4);
+    }
+}
+
+/** @brief Encode a "NAME=VALUE" environment string as a name-value pair */
+static void write_param(buf_t *bp, char *env) {
+    char *val = strchr(env, '=');
+    int name_len, val_len;
+
+    if (val == NULL) return;
+    name_len = val - env;
+    val += 1;
+    val_len = strlen(val);
+
+    write_length(bp, name_len);
+    write_length(bp, val_len);
+    buf_write(bp, env, name_len);
+    buf_write(bp, val, val_len);
+}
+
+/** @brief Connect to the FastCGI worker socket without blocking
+ *
+ *  A UNIX socket connects at once, or fails with EAGAIN while the listen
+ *  backlog of the workers is full. The loop does not wait for that.
+ *
+ *  @return 0 on success. -1 on error, or if the workers are busy
+ */
+static int fcgi_connect(fcgi_conn_t *conn) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                     0)) == -1) {
+        log_error("fcgi_connect socket error");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, fcgi_socket, sizeof(addr.sun_path) - 1);
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        if (errno == EAGAIN)
+            log_msg(L_ERROR, "FastCGI workers busy, their backlog is full\n");
+        else
+            log_error("fcgi_connect connect error");
+        close(fd);
+        return -1;
+    }
+
+    add_read_fd(fd);
+    conn->fd = fd;
+    conn->paused = 0;
+    log_msg(L_INFO, "Connected to FastCGI worker, fd %d\n", fd);
+
+    return 0;
+}
+
+/** @brief Pick the least loaded connection with a free request id
+ *
+ *  If a new connection cannot be made, e.g. the workers are busy, the least
+ *  loaded connection already open takes the request.
+ *
+ *  @param id The pointer to the variable which stores the request id
+ *  @return The connection. NULL if all connections are full or down.
+ */
+static fcgi_conn_t* pick_conn(int *id) {
+    fcgi_conn_t *conn = NULL, *open = NULL;
+    int i;
+
+    for (i = 0; i < fcgi_conns; ++i) {
+        if (pool[i].active >= fcgi_mpx)
+            continue;
+        /* Prefer connected ones, they need no connect() */
+        if (conn == NULL || pool[i].active < conn->active ||
+            (pool[i].active == conn->active && conn->fd == -1 &&
+             pool[i].fd != -1))
+            conn = pool + i;
+        if (pool[i].fd != -1 && (open == NULL || pool[i].active < open->active))
+            open = pool + i;
+    }
+
+    if (conn == NULL) {
+        log_msg(L_ERROR, "All FastCGI connections are busy\n");
+        return NULL;
+    }
+    if (conn->fd == -1 && fcgi_connect(conn) == -1) {
+        if (open == NULL)
+            return NULL;
+        conn = open;
+    }
+
+    for (i = 1; i <= fcgi_mpx; ++i)
+        if (!conn->used[i]) {
+            *id = i;
+            return conn;
+        }
+
+    return NULL;
+}
+
+/** @brief Release a request id and detach it from its client */
+static void release_id(fcgi_conn_t *conn, int id) {
+    http_client_t *client = conn->clients[id];
+
+    if (client != NULL) {
+        client->fcgi_conn = NULL;
+        client->fcgi_id = 0;
+    }
+    conn->clients[id] = NULL;
+    conn->used[id] = 0;
+    conn->active -= 1;
+    timer_cancel(conn->timers + id);
+}
+
+/** @brief Close a broken connection and fail all requests on it */
+static void fail_conn(fcgi_conn_t *conn) {
+    http_client_t *client;
+    int i;
+
+    log_msg(L_ERROR, "FastCGI connection fd %d closed\n", conn->fd);
+
+    for (i = 1; i <= FCGI_MAX_MPX; ++i) {
+        if (!conn->used[i]) continue;
+        client = conn->clients[i];
+        release_id(conn, i);
+        if (client == NULL) continue;
+
+        /* Response not started, a complete error response can still be sent */
+        if (!conn->started[i])
+            end_request(client, INTERNAL_SERVER_ERROR);
+        access_close(client);
+        client->status = C_IDLE;
+        client->alive = 0;
+        client_wake(client);
+    }
+
+    remove_read_fd(conn->fd);
+    remove_write_fd(conn->fd);
+    close(conn->fd);
+    conn->fd = -1;
+    conn->in->pos = conn->in->datasize = 0;
+    conn->out->pos = conn->out->datasize = 0;
+}
+
+/** @brief Handle a record received from a worker */
+static void handle_record(fcgi_conn_t *conn, int type, int id, char *content,
+                          int len) {
+    http_client_t *client;
+
+    if (id < 1 || id > FCGI_MAX_MPX || !conn->used[id]) {
+        log_msg(L_ERROR, "FastCGI record for unknown request id %d\n", id);
+        return;
+    }
+    client = conn->clients[id];
+
+    if (client != NULL)
+        client_wake(client);
+
+    switch (type) {
+    case FCGI_STDOUT:
+        if (client != NULL && len > 0) {
+            if (!conn->started[id])
+                access_sniff(client, content, len);
+            client_write(client, content, len);
+            conn->started[id] = 1;
+        }
+        break;
+    case FCGI_STDERR:
+        if (len > 0)
+            log_msg(L_ERROR, "FastCGI stderr: %.*s\n", len, content);
+        break;
+    case FCGI_END_REQUEST:
+        release_id(conn, id);
+        if (client == NULL) break;
+        /* The worker refused the request. e.g. FCGI_OVERLOADED */
+        if (len >= 5 && content[4] != FCGI_REQUEST_COMPLETE &&
+            !conn->started[id]) {
+            log_msg(L_ERROR, "FastCGI request rejected: %d\n", content[4]);
+            end_request(client, SERVICE_UNAVAILABLE);
+        }
+        access_close(client);
+        client->status = C_IDLE;
+        break;
+    default:
+        log_msg(L_ERROR, "Unexpected FastCGI record type %d\n", type);
+    }
+}
+
+/** @brief Split received data into records and dispatch them
+ *
+ *  Incomplete records are kept in the input buffer until the rest arrives.
+ */
+static void parse_records(fcgi_conn_t *conn) {
+    buf_t *bp = conn->in;
+    unsigned char *h;
+    int content_len, record_len;
+
+    while (bp->datasize - bp->pos >= FCGI_HEADER_LEN) {
+        h = (unsigned char *)bp->buf + bp->pos;
+        content_len = (h[4] << 8) | h[5];
+        record_len = FCGI_HEADER_LEN + content_len + h[6];
+        if (bp->datasize - bp->pos < record_len)
+            break;
+
+        handle_record(conn, h[1], (h[2] << 8) | h[3],
+                      (char *)h + FCGI_HEADER_LEN, content_len);
+        bp->pos += record_len;
+    }
+
+    if (empty(bp)) io_shrink(bp);
+}
+
+/** @brief Called by the timer wheel when a request misses its deadline
+ *
+ *  The first time, the worker is asked to abort and the client is answered
+ *  or closed. If the deadline of the abort passes too, the worker is hung.
+ */
+static void request_timeout(timer_node_t *t) {
+    fcgi_conn_t *conn = t->data;
+    int id = t - conn->timers;
+    http_client_t *client = conn->clients[id];
+
+    if (client == NULL) {
+        log_msg(L_ERROR, "FastCGI request %d not ended after abort\n", id);
+        fail_conn(conn);
+        return;
+    }
+
+    log_msg(L_ERROR, "FastCGI request %d for %s timed out\n", id,
+            client->remote_ip);
+    fcgi_detach(client);
+    client->alive = 0;
+    if (!conn->started[id])
+        end_request(client, GATEWAY_TIMEOUT);
+    access_close(client);
+    client->status = C_IDLE;
+    client_wake(client);
+}
+
+/** @brief Create the connection pool. Connections are opened on demand
+ *
+ *  @return 0 if success. -1 if error
+ */
+int fcgi_init() {
+    int i, j;
+
+    if (fcgi_conns < 1 || fcgi_mpx < 1 || fcgi_mpx > FCGI_MAX_MPX) {
+        log_msg(L_ERROR, "Bad FastCGI pool size %d or mpx %d\n",
+                fcgi_conns, fcgi_mpx);
+        return -1;
+    }
+
+    pool = malloc(sizeof(fcgi_conn_t) * fcgi_conns);
+    for (i = 0; i < fcgi_conns; ++i) {
+        pool[i].fd = -1;
+        pool[i].in = init_buf();
+        pool[i].out = init_buf();
+        pool[i].active = 0;
+        pool[i].paused = 0;
+        memset(pool[i].used, 0, sizeof(pool[i].used));
+        memset(pool[i].clients, 0, sizeof(pool[i].clients));
+        for (j = 0; j <= FCGI_MAX_MPX; ++j)
+            timer_setup(pool[i].timers + j, request_timeout, pool + i);
+    }
+
+    return 0;
+}
+
+/** @brief Forward a CGI request to a FastCGI worker
+ *
+ *  The response is delivered asynchronously by fcgi_process().
+ *
+ *  @return 0 if ok. HTTP status code if something goes wrong
+ */
+int fcgi_handler(http_client_t *client) {
+    fcgi_conn_t *conn;
+    unsigned char begin[8];
+    buf_t *params;
+    char **envp, **env;
+    int id;
+
+    if ((conn = pick_conn(&id)) == NULL)
+        return SERVICE_UNAVAILABLE;
+
+    memset(begin, 0, sizeof(begin));
+    begin[1] = FCGI_RESPONDER;
+    begin[2] = FCGI_KEEP_CONN;
+    write_record(conn, FCGI_BEGIN_REQUEST, id, (char *)begin, sizeof(begin));
+
+    params = init_buf();
+    envp = setup_envp(client);
+    for (env = envp; *env != NULL; ++env)
+        write_param(params, *env);
+    free_envp(envp);
+    write_length(params, strlen("SCRIPT_FILENAME"));
+    write_length(params, strlen(cgi_path));
+    buf_write(params, "SCRIPT_FILENAME", strlen("SCRIPT_FILENAME"));
+    buf_write(params, cgi_path, strlen(cgi_path));
+    write_stream(conn, FCGI_PARAMS, id, params->buf, params->datasize);
+    deinit_buf(params);
+
+    if (client->req->method == M_POST)
+        write_stream(conn, FCGI_STDIN, id, client->req->body,
+                     client->req->content_length);
+    else
+        write_stream(conn, FCGI_STDIN, id, NULL, 0);
+
+    conn->used[id] = 1;
+    conn->clients[id] = client;
+    conn->active += 1;
+    conn->started[id] = 0;
+    client->fcgi_conn = conn;
+    client->fcgi_id = id;
+    add_write_fd(conn->fd);
+    if (cgi_timeout > 0)
+        timer_arm(conn->timers + id, cgi_timeout * 1000);
+
+    log_msg(L_INFO, "FastCGI request %d on fd %d\n", id, conn->fd);
+    return 0;
+}
+
+/** @brief Should reading from a worker wait for its clients?
+ *
+ *  Responses of all requests on a connection arrive interleaved, so one
+ *  client that does not read stops the whole connection.
+ */
+static int clients_full(fcgi_conn_t *conn) {
+    int i;
+
+    for (i = 1; i <= FCGI_MAX_MPX; ++i)
+        if (conn->clients[i] != NULL && client_out_full(conn->clients[i]))
+            return 1;
+    return 0;
+}
+
+/** @brief Send pending records and dispatch received ones
+ *
+ *  Called by the server loop after each select().
+ */
+void fcgi_process() {
+    fcgi_conn_t *conn;
+    int i, n;
+
+    if (pool == NULL) return;
+
+    for (i = 0; i < fcgi_conns; ++i) {
+        conn = pool + i;
+        if (conn->fd == -1) continue;
+
+        if (test_write_fd(conn->fd)) {
+            if (conn->out->pos < conn->out->datasize &&
+                io_send(conn->fd, conn->out, NULL) == -1) {
+                fail_conn(conn);
+                continue;
+            }
+            if (conn->out->pos >= conn->out->datasize)
+                remove_write_fd(conn->fd);
+        }
+
+        if (!conn->paused && test_read_fd(conn->fd)) {
+            n = io_recv(conn->fd, conn->in, NULL);
+            if (n == IO_AGAIN)
+                continue;
+            if (n <= 0) {
+                fail_conn(conn);
+                continue;
+            }
+            parse_records(conn);
+        }
+    }
+}
+
+/** @brief Pause or resume reading from the workers
+ *
+ *  The output is left in the worker until the clients catch up. Called by the
+ *  server loop after the clients are served, before the next select().
+ */
+void fcgi_update_interest() {
+    fcgi_conn_t *conn;
+    int i, full;
+
+    if (pool == NULL) return;
+
+    for (i = 0; i < fcgi_conns; ++i) {
+        conn = pool + i;
+        if (conn->fd == -1) continue;
+
+        full = clients_full(conn);
+        if (full == conn->paused) continue;
+        if (full)
+            remove_read_fd(conn->fd);
+        else
+            add_read_fd(conn->fd);
+        conn->paused = full;
+    }
+}
+
+/** @brief Detach a client that is going away from its FastCGI request
+ *
+ *  The worker is asked to abort the request. The request id stays in use
+ *  until the worker answers with END_REQUEST, for FCGI_ABORT_GRACE seconds.
+ */
+void fcgi_detach(http_client_t *client) {
+    fcgi_conn_t *conn = client->fcgi_conn;
+
+    if (conn == NULL) return;
+
+    conn->clients[client->fcgi_id] = NULL;
+    write_record(conn, FCGI_ABORT_REQUEST, client->fcgi_id, NULL, 0);
+    add_write_fd(conn->fd);
+    timer_arm(conn->timers + client->fcgi_id, FCGI_ABORT_GRACE * 1000);
+    client->fcgi_conn = NULL;
+}
+
+/** @brief Close all worker connections and free the pool */
+void fcgi_finalize() {
+    int i, j;
+
+    if (pool == NULL) return;
+
+    for (i = 0; i < fcgi_conns; ++i) {
+        if (pool[i].fd != -1)
+            close(pool[i].fd);
+        for (j = 0; j <= FCGI_MAX_MPX; ++j)
+            timer_cancel(pool[i].timers + j);
+        deinit_buf(pool[i].in);
+        deinit_buf(pool[i].out);
+    }
+    free(pool);
+    pool = NULL;
+}
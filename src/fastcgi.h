@@ -0,0 +1,60 @@
+/** @file fastcgi.h
+ *  @brief FastCGI client. Forward CGI requests to persistent FastCGI workers
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __FASTCGI_H__
+#define __FASTCGI_H__
+
+#include "io.h"
+#include "http_client.h"
+#include "timer.h"
+
+/* Record types, see FastCGI specification section 8 */
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_VERSION_1 1
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_COMPLETE 0
+
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+
+/* Maximum number of requests multiplexed on one worker connection */
+#define FCGI_MAX_MPX 64
+
+/* Seconds a worker has to end a request it was asked to abort */
+#define FCGI_ABORT_GRACE 5
+
+/** @brief A persistent connection to a FastCGI worker
+ *
+ *  Request ids are indices into clients[]. A slot stays in use until the
+ *  worker ends the request, even if the client went away before that.
+ *  timers[id] is the deadline of the request in the slot.
+ */
+typedef struct fcgi_conn {
+    int fd;                 //<!-1 if not connected
+    buf_t *in, *out;        //<!records received from and sent to the worker
+    int active;             //<!number of requests in flight
+    int paused;             //<!not read until the clients drain their output
+    char used[FCGI_MAX_MPX + 1];                //<!slot in use?
+    char started[FCGI_MAX_MPX + 1];             //<!response started?
+    http_client_t *clients[FCGI_MAX_MPX + 1];   //<!owner of each request id
+    timer_node_t timers[FCGI_MAX_MPX + 1];      //<!deadline of each request
+} fcgi_conn_t;
+
+int fcgi_init();
+int fcgi_handler(http_client_t *client);
+void fcgi_process();
+void fcgi_update_interest();
+void fcgi_detach(http_client_t *client);
+void fcgi_finalize();
+
+#endif
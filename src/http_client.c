@@ -11,15 +11,35 @@
  *  What client_write to is putting data in the output buffer and those data is
  *  pending for the server to send.
  *
+ *  Clients are found through a table indexed by fd, which maps both the
+ *  client socket and the source fd of its pipe to the client. The server only
+ *  visits clients that are woken: by a ready fd, or by another module that
+ *  changed their state.
+ *
  *  @author Chao Xin(cxin)
  */
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <sys/select.h>
 #include "config.h"
 #include "log.h"
 #include "io.h"
 #include "http_client.h"
+#include "fastcgi.h"
+#include "cgi_supervisor.h"
+#include "probes.h"
+#include "mem.h"
+
+/* Owner of each fd. select() cannot watch fds beyond FD_SETSIZE anyway */
+static http_client_t *conns[FD_SETSIZE];
+static int nconns = 0;
+/*
+ * Clients to visit in the next round of the server loop, and those left to
+ * visit in the current one. client->ready tells which list a client is in
+ */
+static http_client_t *ready_head = NULL, *round_head = NULL;
 
 /** brief Compare two string(case insensitive) */
 int strcicmp(char* s1, char* s2) {
@@ -45,10 +65,10 @@ int strcicmp(char* s1, char* s2) {
 void deinit_header(http_header_t *header) {
     if (header == NULL) return;
     if (header->key != NULL)
-        free(header->key);
+        mem_free(header->key);
     if (header->val != NULL)
-        free(header->val);
-    free(header);
+        mem_free(header->val);
+    mem_free(header);
 }
 
 /** @brief Destroy a http_request struct */
@@ -70,57 +90,205 @@ void deinit_request(http_request_t *req) {
      * buffer of a client.
      */
 
-    free(req);
+    mem_free(req);
 }
 
 /** @brief Create a new http_request */
 http_request_t* new_request() {
     http_request_t *req;
 
-    req = malloc(sizeof(http_request_t));
+    req = mem_alloc(MEM_REQUEST, sizeof(http_request_t));
     req->cnt_headers = 0;
     req->headers = NULL;
     req->body = NULL;
+    req->content_length = 0;
+    req->is_chunked = 0;
+    req->chunk_state = 0;
+    req->chunk_left = 0;
+    req->chunk_raw = 0;
+    req->method = -1;
+    req->line[0] = '\0';
+    req->logged = 0;
+    req->id = 0;
 
     return req;
 }
 
 /** @brief Create a new http client associated with socket fd */
 http_client_t* new_client(int fd) {
-    http_client_t *client = malloc(sizeof(http_client_t));
+    http_client_t *client = mem_alloc(MEM_CLIENT, sizeof(http_client_t));
 
     client->fd = fd;
+    client->pipe = NULL;
+    client->pipe_tail = NULL;
+    client->npipes = 0;
+    client->bytes_written = 0;
+    client->bytes_sent = 0;
+    client->access_head = client->access_tail = NULL;
     client->status = C_IDLE;
     client->alive = 1;
+    clock_gettime(CLOCK_MONOTONIC, &client->since);
 
     client->in = init_buf();
     client->out = init_buf();
 
     client->req = new_request();
     client->remote_ip[0] = '\0';
-    client->remote_host = NULL;
+    client->remote_addr.s_addr = INADDR_ANY;
     client->ssl_context = NULL;
-    client->next = NULL;
-
+    client->ssl_want = 0;
+    client->recv_wants_write = 0;
+    client->send_wants_read = 0;
+    client->fcgi_conn = NULL;
+    client->fcgi_id = 0;
+    client->cgi_in = -1;
+    client->cgi_body = NULL;
+    timer_setup(&client->timer, NULL, client);
+    client->timer_phase = T_NONE;
+    client->expired = 0;
+    client->read_paused = 0;
+    client->parse_ready = 0;
+    client->ready = 0;
+    client->ready_next = client->ready_prev = NULL;
+
+    client_bind(fd, client);
+    nconns += 1;
     return client;
 }
 
 /** @brief Destroy a client struct, free all its resource */
 void deinit_client(http_client_t *client) {
+    pipe_t *pipe;
+
     if (client == NULL) return;
     remove_read_fd(client->fd);
     remove_write_fd(client->fd);
+    client_unbind(client->fd, client);
+    nconns -= 1;
 
+    access_finish(client);
+    PROBE2(close, client->fd, client->bytes_sent);
+    io_release_fd(client->fd);
     close(client->fd);
     log_msg(L_INFO, "Closed fd %d\n", client->fd);
     deinit_buf(client->in);
     deinit_buf(client->out);
     deinit_request(client->req);
+    while ((pipe = client->pipe) != NULL) {
+        client->pipe = pipe->next;
+        remove_read_fd(pipe->from_fd);
+        client_unbind(pipe->from_fd, client);
+        close(pipe->from_fd);
+        deinit_pipe(pipe);
+    }
+    client_cgi_input_done(client);
+    fcgi_detach(client);
+    cgi_detach(client);
+    timer_cancel(&client->timer);
+    if (client->read_paused)
+        buf_get_stats()->paused -= 1;
     if (client->ssl_context) {
         SSL_shutdown(client->ssl_context);
         SSL_free(client->ssl_context);
     }
-    free(client);
+    client_unwake(client);
+    mem_free(client);
+}
+
+/** @brief Map fd, a client socket or a pipe source, to its client */
+void client_bind(int fd, http_client_t *client) {
+    if (fd >= 0 && fd < FD_SETSIZE)
+        conns[fd] = client;
+}
+
+/** @brief Forget the mapping of fd
+ *
+ *  Nothing is done if fd has been closed and reused by another client.
+ */
+void client_unbind(int fd, http_client_t *client) {
+    if (fd >= 0 && fd < FD_SETSIZE && conns[fd] == client)
+        conns[fd] = NULL;
+}
+
+/** @brief The client owning fd. NULL if none */
+http_client_t* client_lookup(int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE)
+        return NULL;
+    return conns[fd];
+}
+
+/** @brief Number of clients */
+int client_count() {
+    return nconns;
+}
+
+/** @brief Name of a client status, "idle" for C_IDLE... */
+char* client_status_name(int status) {
+    static char *names[] = { "idle", "header", "body", "piping",
+                             "handshake" };
+
+    if (status < 0 || status > C_HANDSHAKE)
+        return "?";
+    return names[status];
+}
+
+/** @brief Have the server visit a client in its next round
+ *
+ *  A client still to be visited in the current round stays there.
+ */
+void client_wake(http_client_t *client) {
+    if (client->ready) return;
+    client->ready = R_NEXT;
+    client->ready_prev = NULL;
+    client->ready_next = ready_head;
+    if (ready_head != NULL)
+        ready_head->ready_prev = client;
+    ready_head = client;
+}
+
+/** @brief Remove a client that is going away from the woken ones, in O(1) */
+void client_unwake(http_client_t *client) {
+    http_client_t **head;
+
+    if (!client->ready) return;
+    head = client->ready == R_NEXT ? &ready_head : &round_head;
+    if (client->ready_prev != NULL)
+        client->ready_prev->ready_next = client->ready_next;
+    else
+        *head = client->ready_next;
+    if (client->ready_next != NULL)
+        client->ready_next->ready_prev = client->ready_prev;
+    client->ready = 0;
+}
+
+/** @brief Start a round with the woken clients
+ *
+ *  Clients woken after this are visited in the next round.
+ */
+void client_take_ready() {
+    http_client_t *client;
+
+    round_head = ready_head;
+    ready_head = NULL;
+    for (client = round_head; client != NULL; client = client->ready_next)
+        client->ready = R_ROUND;
+}
+
+/** @brief Take the next client to visit in this round
+ *
+ *  @return The client. NULL once the round is over
+ */
+http_client_t* client_next_ready() {
+    http_client_t *client = round_head;
+
+    if (client != NULL)
+        client_unwake(client);
+    return client;
+}
+
+/** @brief Is a client waiting to be visited? */
+int client_any_ready() {
+    return ready_head != NULL;
 }
 
 /** @brief Write a buffer to client
@@ -133,20 +301,17 @@ void deinit_client(http_client_t *client) {
  *  @return Void
  */
 void client_write(http_client_t *client, char* buf, int buf_len) {
-    buf_t *c_buf = client->out;     //Internal output buffer of client
-
-    //The space is not enough, realloc !
-    if (c_buf->datasize + buf_len > c_buf->bufsize) {
-        /*
-         * An additional BUFSIZE is added to the bufsize to prevent
-         * frequent realloc
-         */
-        c_buf->bufsize = c_buf->datasize + buf_len + BUFSIZE;
-        c_buf->buf = realloc(c_buf->buf, c_buf->bufsize);
+    pipe_t *tail = client->pipe_tail;
+
+    client->bytes_written += buf_len;
+    /* Behind a queued pipe, the bytes wait until the pipe is drained */
+    if (tail == NULL)
+        buf_write(client->out, buf, buf_len);
+    else {
+        if (tail->after == NULL)
+            tail->after = init_buf();
+        buf_write(tail->after, buf, buf_len);
     }
-
-    memmove(c_buf->buf + c_buf->datasize, buf, buf_len);
-    c_buf->datasize += buf_len;
 }
 
 /** @brief Write a string to client */
@@ -155,6 +320,98 @@ void client_write_string(http_client_t *client, char* str) {
     client_write(client, str, strlen(str));
 }
 
+/** @brief Queue a pipe behind the response bytes written so far
+ *
+ *  Pipelined requests are parsed ahead, so several responses can be queued.
+ *  They are sent in order: the output buffer, the first pipe, the bytes
+ *  written after it, the next pipe...
+ */
+void client_queue_pipe(http_client_t *client, pipe_t *pipe) {
+    pipe->next = NULL;
+    if (client->pipe_tail == NULL)
+        client->pipe = pipe;
+    else
+        client->pipe_tail->next = pipe;
+    client->pipe_tail = pipe;
+    client->npipes += 1;
+    client_bind(pipe->from_fd, client);
+    // The length of a CGI output is known at its end
+    if (pipe->file_left > 0)
+        client->bytes_written += pipe->file_left;
+}
+
+/** @brief The pipe at the head of the queue is drained, or failed
+ *
+ *  The bytes queued after it become the output buffer, which is empty since
+ *  a pipe is only drained after the output buffer.
+ */
+void client_pipe_done(http_client_t *client) {
+    pipe_t *pipe = client->pipe;
+    buf_t *out;
+
+    client_unbind(pipe->from_fd, client);
+    client->pipe = pipe->next;
+    if (client->pipe == NULL)
+        client->pipe_tail = NULL;
+    client->npipes -= 1;
+
+    if (pipe->after != NULL) {
+        out = client->out;
+        client->out = pipe->after;
+        pipe->after = NULL;
+        deinit_buf(out);
+    }
+    if (pipe->file_left < 0)
+        client->bytes_written += pipe->sent;
+    if (pipe->ends_piping && pipe->sent == 0)
+        // The script died without a response, e.g. killed by its limits
+        end_request(client, INTERNAL_SERVER_ERROR);
+    else if (pipe->ends_piping) {
+        client->status = C_IDLE;
+        access_close(client);
+    }
+    // The script is done, whatever of the body it did not read
+    if (pipe->ends_piping)
+        client_cgi_input_done(client);
+    deinit_pipe(pipe);
+}
+
+/** @brief Write more of the request body to the stdin of a CGI script
+ *
+ *  The part of the body the pipe could not take when the script started is
+ *  fed here whenever the pipe is writable, so a large body does not block the
+ *  server.
+ *
+ *  @return 1 if the pipe is closed, the body is written or the script does
+ *          not read it. 0 if the pipe is full
+ */
+int client_feed_cgi(http_client_t *client) {
+    buf_t *bp = client->cgi_body;
+    int n;
+
+    while (bp->pos < bp->datasize) {
+        n = write(client->cgi_in, bp->buf + bp->pos, bp->datasize - bp->pos);
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        // EPIPE, the script exited or closed its stdin
+        if (n == -1) break;
+        bp->pos += n;
+    }
+    client_cgi_input_done(client);
+    return 1;
+}
+
+/** @brief Close the stdin of a CGI script fed by the server, if any */
+void client_cgi_input_done(http_client_t *client) {
+    if (client->cgi_in == -1) return;
+    remove_write_fd(client->cgi_in);
+    client_unbind(client->cgi_in, client);
+    close(client->cgi_in);
+    deinit_buf(client->cgi_body);
+    client->cgi_in = -1;
+    client->cgi_body = NULL;
+}
+
 /** @brief Read a line ends in \n from client's input buffer
  *
  *  Find \n started from the internal pointer pos of the client's input buffer
@@ -194,6 +451,46 @@ int client_readline(http_client_t *client, char *line) {
     return 0;
 }
 
+/** @brief Are the buffers of the server over the global budget? */
+int total_full() {
+    return buf_get_stats()->bytes >= (long)total_buf_limit << 20;
+}
+
+/** @brief Should a client stop receiving?
+ *
+ *  The body of a request being received is exempt from the per connection
+ *  budget, since it must be complete before it can be handled. Its size is
+ *  limited by MAX_BODY_LEN. Over the global budget, only clients with nothing
+ *  buffered are read.
+ */
+int client_in_full(http_client_t *client) {
+    int pending = client->in->datasize - client->in->pos;
+
+    return (pending >= conn_buf_limit << 10 && client->status != C_PBODY) ||
+           (pending > 0 && total_full());
+}
+
+/** @brief Should whatever produces output for a client wait for it to drain?
+ *
+ *  That is, the parser should not start another request, and FastCGI output
+ *  should not be read. The bytes queued behind pipes count, and so does the
+ *  number of pipes, each holding an fd. Over the global budget, a client with
+ *  nothing left to send may still go on, so requests already received are
+ *  answered.
+ */
+int client_out_full(http_client_t *client) {
+    int pending = client->out->datasize - client->out->pos;
+    pipe_t *pipe;
+
+    for (pipe = client->pipe; pipe != NULL; pipe = pipe->next)
+        if (pipe->after != NULL)
+            pending += pipe->after->datasize - pipe->after->pos;
+
+    return pending >= conn_buf_limit << 10 ||
+           client->npipes >= MAX_QUEUED_PIPES ||
+           ((pending > 0 || client->pipe != NULL) && total_full());
+}
+
 /** @brief Send the response line to client with status code
  *
  *  @param client The corresponding client
@@ -202,8 +499,12 @@ int client_readline(http_client_t *client, char *line) {
 void send_response_line(http_client_t *client, int code) {
     char* line;
 
+    if (code != CONTINUE)
+        access_open(client, code);
     client_write_string(client, http_version);
 
+    if (code == CONTINUE)
+        line = " 100 Continue";
     if (code == OK)
         line = " 200 OK";
     if (code == BAD_REQUEST)
@@ -212,14 +513,22 @@ void send_response_line(http_client_t *client, int code) {
         line = " 404 Not Found";
     if (code == METHOD_NOT_ALLOWED)
         line = " 405 Method Not Allowed";
+    if (code == REQUEST_TIMEOUT)
+        line = " 408 Request Timeout";
     if (code == LENGTH_REQUIRED)
         line = " 411 Length Required";
+    if (code == REQUEST_ENTITY_TOO_LARGE)
+        line = " 413 Request Entity Too Large";
+    if (code == EXPECTATION_FAILED)
+        line = " 417 Expectation Failed";
     if (code == INTERNAL_SERVER_ERROR)
         line = " 500 Internal Server Error";
     if (code == NOT_IMPLEMENTED)
         line = " 501 Not Implemeneted";
     if (code == SERVICE_UNAVAILABLE)
         line = " 503 Service Unavailable";
+    if (code == GATEWAY_TIMEOUT)
+        line = " 504 Gateway Timeout";
     if (code == HTTP_VERSION_NOT_SUPPORTED)
         line = " 505 HTTP Version Not Supported";
 
@@ -237,7 +546,8 @@ void send_header(http_client_t *client, char* key, char* val) {
 
 //In case of what kind of error should the connection be closed?
 static int is_fatal(int code) {
-    return code == BAD_REQUEST || code == INTERNAL_SERVER_ERROR;
+    return code == BAD_REQUEST || code == REQUEST_TIMEOUT ||
+           code == INTERNAL_SERVER_ERROR;
 }
 
 /** @brief Ends current request with given status code and destroy request
@@ -249,18 +559,24 @@ static int is_fatal(int code) {
 int end_request(http_client_t *client, int code) {
     client->status = C_IDLE;
     send_response_line(client, code);
+    /* No body. Without this a keep-alive client would wait for one */
+    send_header(client, "Content-Length", "0");
 
     /* The client signal a "Connection: Close" */
     if (connection_close(client->req))
         client->alive = 0;
 
-    if (is_fatal(code)) {
+    if (is_fatal(code) || !client->alive) {
         send_header(client, "Connection", "Close");
         client_write_string(client, "\r\n");
+        access_close(client);
+        if (!is_fatal(code))
+            return 0;
         client->alive = 0;
         return -1;
     }
     client_write_string(client, "\r\n");
+    access_close(client);
 
     return 0;
 }
@@ -9,16 +9,23 @@
 #include <netinet/in.h>
 #include <openssl/ssl.h>
 #include "io.h"
+#include "timer.h"
+#include "access_log.h"
 
 /* http response code */
+#define CONTINUE 100
 #define OK 200
 #define BAD_REQUEST 400
 #define NOT_FOUND 404
 #define METHOD_NOT_ALLOWED 405
+#define REQUEST_TIMEOUT 408
 #define LENGTH_REQUIRED 411
+#define REQUEST_ENTITY_TOO_LARGE 413
+#define EXPECTATION_FAILED 417
 #define INTERNAL_SERVER_ERROR 500
 #define NOT_IMPLEMENTED 501
 #define SERVICE_UNAVAILABLE 503
+#define GATEWAY_TIMEOUT 504
 #define HTTP_VERSION_NOT_SUPPORTED 505
 
 /**
@@ -36,6 +43,23 @@
  * request before finishing the current response.
  */
 #define C_PIPING 3
+/**
+ * The TLS handshake is in progress. SSL_accept() is driven by the serving
+ * loop whenever the socket becomes ready in the direction OpenSSL asked for,
+ * so a slow peer never blocks other clients.
+ */
+#define C_HANDSHAKE 4
+
+/* Which deadline a client is waiting for. See update_timer() in server.c */
+#define T_NONE 0        //no deadline, e.g. waiting for a CGI script
+#define T_IDLE 1        //keep-alive, waiting for the next request
+#define T_HEADER 2      //receiving a request line and headers
+#define T_BODY 3        //receiving a request body
+#define T_WRITE 4       //sending a response
+
+/* Which list of woken clients a client is in. See client_wake() */
+#define R_NEXT 1        //to visit in the next round of the server loop
+#define R_ROUND 2       //still to visit in the current round
 
 /* Methods */
 #define M_GET 0
@@ -48,6 +72,12 @@
 /* Maximum length of a URI */
 #define MAX_URI_LEN 2048
 
+/* Maximum number of pipelined responses with a pipe queued on a client */
+#define MAX_QUEUED_PIPES 16
+
+/* Maximum length of a request body */
+#define MAX_BODY_LEN (16 * 1024 * 1024)
+
 /** @brief Store information of a single http header.
  *
  * Headers are organized using linked list.
@@ -67,31 +97,58 @@ typedef struct http_request {
     char *body;
     int is_cgi;
     int content_length;
+    int is_chunked;         //Body is sent with "Transfer-Encoding: chunked"
+    int chunk_state;        //Where the chunked decoder is. See http_parser.c
+    int chunk_left;         //Bytes left in the current chunk
+    int chunk_raw;          //Offset of undecoded bytes, relative to in->pos
     int cnt_headers;
     http_header_t *headers; //Headers in a linked list
+    char line[MAX_URI_LEN]; //Request line, cut if too long
+    time_t received;        //Wall clock time of the request line
+    struct timespec start;  //When the request line was read
+    struct timespec handled;    //When the request was complete
+    int logged;             //Has a record in the access log
+    unsigned long id;       //Number of the request in the server, for probes
 } http_request_t;
 
 /** @brief Store information of a single client.
  *
- *  Clients are organized using linked list. The server maintain an this object
+ *  Clients are found by fd in a table. The server maintain an this object
  *  for each client. The object includes the file descriptor, data regarding
  *  current request, and an input buffer and an output buffer.
  */
 typedef struct http_client {
     int fd;                 //<!client's file descriptor
-    pipe_t *pipe;           //<!pipe from a file or cgi output
+    pipe_t *pipe;           //<!pipe from a file or cgi output, queue head
+    pipe_t *pipe_tail;      //<!last pipe in the response queue
+    int npipes;             //<!pipes in the response queue
     int status;             //<!the current status of this client
     int alive;              //<!indicates if the client should be kept alive
     buf_t *in, *out;        //<!input and output buffer assigned to this client
     http_request_t* req;     //<!current request from this client
     char remote_ip[INET_ADDRSTRLEN];   //<!ip address of the client
-    char* remote_host;                  //<!host name of the client
+    struct in_addr remote_addr;         //<!address of the client
     SSL* ssl_context;        //<!SSL context for this client
-    struct http_client* next;   //<!next client in the linked list
+    int ssl_want;            //<!SSL_ERROR_WANT_READ/WRITE during handshake
+    int recv_wants_write;    //<!SSL_read() waits for the socket to be writable
+    int send_wants_read;     //<!SSL_write() waits for the socket to be readable
+    struct fcgi_conn *fcgi_conn;    //<!FastCGI connection serving the request
+    int fcgi_id;                    //<!FastCGI request id
+    int cgi_in;             //<!stdin of the CGI script being fed, -1 if none
+    buf_t *cgi_body;        //<!request body not written to cgi_in yet
+    timer_node_t timer;     //<!deadline of the current phase
+    int timer_phase;        //<!T_NONE, T_IDLE...
+    int expired;            //<!missed a deadline, to be closed
+    int read_paused;        //<!not read because of the buffer budgets
+    int parse_ready;        //<!the parser may go on without new data
+    int ready;              //<!to be visited by the server loop, see R_NEXT
+    struct http_client *ready_next, *ready_prev;  //<!in the same list
+    long long bytes_written;    //<!bytes of responses put in the output
+    long long bytes_sent;       //<!bytes of the output sent to the client
+    struct access_rec *access_head, *access_tail;  //<!responses to log
+    struct timespec since;      //<!when the connection was accepted
 } http_client_t;
 
-http_client_t *client_head;     //<!first client in the linked list
-
 /* Initialize and destroy object */
 void deinit_header(http_header_t *header);
 void deinit_request(http_request_t *req);
@@ -99,13 +156,32 @@ http_request_t* new_request();
 void deinit_client(http_client_t *client);
 http_client_t* new_client(int fd);
 
+/* Connection table and the clients the server loop should visit */
+void client_bind(int fd, http_client_t *client);
+void client_unbind(int fd, http_client_t *client);
+http_client_t* client_lookup(int fd);
+int client_count();
+char* client_status_name(int status);
+void client_wake(http_client_t *client);
+void client_unwake(http_client_t *client);
+void client_take_ready();
+http_client_t* client_next_ready();
+int client_any_ready();
+
 /* IO with client */
 void client_write(http_client_t *client, char* buf, int buf_len);
 void client_write_string(http_client_t *client, char* str);
+void client_queue_pipe(http_client_t *client, pipe_t *pipe);
+void client_pipe_done(http_client_t *client);
+int client_feed_cgi(http_client_t *client);
+void client_cgi_input_done(http_client_t *client);
 int client_readline(http_client_t *client, char *line);
 void send_response_line(http_client_t *client, int code);
 void send_header(http_client_t *client, char* key, char* val);
 int end_request(http_client_t *client, int code);
+int total_full();
+int client_in_full(http_client_t *client);
+int client_out_full(http_client_t *client);
 
 /* helper functions */
 int strcicmp(char* s1, char* s2);
@@ -3,12 +3,26 @@
  *
  *  @author Chao Xin(cxin)
  */
+#include <ctype.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
 #include "config.h"
 #include "http_parser.h"
 #include "request_handler.h"
 #include "log.h"
+#include "metrics.h"
+#include "probes.h"
+#include "mem.h"
+
+/* Requests read by the server, to number them */
+static unsigned long request_ids = 0;
+
+/* States of the chunked body decoder */
+#define CH_SIZE 0           // Expecting a chunk-size line
+#define CH_DATA 1           // Inside chunk data
+#define CH_DATA_END 2       // Expecting the CRLF after chunk data
+#define CH_TRAILER 3        // Reading trailer lines after the last chunk
 
 /** @brief Check if string str start with string sub
  *  @return 1 if true, 0 if false
@@ -117,7 +131,7 @@ static char* copy_trimmed_string(char *head, char* tail) {
     if (head > tail)
         return NULL;
 
-    buf = malloc(tail - head + 2);
+    buf = mem_alloc(MEM_HEADER, tail - head + 2);
     strncpy(buf, head, tail - head + 1);
     buf[tail - head + 1] = '\0';
 
@@ -138,10 +152,10 @@ static int parse_header(http_request_t* req, char* line) {
     if (val == NULL || val[1] == '\0' || val == line)
         return -1;
 
-    header = malloc(sizeof(http_header_t));
+    header = mem_alloc(MEM_HEADER, sizeof(http_header_t));
     header->key = copy_trimmed_string(line, val - 1);
     if (header->key == NULL) {
-        free(header);
+        mem_free(header);
         return -1;
     }
     header->val = copy_trimmed_string(val + 1, line + strlen(line) - 1);
@@ -158,23 +172,205 @@ static int parse_header(http_request_t* req, char* line) {
     return 0;
 }
 
+/** @brief Find the end of a line in the undecoded part of a chunked body
+ *
+ *  @return The offset(relative to bp->pos) of the first byte after '\n'. 0 if
+ *          the line is not complete yet. -1 if the line is too long.
+ */
+static int chunk_line_end(buf_t *bp, int from) {
+    int end;
+
+    for (end = bp->pos + from; end < bp->datasize; ++end) {
+        if (end - bp->pos - from >= MAXBUF)
+            return -1;
+        if (bp->buf[end] == '\n')
+            return end - bp->pos + 1;
+    }
+    if (end - bp->pos - from >= MAXBUF)
+        return -1;
+    return 0;
+}
+
+/** @brief Decode a chunked request body in place
+ *
+ *  The decoder strips chunk framing as data arrives. Decoded bytes are packed
+ *  at the beginning of the unprocessed part of the input buffer, so the body
+ *  is never copied into another buffer. Everything is recorded as offsets
+ *  relative to client->in->pos because io_shrink() may move the data.
+ *
+ *  Layout of the input buffer while decoding:
+ *      [pos, pos + content_length)         decoded body
+ *      [pos + chunk_raw, datasize)         bytes not yet decoded
+ *
+ *  @return 1 if the whole body has been decoded. 0 if more data is needed.
+ *          Negate of the corresponding http response code if error occurs.
+ */
+static int decode_chunked_body(http_client_t *client) {
+    http_request_t *req = client->req;
+    buf_t *bp = client->in;
+    char *line, *end;
+    int n;
+    long size;
+
+    while (1) {
+        if (req->chunk_state == CH_DATA) {
+            n = bp->datasize - bp->pos - req->chunk_raw;
+            if (n > req->chunk_left)
+                n = req->chunk_left;
+            if (n == 0) return 0;
+
+            memmove(bp->buf + bp->pos + req->content_length,
+                    bp->buf + bp->pos + req->chunk_raw, n);
+            req->content_length += n;
+            req->chunk_raw += n;
+            req->chunk_left -= n;
+            if (req->chunk_left == 0)
+                req->chunk_state = CH_DATA_END;
+            continue;
+        }
+
+        /* All other states consume a whole line */
+        n = chunk_line_end(bp, req->chunk_raw);
+        if (n == 0) return 0;
+        if (n < 0) {
+            log_msg(L_ERROR, "Chunk line too long\n");
+            return -BAD_REQUEST;
+        }
+        line = bp->buf + bp->pos + req->chunk_raw;
+        end = bp->buf + bp->pos + n - 1;        // Points to '\n'
+        if (end > line && end[-1] == '\r')
+            end -= 1;
+        req->chunk_raw = n;
+
+        if (req->chunk_state == CH_DATA_END) {
+            if (end != line) {
+                log_msg(L_ERROR, "Missing CRLF after chunk data\n");
+                return -BAD_REQUEST;
+            }
+            req->chunk_state = CH_SIZE;
+        } else if (req->chunk_state == CH_SIZE) {
+            size = 0;
+            for (n = 0; line + n < end && isxdigit(line[n]); ++n) {
+                size = size * 16 + (isdigit(line[n]) ? line[n] - '0' :
+                                    tolower(line[n]) - 'a' + 10);
+                if (size > MAX_BODY_LEN - req->content_length) {
+                    log_msg(L_ERROR, "Chunked body too large\n");
+                    return -REQUEST_ENTITY_TOO_LARGE;
+                }
+            }
+            /* Allow chunk extensions, which are ignored */
+            if (n == 0 || (line + n < end && line[n] != ';' &&
+                           line[n] != ' ' && line[n] != '\t')) {
+                log_msg(L_ERROR, "Bad chunk size line\n");
+                return -BAD_REQUEST;
+            }
+            req->chunk_left = size;
+            req->chunk_state = size > 0 ? CH_DATA : CH_TRAILER;
+        } else {    /* CH_TRAILER. Trailer fields are ignored */
+            if (end == line)
+                return 1;
+        }
+    }
+}
+
+/** @brief Decide how the body of a POST request is framed
+ *
+ *  @return 0 on success. HTTP status code on error.
+ */
+static int parse_body_length(http_request_t *req) {
+    char *buf;
+    int i;
+
+    buf = get_request_header(req, "Transfer-Encoding");
+    if (buf != NULL) {
+        /* Only the chunked coding is supported */
+        if (strcicmp(buf, "chunked") != 0)
+            return NOT_IMPLEMENTED;
+        req->is_chunked = 1;
+        req->chunk_state = CH_SIZE;
+        req->content_length = 0;
+        req->chunk_raw = 0;
+        return 0;
+    }
+
+    buf = get_request_header(req, "Content-Length");
+    if (buf == NULL)
+        return LENGTH_REQUIRED;
+    //validate content-length
+    if (strlen(buf) == 0) return BAD_REQUEST;
+    for (i = 0; i < strlen(buf); ++i)
+        if (buf[i] < '0' || buf[i] >'9') //each char in range ['0', '9']
+            return BAD_REQUEST;
+
+    if (strlen(buf) > 9 || atoi(buf) > MAX_BODY_LEN) {
+        log_msg(L_ERROR, "Request body too large: %s\n", buf);
+        return REQUEST_ENTITY_TOO_LARGE;
+    }
+
+    req->content_length = atoi(buf);
+    return 0;
+}
+
+/** @brief Answer "Expect: 100-continue" before the body is sent
+ *
+ *  The request line and headers are checked by precheck_post() first. The
+ *  client is told to go ahead only if the request will be accepted, so a
+ *  rejected upload never hits the wire.
+ *
+ *  @return 0 if the body should be received. HTTP status code if the request
+ *          should be answered right away.
+ */
+static int handle_expect(http_client_t *client) {
+    char *expect;
+    int ret;
+
+    expect = get_request_header(client->req, "Expect");
+    if (expect == NULL)
+        return 0;
+    if (strcicmp(expect, "100-continue") != 0)
+        return EXPECTATION_FAILED;
+
+    if ((ret = precheck_post(client)) != 0)
+        return ret;
+
+    send_response_line(client, CONTINUE);
+    client_write_string(client, "\r\n");
+    return 0;
+}
+
+/** @brief The request is complete, its handler starts. Count the parse time */
+static void handler_start(http_client_t *client) {
+    http_request_t *req = client->req;
+
+    PROBE3(handler_start, client->fd, req->id, req->uri);
+    clock_gettime(CLOCK_MONOTONIC, &req->handled);
+    hist_record_span(&metrics_get()->parse, &req->start, &req->handled);
+}
+
+/** @brief Count the time spent in the handler
+ *
+ *  @param ret What the handler returned
+ */
+static void handler_end(http_client_t *client, int ret) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    hist_record_span(&metrics_get()->handler, &client->req->handled, &now);
+    PROBE3(handler_end, client->fd, client->req->id, ret);
+}
+
 /** @brief Parse and response to request from a client
  *
  *  @return 0 if the connection should be kept alive. -1 if the connection
  *          should be closed.
  */
 int http_parse(http_client_t *client) {
-    int ret, i;
+    int ret;
     char line[MAXBUF];
-    char* buf;
 
     if (client->status == C_IDLE) {  /* A new request, parse request line */
-        ret = client_readline(client, line);
-        if (strlen(line) == 0) return 0;
-
-        log_msg(L_HTTP_DEBUG, "%s\n", line);
-
-        if (ret == 0) return 0;
+        /* No complete line yet, line is not set */
+        if ((ret = client_readline(client, line)) == 0) return 0;
 
         /* The length of a line exceed MAXBUF */
         if (ret < 0) {
@@ -182,8 +378,18 @@ int http_parse(http_client_t *client) {
             return end_request(client, BAD_REQUEST);
         }
 
-        if (client->req != NULL) free(client->req);
+        if (strlen(line) == 0) return 0;
+
+        log_msg(L_HTTP_DEBUG, "%s\n", line);
+
+        deinit_request(client->req);
         client->req = new_request();
+        strncpy(client->req->line, line, MAX_URI_LEN - 1);
+        client->req->line[MAX_URI_LEN - 1] = '\0';
+        client->req->received = time(NULL);
+        clock_gettime(CLOCK_MONOTONIC, &client->req->start);
+        client->req->id = ++request_ids;
+        PROBE3(request_line, client->fd, client->req->id, client->req->line);
 
         /* parse request line and store information in client->req */
         if ((ret = parse_request_line(client->req, line)) > 0)
@@ -203,26 +409,25 @@ int http_parse(http_client_t *client) {
         log_msg(L_HTTP_DEBUG, "%s\n", line);
 
         if (strlen(line) == 0) {    //Request header ends
+            PROBE2(headers, client->fd, client->req->id);
 
             if (client->req->method == M_POST) {
-                buf = get_request_header(client->req, "Content-Length");
-                if (buf == NULL)
-                    return end_request(client, LENGTH_REQUIRED);
-                //validate content-length
-                if (strlen(buf) == 0) return BAD_REQUEST;
-                for (i = 0; i < strlen(buf); ++i)
-                    if (buf[i] < '0' || buf[i] >'9') //each char in range ['0', '9']
-                        return end_request(client, BAD_REQUEST);
-
-                client->req->content_length = atoi(buf);
+                if ((ret = parse_body_length(client->req)) != 0 ||
+                    (ret = handle_expect(client)) != 0) {
+                    /* The body will not be read, so the connection ends */
+                    client->alive = 0;
+                    return end_request(client, ret);
+                }
 
                 /* Now start receiving body */
                 client->status = C_PBODY;
                 break;
             }
 
+            handler_start(client);
             if (client->req->method == M_GET) ret = handle_get(client);
             if (client->req->method == M_HEAD) ret = handle_head(client);
+            handler_end(client, ret);
             if (ret != 0)
                 return end_request(client, ret);
             else {
@@ -245,12 +450,30 @@ int http_parse(http_client_t *client) {
      * of the request is ready. If so, copy data
      */
     if (client->status == C_PBODY) {
-        // Reveive complete body?
-        if (client->in->datasize - client->in->pos >= client->req->content_length) {
+        if (client->req->is_chunked) {
+            if ((ret = decode_chunked_body(client)) < 0) {
+                client->alive = 0;
+                return end_request(client, -ret);
+            }
+            /*
+             * Body is complete. The decoded body sits at in->pos, while the
+             * framing consumed chunk_raw bytes in the input buffer.
+             */
+            if (ret == 1) {
+                client->req->body = client->in->buf + client->in->pos;
+                client->in->pos += client->req->chunk_raw;
+            }
+        } else if (client->in->datasize - client->in->pos >=
+                   client->req->content_length) {  // Reveive complete body?
             /* Let body points to corresponding memory in the input buffer */
             client->req->body = client->in->buf + client->in->pos;
             client->in->pos += client->req->content_length;
+        }
+
+        if (client->req->body != NULL) {
+            handler_start(client);
             ret = handle_post(client);
+            handler_end(client, ret);
 
             if (ret != 0)
                 return end_request(client, ret);
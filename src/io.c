@@ -6,17 +6,49 @@
  *  dynamically. When sending, the buffer size might shrink when it's empty
  *  enough.
  *
+ *  With the io_uring engine, plain client sockets are received from and sent
+ *  to by completion, see uring.c. io_recv() and io_send() then take the
+ *  results instead of calling recv() and send().
+ *
  *  @author Chao Xin(cxin)
  */
+#define _GNU_SOURCE         // accept4
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
 #include "io.h"
 #include "log.h"
+#include "uring.h"
+#include "mem.h"
+
+static select_context context = { .wake_fds = { -1, -1 } };
+static buf_stats_t stats;
+
+/** @brief Is fd served by io_uring completions instead of system calls? */
+static int by_completion(int fd) {
+    return context.uring && uring_completes(fd);
+}
 
-static select_context context;
+/** @brief Count memory held by buffers and pipes */
+static void account(long delta) {
+    stats.bytes += delta;
+    if (stats.bytes > stats.peak)
+        stats.peak = stats.bytes;
+}
+
+/** @brief Reallocate the memory of a buffer */
+static void resize(buf_t *bp, int bufsize) {
+    account(bufsize - bp->bufsize);
+    bp->bufsize = bufsize;
+    bp->buf = mem_realloc(MEM_BUF, bp->buf, bp->bufsize);
+}
 
 /** @brief The buffer is full and need to be expand? */
 inline int full(buf_t *bp) {
@@ -51,31 +83,98 @@ void io_shrink(buf_t *bp) {
     memmove(bp->buf, bp->buf + bp->pos, bp->datasize);
     bp->pos = 0;
     //cut of half of the free space
-    bp->bufsize -= freespace >> 1;
-
-    bp->buf = realloc(bp->buf, bp->bufsize);
+    resize(bp, bp->bufsize - (freespace >> 1));
 
     log_msg(L_IO_DEBUG, "Shrinking completed. bufsize: %d datasize: %d pos: %d\n",
             bp->bufsize, bp->datasize, bp->pos);
 }
 
+/** @brief Append buf_len bytes from buf to the end of a buffer
+ *
+ *  @param bp The buffer to be written to
+ *  @param buf The data to be appended
+ *  @param buf_len The length of the data
+ *  @return Void
+ */
+void buf_write(buf_t *bp, char *buf, int buf_len) {
+    //The space is not enough, realloc !
+    if (bp->datasize + buf_len > bp->bufsize) {
+        /*
+         * An additional BUFSIZE is added to the bufsize to prevent
+         * frequent realloc
+         */
+        resize(bp, bp->datasize + buf_len + BUFSIZE);
+    }
+
+    memmove(bp->buf + bp->datasize, buf, buf_len);
+    bp->datasize += buf_len;
+}
+
+/** @brief printf() at the end of a buffer. A line is cut at 511 bytes */
+void bprintf(buf_t *bp, char *format, ...) {
+    char line[512];
+    va_list arguments;
+    int len;
+
+    va_start(arguments, format);
+    len = vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+    if (len >= sizeof(line))
+        len = sizeof(line) - 1;
+    buf_write(bp, line, len);
+}
+
+/** @brief Did the last send/recv fail only because the socket is not ready?
+ *
+ *  Client sockets are non-blocking. For a TLS connection, OpenSSL may need to
+ *  read or write, whichever operation was requested.
+ *
+ *  @param ret What the failed call returned
+ */
+static int would_block(SSL *ssl_context, int ret) {
+    int err;
+
+    if (ssl_context == NULL)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    err = SSL_get_error(ssl_context, ret);
+    return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE;
+}
+
 /** @brief Try to recv as much data as possible
  *
- *  Call recv()/SSL_read() until connection closed or error occurs.
+ *  Call recv()/SSL_read() until connection closed or error occurs. For a TLS
+ *  connection, everything OpenSSL has already decrypted is read as well.
  *
  *  @param sock Client socket
  *  @param bp A pointer to a buf_t struct which stores received data
  *  @param ssl_context If ssl_context if not NULL, SSL_read() will be used
  *                     instead of recv().
  *  @return Number of bytes received on normal exit, 0 on connection closed,
- *          -1 on error.
+ *          IO_AGAIN if no data is available yet, -1 on error.
  */
 int io_recv(int sock, buf_t *bp, SSL* ssl_context) {
-    int nbytes;
+    int nbytes, n;
 
-    if (ssl_context)
+    if (ssl_context) {
         nbytes = SSL_read(ssl_context, bp->buf + bp->datasize,
                           bp->bufsize - bp->datasize - 1);
+        /*
+         * Bytes already decrypted by OpenSSL are invisible to select(). Take
+         * them all now, or a pipelined request may wait for the next packet.
+         */
+        while (nbytes > 0 && SSL_pending(ssl_context) > 0) {
+            if (bp->datasize + nbytes + SSL_pending(ssl_context) >= bp->bufsize)
+                resize(bp, bp->datasize + nbytes + SSL_pending(ssl_context) +
+                           BUFSIZE);
+            n = SSL_read(ssl_context, bp->buf + bp->datasize + nbytes,
+                         bp->bufsize - bp->datasize - nbytes - 1);
+            if (n <= 0) break;
+            nbytes += n;
+        }
+    } else if (by_completion(sock))
+        nbytes = uring_recv(sock, bp->buf + bp->datasize,
+                            bp->bufsize - bp->datasize - 1);
     else
         nbytes = recv(sock, bp->buf + bp->datasize,
                       bp->bufsize - bp->datasize - 1, 0);
@@ -84,14 +183,19 @@ int io_recv(int sock, buf_t *bp, SSL* ssl_context) {
         bp->datasize += nbytes;
 
         // Allocate more memory
-        if (full(bp)) {
-            bp->bufsize += bp->bufsize >> 1;
-            bp->buf = realloc(bp->buf, bp->bufsize);
-        }
+        if (full(bp))
+            resize(bp, bp->bufsize + (bp->bufsize >> 1));
     }
 
-    if (nbytes < 0)
+    if (nbytes <= 0) {
+        if (would_block(ssl_context, nbytes))
+            return IO_AGAIN;
+        if (nbytes == 0 || (ssl_context && SSL_get_error(ssl_context, nbytes)
+                                           == SSL_ERROR_ZERO_RETURN))
+            return 0;
         log_error("io_recv error");
+        return -1;
+    }
 
     return nbytes;
 }
@@ -104,18 +208,36 @@ int io_recv(int sock, buf_t *bp, SSL* ssl_context) {
  *  @param bp A pointer to a buf_t struct which store data to be sent
  *  @param ssl_context If ssl_context if not NULL, SSL_write() will be used
  *                     instead of send().
- *  @return Number of bytes sent, -1 on error
+ *  @return Number of bytes sent, 0 if the socket is not ready, -1 on error
  */
 int io_send(int sock, buf_t *bp, SSL* ssl_context) {
-    int nbytes;
+    return io_send_more(sock, bp, ssl_context, 0);
+}
+
+/** @brief Send data to socket sock, more data follows at once
+ *
+ *  With more set, a plain TCP socket holds back a partial segment(MSG_MORE),
+ *  so response headers go out in the same segment as the body that follows.
+ *
+ *  @return Like io_send()
+ */
+int io_send_more(int sock, buf_t *bp, SSL* ssl_context, int more) {
+    int nbytes = 0;
 
     if (bp->pos < bp->datasize) {
         if (ssl_context)
             nbytes = SSL_write(ssl_context, bp->buf + bp->pos, bp->datasize - bp->pos);
+        else if (by_completion(sock))
+            nbytes = uring_send(sock, bp->buf + bp->pos,
+                                bp->datasize - bp->pos, more);
         else
-            nbytes = send(sock, bp->buf + bp->pos, bp->datasize - bp->pos, 0);
+            nbytes = send(sock, bp->buf + bp->pos, bp->datasize - bp->pos,
+                          more ? MSG_MORE : 0);
 
         if (nbytes <= 0) {
+            // Retried with the same data, see SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+            if (would_block(ssl_context, nbytes))
+                return 0;
             log_error("io_send error");
             return -1;
         }
@@ -131,12 +253,70 @@ int io_send(int sock, buf_t *bp, SSL* ssl_context) {
     return nbytes;
 }
 
+/** @brief Can the kernel encrypt data sent on this connection? */
+static int ktls_send(SSL *ssl_context) {
+#ifdef USE_KTLS
+    return BIO_get_ktls_send(SSL_get_wbio(ssl_context));
+#else
+    return 0;
+#endif
+}
+
+/** @brief Send the next part of a regular file with sendfile()
+ *
+ *  For a TLS connection this is only possible when kernel TLS is active, in
+ *  which case SSL_sendfile() lets the kernel encrypt the file.
+ *
+ *  @return 1 piping complete. 0 to be continued. -1 error.
+ */
+static int io_sendfile(int sock, pipe_t *pp, SSL *ssl_context) {
+    size_t len = PIPE_BUFSIZE;
+    ssize_t n;
+
+    if (pp->file_left < len)
+        len = pp->file_left;
+
+    if (len > 0) {
+#ifdef USE_KTLS
+        if (ssl_context) {
+            n = SSL_sendfile(ssl_context, pp->from_fd, pp->file_pos, len, 0);
+            if (n > 0)
+                pp->file_pos += n;
+        } else
+#endif
+            n = sendfile(sock, pp->from_fd, &pp->file_pos, len);
+
+        if (n < 0 && would_block(ssl_context, n))
+            return 0;
+        // 0 means the file has been truncated
+        if (n <= 0) {
+            close(pp->from_fd);
+            remove_read_fd(pp->from_fd);
+            log_error("io_sendfile error");
+            return -1;
+        }
+        log_msg(L_IO_DEBUG, "io_sendfile: %d bytes sent.\n", (int)n);
+        pp->file_left -= n;
+        pp->sent += n;
+    }
+
+    if (pp->file_left == 0) {
+        close(pp->from_fd);
+        remove_read_fd(pp->from_fd);
+        return 1;
+    }
+    return 0;
+}
+
 /** @brief Pipe content directly to client socket without reading it extirely
  *         into buffer
  *
  *  If buf in pipe is not empty, send data in buf to socket sock. After the buf
  *  becomes empty, refill it using data read from fd associated with the pipe.
  *
+ *  A regular file is sent with sendfile() instead, unless the connection is
+ *  TLS without kernel TLS offload.
+ *
  *  @param sock Client socket
  *  @param pp The pointer to a pipe to the file client requested or a cgi
  *            script process output.
@@ -147,8 +327,11 @@ int io_send(int sock, buf_t *bp, SSL* ssl_context) {
 int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
     int n;
 
+    if (pp->file_left >= 0 && (ssl_context == NULL || ktls_send(ssl_context)))
+        return io_sendfile(sock, pp, ssl_context);
+
     if (pp->datasize <= pp->offset) { // No data in buf
-        pp->datasize = read(pp->from_fd, pp->buf, BUFSIZE); // Get new data
+        pp->datasize = read(pp->from_fd, pp->buf, PIPE_BUFSIZE); // Get new data
         if (pp->datasize == -1) {
             close(pp->from_fd);
             remove_read_fd(pp->from_fd);
@@ -170,7 +353,10 @@ int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
     else
         n = send(sock, pp->buf + pp->offset, pp->datasize - pp->offset, 0);
 
-    if (n == -1) {
+    // The data stays in buf until the socket is ready again
+    if (n <= 0 && would_block(ssl_context, n))
+        return 0;
+    if (n <= 0) {
         close(pp->from_fd);
         remove_read_fd(pp->from_fd);
         log_error("io_pipe send error");
@@ -178,6 +364,7 @@ int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
     }
     log_msg(L_IO_DEBUG, "io_pipe: %d bytes sent.\n", n);
     pp->offset += n;
+    pp->sent += n;
 
     return 0;
 }
@@ -187,24 +374,51 @@ int io_pipe(int sock, pipe_t *pp, SSL *ssl_context) {
  *  @return A pointer to the newly created pipe_t struct
  */
 pipe_t* init_pipe() {
-    pipe_t *pp = malloc(sizeof(pipe_t));
+    pipe_t *pp = mem_alloc(MEM_PIPE, sizeof(pipe_t));
 
     pp->offset = 0;
     pp->datasize = 0;
+    pp->file_pos = 0;
+    pp->file_left = -1;
+    pp->sent = 0;
+    pp->ends_piping = 0;
+    pp->after = NULL;
+    pp->next = NULL;
+    account(sizeof(pipe_t));
     return pp;
 }
 
+/** @brief Free a pipe_t struct and the bytes after it. The source fd is not
+ *         touched
+ */
+void deinit_pipe(pipe_t *pp) {
+    if (pp->after != NULL)
+        deinit_buf(pp->after);
+    account(-(long)sizeof(pipe_t));
+    mem_free(pp);
+}
+
+/** @brief Does the pipe have data for the client socket?
+ *
+ *  A file always does. Otherwise, data read from the source has not been
+ *  sent completely.
+ */
+int pipe_pending(pipe_t *pp) {
+    return pp->file_left >= 0 || pp->offset < pp->datasize;
+}
+
 /** @brief Init a buf_t struct
  *
  *  @return A pointer to the newly created buf_t struct
  */
 buf_t* init_buf() {
-    buf_t *bp = malloc(sizeof(buf_t));
+    buf_t *bp = mem_alloc(MEM_BUF, sizeof(buf_t));
 
     bp->bufsize = BUFSIZE;
     bp->datasize = 0;
     bp->pos = 0;
-    bp->buf = malloc(bp->bufsize);
+    bp->buf = mem_alloc(MEM_BUF, bp->bufsize);
+    account(bp->bufsize);
 
     return bp;
 }
@@ -215,25 +429,122 @@ buf_t* init_buf() {
  *  @return Void
  */
 void deinit_buf(buf_t *bp) {
-    free(bp->buf);
-    free(bp);
+    account(-bp->bufsize);
+    mem_free(bp->buf);
+    mem_free(bp);
 }
 
-void init_select_context() {
+/** @brief Init the select context
+ *
+ *  @param use_uring Wait with io_uring instead of select(). Falls back to
+ *                   select() if io_uring cannot be set up
+ */
+void init_select_context(int use_uring) {
     FD_ZERO(&context.read_fds);
     FD_ZERO(&context.read_fds_cpy);
     FD_ZERO(&context.write_fds);
     FD_ZERO(&context.write_fds_cpy);
+
+    context.uring = use_uring && uring_init() == 0;
+    if (use_uring && !context.uring)
+        log_msg(L_ERROR, "io_uring not available, using select()\n");
+
+    if (pipe2(context.wake_fds, O_NONBLOCK | O_CLOEXEC) == -1) {
+        log_error("init_select_context pipe2 error");
+        context.wake_fds[0] = context.wake_fds[1] = -1;
+    } else
+        add_read_fd(context.wake_fds[0]);
+}
+
+void finalize_select_context() {
+    int fd = context.wake_fds[1];
+
+    if (context.uring)
+        uring_finalize();
+    context.uring = 0;
+    if (fd != -1) {
+        context.wake_fds[1] = -1;
+        close(fd);
+        close(context.wake_fds[0]);
+        context.wake_fds[0] = -1;
+    }
+}
+
+/** @brief Make the current or next io_select() return
+ *
+ *  Called by signal handlers, so only async-signal-safe calls are made. A
+ *  full pipe already has a wake up pending.
+ */
+void io_wake() {
+    int saved_errno = errno;
+
+    if (context.wake_fds[1] != -1 && write(context.wake_fds[1], "", 1) == -1)
+        ;   //EAGAIN, the pipe is full
+    errno = saved_errno;
+}
+
+/** @brief Accept on a listening socket by completion with io_uring
+ *
+ *  Call before watching fd. A no-op with select()
+ */
+void io_listen_fd(int fd) {
+    if (context.uring)
+        uring_listen(fd);
+}
+
+/** @brief Receive and send on a plain socket by completion with io_uring
+ *
+ *  Call before watching fd. The socket is then only read with io_recv() and
+ *  written with io_send(), io_send_more() and io_pipe(). A no-op with select()
+ */
+void io_stream_fd(int fd) {
+    if (context.uring)
+        uring_stream(fd);
+}
+
+/** @brief Forget a listening or plain socket before closing it */
+void io_release_fd(int fd) {
+    if (context.uring)
+        uring_release(fd);
+}
+
+/** @brief Take a new connection from a listening socket
+ *
+ *  @return The connected socket, non-blocking. -1 on error, errno is EAGAIN
+ *          if no connection is pending
+ */
+int io_accept(int listen_fd, struct sockaddr *addr, socklen_t *addr_len) {
+    int fd;
+
+    if (!by_completion(listen_fd))
+        return accept4(listen_fd, addr, addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    // A multishot accept does not keep the address of each peer
+    if ((fd = uring_accept(listen_fd)) != -1 &&
+        getpeername(fd, addr, addr_len) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** @brief Tell the io_uring engine what is watched for fd now */
+static void update_uring(int fd) {
+    if (context.uring)
+        uring_watch(fd, (FD_ISSET(fd, &context.read_fds_cpy) ? POLLIN : 0) |
+                        (FD_ISSET(fd, &context.write_fds_cpy) ? POLLOUT : 0));
 }
 
 void add_read_fd(int fd) {
     FD_SET(fd, &context.read_fds_cpy);
     if (fd > context.fd_max)
         context.fd_max = fd;
+    update_uring(fd);
 }
 
 void remove_read_fd(int fd) {
     FD_CLR(fd, &context.read_fds_cpy);
+    update_uring(fd);
 }
 
 int test_read_fd(int fd) {
@@ -244,23 +555,84 @@ void add_write_fd(int fd) {
     FD_SET(fd, &context.write_fds_cpy);
     if (fd > context.fd_max)
         context.fd_max = fd;
+    update_uring(fd);
 }
 
 void remove_write_fd(int fd) {
     FD_CLR(fd, &context.write_fds_cpy);
+    update_uring(fd);
 }
 
 int test_write_fd(int fd) {
     return FD_ISSET(fd, &context.write_fds);
 }
 
+/** @brief The fds found ready by the last io_select()
+ *
+ *  The caller touches only the connections which are ready, however many are
+ *  idle.
+ *
+ *  @param fds Set to the fds ready for reading, writing or both
+ *  @return Number of fds in *fds
+ */
+int io_ready_fds(int **fds) {
+    *fds = context.ready_fds;
+    return context.nready;
+}
+
+/** @brief List the fds set in the sets select() returned
+ *
+ *  The sets are scanned a word at a time, so the words of idle fds are
+ *  skipped at once and each ready fd costs one step.
+ */
+static void collect_ready() {
+    unsigned long *r = (unsigned long *)&context.read_fds;
+    unsigned long *w = (unsigned long *)&context.write_fds;
+    unsigned long bits;
+    int i, word_bits = 8 * sizeof(unsigned long);
+
+    context.nready = 0;
+    for (i = 0; i <= context.fd_max / word_bits; ++i)
+        for (bits = r[i] | w[i]; bits != 0; bits &= bits - 1)
+            context.ready_fds[context.nready++] =
+                i * word_bits + __builtin_ctzl(bits);
+}
+
+/** @brief Get the buffer memory counters */
+buf_stats_t* buf_get_stats() {
+    return &stats;
+}
+
 /** @brief Wrapper for select()
  *
+ *  The fds found ready are then listed, see io_ready_fds(). The bytes written
+ *  by io_wake() are consumed.
+ *
+ *  @param timeout Passed to select(). NULL to wait without timeout
  *  @return What select() returns
  */
-int io_select() {
-    context.read_fds = context.read_fds_cpy;
-    context.write_fds = context.write_fds_cpy;
-    return select(context.fd_max + 1, &context.read_fds, &context.write_fds,
-        NULL, NULL);
+int io_select(struct timeval *timeout) {
+    int ret;
+
+    char drain[64];
+
+    context.nready = 0;
+    if (context.uring)
+        ret = uring_wait(timeout, &context.read_fds, &context.write_fds,
+                         context.ready_fds, &context.nready);
+    else {
+        context.read_fds = context.read_fds_cpy;
+        context.write_fds = context.write_fds_cpy;
+        ret = select(context.fd_max + 1, &context.read_fds,
+                     &context.write_fds, NULL, timeout);
+        if (ret > 0)
+            collect_ready();
+    }
+
+    // Signals handled since the last wait, the caller checks its flags
+    if (ret > 0 && context.wake_fds[0] != -1 &&
+            FD_ISSET(context.wake_fds[0], &context.read_fds))
+        while (read(context.wake_fds[0], drain, sizeof(drain)) > 0)
+            ;
+    return ret;
 }
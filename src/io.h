@@ -7,6 +7,8 @@
 #define __MYIO_H__
 
 #include <unistd.h>
+#include <sys/time.h>
+#include <sys/socket.h>
 #include <openssl/ssl.h>
 
 /*
@@ -14,11 +16,40 @@
  */
 #define BUFSIZE 1024
 
-/** @brief Context for using select */
+/*
+ * Pipe buffer size. One pipe step sends at most this much, which is also the
+ * largest TLS record
+ */
+#define PIPE_BUFSIZE (16 * BUFSIZE)
+
+/* Kernel TLS offload is available at build time */
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_KTLS)
+#define USE_KTLS
+#endif
+
+/* io_recv(): no data available on a non-blocking socket */
+#define IO_AGAIN (-2)
+
+/** @brief Context for using select
+ *
+ *  The _cpy sets are the fds watched. The others are the fds found ready. With
+ *  the io_uring engine, see uring.c, the ready ones are filled from the
+ *  completions instead of select().
+ *
+ *  ready_fds lists the fds found ready, so the loop visits them without
+ *  looking at the idle ones.
+ *
+ *  A signal may come after the loop checked its flags and before the wait
+ *  starts. Its handler writes a byte to wake_fds, so the wait returns anyway.
+ */
 typedef struct {
     fd_set read_fds, read_fds_cpy;
     fd_set write_fds, write_fds_cpy;
     int fd_max;
+    int uring;          //<!io_uring engine in use
+    int ready_fds[FD_SETSIZE];
+    int nready;         //<!number of fds in ready_fds
+    int wake_fds[2];    //<!self-pipe written by signal handlers, see io_wake()
 } select_context;
 
 /** @brief A dynamic size buffer */
@@ -38,37 +69,72 @@ typedef struct {
  *
  *  Data in from_fd will be first read into buf, and directly sent out. This
  *  process will be repeated until an error occurs or an EOF is read.
+ *
+ *  If from_fd is a regular file, file_left is its size and the kernel copies
+ *  the file to the socket with sendfile(), without going through buf.
+ *
+ *  Pipes of pipelined responses are queued in order. The bytes of the next
+ *  responses, written while this pipe is queued, wait in after.
  */
-typedef struct {
+typedef struct pipe {
     int from_fd;
-    char buf[BUFSIZE];
+    char buf[PIPE_BUFSIZE];
     int offset;
     int datasize;
+    off_t file_pos;     //<!next byte of the file to send
+    off_t file_left;    //<!bytes of the file not sent yet. -1 if not a file
+    off_t sent;         //<!bytes sent to the client
+    int ends_piping;    //<!CGI output, the client leaves C_PIPING after it
+    buf_t *after;       //<!bytes to send once drained. NULL if none
+    struct pipe *next;  //<!next pipe in the response queue
 } pipe_t;
 
+/** @brief Memory held by buffers and pipes, see budgets in config.h */
+typedef struct {
+    long bytes;         //<!allocated now
+    long peak;          //<!highest value of bytes
+    int paused;         //<!clients not being read because of a budget
+    long pauses;        //<!times reading from a client was paused
+} buf_stats_t;
+
 /* Init and deinit data structure */
 buf_t* init_buf();
 void deinit_buf(buf_t *bp);
 pipe_t* init_pipe();
+void deinit_pipe(pipe_t *pp);
+int pipe_pending(pipe_t *pp);
+buf_stats_t* buf_get_stats();
 
 /* Monitor dynamic buffer */
 int full(buf_t *bp);
 int empty(buf_t *bp);
 void io_shrink(buf_t *bp);
+void buf_write(buf_t *bp, char *buf, int buf_len);
+void bprintf(buf_t *bp, char *format, ...);
 
 /* Send/recv with client */
 int io_recv(int sock, buf_t *bp, SSL* ssl_context);
 int io_send(int sock, buf_t *bp, SSL* ssl_context);
+int io_send_more(int sock, buf_t *bp, SSL* ssl_context, int more);
 int io_pipe(int sock, pipe_t *pp, SSL* ssl_context);
 
 /* Select context */
-int io_select();       // Shorthand for select
-void init_select_context();
+int io_select(struct timeval *timeout);     // Shorthand for select
+int io_ready_fds(int **fds);                // Fds found ready by select
+void init_select_context(int use_uring);
+void finalize_select_context();
 void add_read_fd(int fd);
 void remove_read_fd(int fd);
 int test_read_fd(int fd);
 void add_write_fd(int fd);
 void remove_write_fd(int fd);
 int test_write_fd(int fd);
+void io_wake();
+
+/* Sockets served by completion with the io_uring engine */
+void io_listen_fd(int fd);
+void io_stream_fd(int fd);
+void io_release_fd(int fd);
+int io_accept(int listen_fd, struct sockaddr *addr, socklen_t *addr_len);
 
 #endif
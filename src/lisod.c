@@ -10,12 +10,74 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <string.h>
 #include "config.h"
 #include "server.h"
 #include "log.h"
+#include "io.h"
+#include "mem.h"
 
 char* http_version = "HTTP/1.1";
 
+char *fcgi_socket = NULL;
+int fcgi_conns = 4;
+int fcgi_mpx = 1;
+
+int cgi_max_children = 16;
+int cgi_queue_len = 64;
+int cgi_timeout = 30;
+int cgi_cpu_limit = 0;
+int cgi_mem_limit = 0;
+
+int tls_cache_size = 20480;
+int tls_ticket_rotate = 3600;
+int tls_workers = 0;
+
+int keepalive_timeout = 15;
+int header_timeout = 20;
+int body_timeout = 30;
+int write_timeout = 30;
+
+int conn_buf_limit = 1024;
+int total_buf_limit = 256;
+
+char *io_engine = "select";
+
+char *access_log_file = NULL;
+char *access_log_format = "combined";
+
+int server_status = 0;
+
+char *admin_socket = NULL;
+
+/* Options which may be given before or after the positional arguments */
+static struct option long_options[] = {
+	{ "fastcgi", required_argument, NULL, 'f' },
+	{ "fastcgi-conns", required_argument, NULL, 'c' },
+	{ "fastcgi-mpx", required_argument, NULL, 'm' },
+	{ "cgi-max-children", required_argument, NULL, 'C' },
+	{ "cgi-queue", required_argument, NULL, 'Q' },
+	{ "cgi-timeout", required_argument, NULL, 'T' },
+	{ "cgi-cpu", required_argument, NULL, 'U' },
+	{ "cgi-mem", required_argument, NULL, 'M' },
+	{ "tls-cache", required_argument, NULL, 'S' },
+	{ "tls-ticket-rotate", required_argument, NULL, 'R' },
+	{ "tls-workers", required_argument, NULL, 'W' },
+	{ "keepalive-timeout", required_argument, NULL, 'k' },
+	{ "header-timeout", required_argument, NULL, 'h' },
+	{ "body-timeout", required_argument, NULL, 'b' },
+	{ "write-timeout", required_argument, NULL, 'w' },
+	{ "conn-buf-limit", required_argument, NULL, 'L' },
+	{ "total-buf-limit", required_argument, NULL, 'G' },
+	{ "io-engine", required_argument, NULL, 'E' },
+	{ "access-log", required_argument, NULL, 'A' },
+	{ "access-log-format", required_argument, NULL, 'F' },
+	{ "server-status", no_argument, NULL, 'P' },
+	{ "admin-socket", required_argument, NULL, 'a' },
+	{ NULL, 0, NULL, 0 }
+};
+
 /**
  * SIGHUP indicates that the config file should be reloaded.
  */
@@ -23,24 +85,22 @@ static void sighup_handler(int sig) {
 }
 
 /**
- * SIGTERM informs the server to terminate. Finalization work here
+ * SIGTERM informs the server to terminate. The serving loop sees terminate,
+ * as io_wake() ends its wait, and finalizes. Nothing else is safe to do here:
+ * finalize() takes locks and joins threads the loop may be in the middle of.
+ * The wake up is not lost if the signal comes just before the wait starts.
  */
 static void sigterm_handler(int sig) {
 	terminate = 1;
-	finalize();
-	log_msg(L_INFO, "Server terminated. Bye~");
-	exit(EXIT_SUCCESS);
+	io_wake();
 }
 
 /**
- * Reap terminated child process
+ * Terminated child processes are reaped by the CGI supervisor in the serving
+ * loop. The signal only ends its wait so that it happens promptly.
  */
 static void sigchld_handler(int sig) {
-	pid_t pid;
-	int status;
-
-	while ((pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0)
-		log_msg(L_INFO, "Reap child process %d\n", pid);
+	io_wake();
 }
 
 static void usage() {
@@ -55,12 +115,129 @@ static void usage() {
 	fprintf(stderr, "redirect all /cgi/* URIs. In the real world, this would likely be a directory of executable programs.\n");
 	fprintf(stderr, "	private key file – private key file path\n");
 	fprintf(stderr, "	certificate file – certificate file path\n");
+	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "	--fastcgi <socket> – send /cgi/* URIs to the FastCGI workers ");
+	fprintf(stderr, "listening on this UNIX socket instead of fork()ing the CGI script\n");
+	fprintf(stderr, "	--fastcgi-conns <n> – persistent connections to the workers(default 4)\n");
+	fprintf(stderr, "	--fastcgi-mpx <n> – requests multiplexed on one connection(default 1)\n");
+	fprintf(stderr, "	--cgi-max-children <n> – CGI scripts running at the same time(default 16)\n");
+	fprintf(stderr, "	--cgi-queue <n> – CGI requests waiting for a free slot(default 64)\n");
+	fprintf(stderr, "	--cgi-timeout <sec> – kill CGI scripts running longer(default 30)\n");
+	fprintf(stderr, "	--cgi-cpu <sec> – CPU time limit of a CGI script(default unlimited)\n");
+	fprintf(stderr, "	--cgi-mem <MB> – address space limit of a CGI script(default unlimited)\n");
+	fprintf(stderr, "	--tls-cache <n> – TLS sessions kept by the server(default 20480)\n");
+	fprintf(stderr, "	--tls-ticket-rotate <sec> – lifetime of a session ticket key(default 3600)\n");
+	fprintf(stderr, "	--tls-workers <n> – threads doing TLS handshakes(default 0, in the loop)\n");
+	fprintf(stderr, "	--keepalive-timeout <sec> – idle time between requests(default 15)\n");
+	fprintf(stderr, "	--header-timeout <sec> – time to send request headers(default 20)\n");
+	fprintf(stderr, "	--body-timeout <sec> – request body stall limit(default 30)\n");
+	fprintf(stderr, "	--write-timeout <sec> – response write stall limit(default 30)\n");
+	fprintf(stderr, "	--conn-buf-limit <KB> – pending input or output per connection(default 1024)\n");
+	fprintf(stderr, "	--total-buf-limit <MB> – buffer memory of the server(default 256)\n");
+	fprintf(stderr, "	--io-engine <select|uring> – wait for fds with select(), or accept, ");
+	fprintf(stderr, "recv and send through io_uring; falls back to select()(default select)\n");
+	fprintf(stderr, "	--access-log <file> – log each response(default none)\n");
+	fprintf(stderr, "	--access-log-format <combined|binary> – format of the access log");
+	fprintf(stderr, "(default combined)\n");
+	fprintf(stderr, "	--server-status – serve counters on /server-status, and on /metrics ");
+	fprintf(stderr, "for Prometheus(default off)\n");
+	fprintf(stderr, "	--admin-socket <path> – UNIX socket taking admin commands: ");
+	fprintf(stderr, "connections, log mask, drain, counters(default none)\n");
+}
+
+/** @brief Parse options, leaving positional arguments at argv[optind]
+ *
+ *  @return 0 on success. -1 on unknown option
+ */
+static int parse_options(int argc, char* argv[]) {
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'f':
+			fcgi_socket = optarg;
+			break;
+		case 'c':
+			fcgi_conns = atoi(optarg);
+			break;
+		case 'm':
+			fcgi_mpx = atoi(optarg);
+			break;
+		case 'C':
+			cgi_max_children = atoi(optarg);
+			break;
+		case 'Q':
+			cgi_queue_len = atoi(optarg);
+			break;
+		case 'T':
+			cgi_timeout = atoi(optarg);
+			break;
+		case 'U':
+			cgi_cpu_limit = atoi(optarg);
+			break;
+		case 'M':
+			cgi_mem_limit = atoi(optarg);
+			break;
+		case 'S':
+			tls_cache_size = atoi(optarg);
+			break;
+		case 'R':
+			tls_ticket_rotate = atoi(optarg);
+			break;
+		case 'W':
+			tls_workers = atoi(optarg);
+			break;
+		case 'k':
+			keepalive_timeout = atoi(optarg);
+			break;
+		case 'h':
+			header_timeout = atoi(optarg);
+			break;
+		case 'b':
+			body_timeout = atoi(optarg);
+			break;
+		case 'w':
+			write_timeout = atoi(optarg);
+			break;
+		case 'L':
+			conn_buf_limit = atoi(optarg);
+			break;
+		case 'G':
+			total_buf_limit = atoi(optarg);
+			break;
+		case 'E':
+			if (strcmp(optarg, "select") != 0 && strcmp(optarg, "uring") != 0) {
+				fprintf(stderr, "Unknown io engine %s\n", optarg);
+				return -1;
+			}
+			io_engine = optarg;
+			break;
+		case 'A':
+			access_log_file = optarg;
+			break;
+		case 'F':
+			access_log_format = optarg;
+			break;
+		case 'P':
+			server_status = 1;
+			break;
+		case 'a':
+			admin_socket = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 /** @brief Set up log system */
 static void config_log() {
 	log_mask = L_ERROR | L_HTTP_DEBUG | L_INFO;
 	set_log_file(log_file_name);
+	if (access_log_file != NULL && set_access_log_file(access_log_file) == -1)
+		access_log_file = NULL;
 }
 
 /** @brief daemonize the server */
@@ -124,10 +301,14 @@ static void daemonize(char* lock_file) {
 
 int main(int argc, char* argv[])
 {
-	if (argc < 9) {
+	// Before OpenSSL allocates anything
+	mem_init();
+
+	if (parse_options(argc, argv) == -1 || argc - optind < 8) {
 		usage();
 		return -1;
 	}
+	argv += optind - 1;
 
 	http_port = atoi(argv[1]);
 	https_port = atoi(argv[2]);
@@ -141,6 +322,7 @@ int main(int argc, char* argv[])
 	daemonize(lock_file);
 
 	serve();
+	log_finalize();
 
 	return 0;
 }
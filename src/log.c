@@ -6,6 +6,27 @@
  *  defined in log.h. log_mask is basically a bit map of what message should be
  *  logged. By setting log_mask, we can output a specific part of logs.
  *
+ *  Once the log file is set, logging is asynchronous. log_msg() formats the
+ *  message into a slot of a ring buffer and returns, it makes no system call.
+ *  A writer thread takes the messages out of the ring every LOG_FLUSH_MS
+ *  milliseconds, or sooner when the ring is half full, and writes them to the
+ *  file in one batch.
+ *
+ *  The ring is a bounded multi-producer queue without locks, since the TLS
+ *  handshake workers log too. Each slot carries a sequence number telling
+ *  whether it is free for the producer of a given position, or filled for the
+ *  writer. A producer claims a position with a compare-and-swap on the tail.
+ *  When the ring is full, the message is dropped and counted, the server never
+ *  waits for the disk. The writer reports the drops in the log.
+ *
+ *  None of this is async-signal-safe. A message logged from a signal handler
+ *  could interrupt its own thread between claiming and filling a slot, and the
+ *  writer would stop there. Signal handlers only set flags.
+ *
+ *  The access log(see access_log.c) has a ring of its own, so a flood of debug
+ *  messages cannot push its records out. The writer drains both rings, and
+ *  counts their drops apart.
+ *
  *  @author Chao Xin(cxin)
  *
  */
@@ -13,24 +34,244 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
 #include "log.h"
 
 FILE *log_file = NULL;
 int log_mask = L_ERROR; //By default, only error message will be logged.
 
+/** @brief A slot of a ring */
+typedef struct {
+    unsigned long seq;          //<!position it is free or filled for
+    int len;
+    char text[LOG_LINE_MAX];
+} log_slot_t;
+
+/** @brief A ring of slots */
+typedef struct {
+    log_slot_t *slots;
+    unsigned long size;         //<!a power of 2
+    unsigned long tail;         //<!next position for a producer
+    unsigned long head;         //<!next position for the writer
+    unsigned long *dropped;     //<!the counter of its drops
+} log_ring_t;
+
+static FILE *access_file = NULL;
+
+static log_stats_t stats;
+static log_slot_t msg_slots[LOG_RING_SLOTS];
+static log_slot_t access_slots[LOG_ACCESS_SLOTS];
+static log_ring_t msg_ring = { msg_slots, LOG_RING_SLOTS, 0, 0,
+                               &stats.dropped };
+static log_ring_t access_ring = { access_slots, LOG_ACCESS_SLOTS, 0, 0,
+                                  &stats.access_dropped };
+static int started = 0;
+static int stopping = 0;
+static pthread_t writer;
+/* Only for the writer to sleep on, producers never take it */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+/** @brief Write the slots filled in a ring to a file
+ *
+ *  @param last Set to the last character written, if not NULL
+ *  @return Number of slots written
+ */
+static int drain_ring(log_ring_t *r, FILE *f, char *last) {
+    unsigned long pos = r->head;
+    log_slot_t *slot;
+    int n = 0;
+
+    for (;; ++pos, ++n) {
+        slot = &r->slots[pos & (r->size - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+        fwrite(slot->text, 1, slot->len, f);
+        if (last != NULL && slot->len > 0)
+            *last = slot->text[slot->len - 1];
+        // Free for the producer one lap later
+        __atomic_store_n(&slot->seq, pos + r->size, __ATOMIC_RELEASE);
+        __atomic_store_n(&r->head, pos + 1, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/** @brief Write the messages and access records in the rings to their files
+ *
+ *  @return Number of messages and records written
+ */
+static int drain() {
+    static unsigned long reported = 0, access_reported = 0;
+    static char last = '\n';
+    unsigned long dropped, access_dropped;
+    int n;
+
+    n = drain_ring(&msg_ring, log_file, &last);
+    if (access_file != NULL)
+        n += drain_ring(&access_ring, access_file, NULL);
+
+    // On a line of its own, a message may end without \n
+    dropped = __atomic_load_n(&stats.dropped, __ATOMIC_RELAXED);
+    if (dropped != reported) {
+        fprintf(log_file, "%sLog ring full, %lu messages dropped\n",
+                last == '\n' ? "" : "\n", dropped - reported);
+        last = '\n';
+    }
+    access_dropped = __atomic_load_n(&stats.access_dropped, __ATOMIC_RELAXED);
+    if (access_dropped != access_reported) {
+        fprintf(log_file, "%sAccess log ring full, %lu records dropped\n",
+                last == '\n' ? "" : "\n", access_dropped - access_reported);
+        last = '\n';
+    }
+
+    if (n > 0 || dropped != reported || access_dropped != access_reported) {
+        fflush(log_file);
+        if (access_file != NULL)
+            fflush(access_file);
+        stats.written += n;
+        stats.batches += 1;
+        reported = dropped;
+        access_reported = access_dropped;
+    }
+    return n;
+}
+
+/** @brief Main function of the writer thread */
+static void* write_loop(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&writer_lock);
+    while (!stopping) {
+        pthread_mutex_unlock(&writer_lock);
+        drain();
+        pthread_mutex_lock(&writer_lock);
+        if (stopping)
+            break;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&writer_cond, &writer_lock, &deadline);
+    }
+    pthread_mutex_unlock(&writer_lock);
+
+    drain();
+    return NULL;
+}
+
 /** @brief Set the file where logs will be output to
+ *
+ *  Starts the writer thread. Until then, and if it cannot start, messages
+ *  are written synchronously.
  *
  *  @param fname The log file name
  *  @return void
  */
 void set_log_file(char *fname) {
     FILE *f;
+    sigset_t all, old;
+    int i, ret;
 
     if ((f = fopen(fname, "w")) == NULL) {
         log_error("set_log_file error");
         return;
     }
     log_file = f;
+
+    for (i = 0; i < LOG_RING_SLOTS; ++i)
+        msg_slots[i].seq = i;
+    for (i = 0; i < LOG_ACCESS_SLOTS; ++i)
+        access_slots[i].seq = i;
+    /* Signals go to the serving loop, the writer inherits a full mask */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&writer, NULL, write_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        log_msg(L_ERROR, "Error creating log writer thread.\n");
+        return;
+    }
+    started = 1;
+}
+
+/** @brief Open the access log file, in append mode
+ *
+ *  @return 0 if ok. -1 if the file cannot be opened
+ */
+int set_access_log_file(char *fname) {
+    if ((access_file = fopen(fname, "a")) == NULL) {
+        log_error("set_access_log_file error");
+        return -1;
+    }
+    return 0;
+}
+
+/** @brief Claim a slot of a ring without blocking
+ *
+ *  @param pos_out The position of the slot, to publish it
+ *  @return The slot. NULL if the ring is full, the message is dropped
+ */
+static log_slot_t* claim(log_ring_t *r, unsigned long *pos_out) {
+    unsigned long pos;
+    log_slot_t *slot;
+    long diff;
+
+    pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &r->slots[pos & (r->size - 1)];
+        diff = (long)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            // The writer has not freed the slot yet: full
+            __atomic_add_fetch(r->dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+
+    *pos_out = pos;
+    return slot;
+}
+
+/** @brief Hand a filled slot to the writer */
+static void publish(log_ring_t *r, log_slot_t *slot, unsigned long pos) {
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // Wake the writer early once per crossing of the half mark
+    if (pos - __atomic_load_n(&r->head, __ATOMIC_RELAXED) == r->size / 2)
+        pthread_cond_signal(&writer_cond);
+}
+
+/** @brief Put a message into the ring without blocking
+ *
+ *  A message longer than LOG_LINE_MAX is cut, and still ends in \n.
+ */
+static void log_async(char* format, va_list arguments) {
+    unsigned long pos;
+    log_slot_t *slot;
+    int len;
+
+    if ((slot = claim(&msg_ring, &pos)) == NULL)
+        return;
+
+    len = vsnprintf(slot->text, LOG_LINE_MAX, format, arguments);
+    if (len < 0)
+        len = 0;
+    if (len >= LOG_LINE_MAX) {
+        len = LOG_LINE_MAX - 1;
+        if (slot->text[len - 1] != '\n')
+            slot->text[len - 1] = '\n';
+        __atomic_add_fetch(&stats.truncated, 1, __ATOMIC_RELAXED);
+    }
+    slot->len = len;
+    publish(&msg_ring, slot, pos);
 }
 
 /** @brief Write formatted logs
@@ -38,7 +279,7 @@ void set_log_file(char *fname) {
  *  Create a new log message with given type(Defined in log.h). The message
  *  will be written into log file if the type is in log_mask.
  *
- *  The output in this function is implemented using vfprintf. Thus this
+ *  The output in this function is implemented using vsnprintf. Thus this
  *  function can be used like printf(char* format, ... )
  *
  *  When log_file is NULL, the message will be output to stderr
@@ -52,16 +293,19 @@ void set_log_file(char *fname) {
 void log_msg(int type, char* format, ...) {
     va_list arguments;
 
-    if ((type & log_mask) != 0) {
-        va_start(arguments, format);
-        if (log_file == NULL)
-            vfprintf(stderr, format, arguments);
-        else
-            vfprintf(log_file, format, arguments);
-        va_end(arguments);
-    }
+    if ((type & log_mask) == 0)
+        return;
 
-    fflush(log_file);
+    va_start(arguments, format);
+    if (started)
+        log_async(format, arguments);
+    else if (log_file == NULL)
+        vfprintf(stderr, format, arguments);
+    else {
+        vfprintf(log_file, format, arguments);
+        fflush(log_file);
+    }
+    va_end(arguments);
 }
 
 /** @brief Write an error log
@@ -75,4 +319,56 @@ void log_msg(int type, char* format, ...) {
  */
 void log_error(char* msg) {
     log_msg(L_ERROR, "%s : %s\n", msg, strerror(errno));
-}
\ No newline at end of file
+}
+
+/** @brief Write a record to the access log
+ *
+ *  The record is written as is, it may be binary. It is cut to LOG_LINE_MAX.
+ *
+ *  @param data The record
+ *  @param len Its length
+ */
+void log_access(char *data, int len) {
+    unsigned long pos;
+    log_slot_t *slot;
+
+    if (access_file == NULL)
+        return;
+    if (len > LOG_LINE_MAX) {
+        len = LOG_LINE_MAX;
+        __atomic_add_fetch(&stats.truncated, 1, __ATOMIC_RELAXED);
+    }
+
+    if (!started) {
+        fwrite(data, 1, len, access_file);
+        fflush(access_file);
+        return;
+    }
+    if ((slot = claim(&access_ring, &pos)) == NULL)
+        return;
+    memcpy(slot->text, data, len);
+    slot->len = len;
+    publish(&access_ring, slot, pos);
+}
+
+/** @brief Stop the writer thread after it wrote the messages left
+ *
+ *  Later messages are written synchronously. Called by main() once the
+ *  server loop is over.
+ */
+void log_finalize() {
+    if (!started)
+        return;
+
+    pthread_mutex_lock(&writer_lock);
+    stopping = 1;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_lock);
+    pthread_join(writer, NULL);
+    started = 0;
+}
+
+/** @brief Get the counters */
+log_stats_t* log_get_stats() {
+    return &stats;
+}
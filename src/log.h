@@ -14,6 +14,21 @@
 #define L_IO_DEBUG 0x4
 #define L_HTTP_DEBUG 0x8
 
+/* Asynchronous logging, see log.c */
+#define LOG_RING_SLOTS 4096     //Messages the ring holds. A power of 2
+#define LOG_ACCESS_SLOTS 4096   //Access records their ring holds. A power of 2
+#define LOG_LINE_MAX 1024       //Longer messages are cut
+#define LOG_FLUSH_MS 100        //The writer writes at least this often
+
+/** @brief Counters of the log writer */
+typedef struct {
+    unsigned long written;      //<!messages written to the file
+    unsigned long dropped;      //<!messages lost because the ring was full
+    unsigned long access_dropped;   //<!access records lost, their ring was full
+    unsigned long truncated;    //<!messages cut to LOG_LINE_MAX
+    unsigned long batches;      //<!writes of a batch to the file
+} log_stats_t;
+
 /*
  * @brief log_file indicates where to write log. When it's NULL, log will be written
  *        to stderr
@@ -25,8 +40,12 @@ FILE* log_file;
 int log_mask;
 
 void set_log_file(char* fname);
+int set_access_log_file(char* fname);
 
 void log_msg(int type, char* format, ...);
 void log_error(char* msg);
+void log_access(char *data, int len);
+void log_finalize();
+log_stats_t* log_get_stats();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,124 @@
+/** @file mem.c
+ *  @brief Allocations tagged by what they hold, counted per tag
+ *
+ *  Each block starts with a small header holding its size and tag, so that
+ *  mem_free() knows what to subtract. A tag has counters of live bytes, live
+ *  allocations, allocations made and peak bytes, shown on /server-status.
+ *  Memory which grows without its connections is found by tag, and pooling
+ *  work can be checked against the allocation counts.
+ *
+ *  OpenSSL allocates through the same functions, under MEM_TLS, once
+ *  mem_init() has installed them. Its handshake workers allocate from other
+ *  threads, hence the atomic counters.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <openssl/crypto.h>
+#include "mem.h"
+
+/** @brief Header of a block, keeps the memory after it aligned */
+typedef union {
+    struct {
+        size_t size;
+        int tag;
+    } h;
+    max_align_t align;
+} mem_hdr_t;
+
+static mem_stats_t stats[MEM_TAGS];
+
+static char *tag_names[MEM_TAGS] = { "buf", "pipe", "client", "request",
+                                     "header", "cgi", "tls" };
+
+/** @brief Count size more bytes for a tag, or less if negative */
+static void account(int tag, long size, int count) {
+    mem_stats_t *s = stats + tag;
+    long bytes;
+
+    bytes = __atomic_add_fetch(&s->bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->count, count, __ATOMIC_RELAXED);
+    if (count > 0)
+        __atomic_add_fetch(&s->allocs, count, __ATOMIC_RELAXED);
+    // Racy between threads, a peak may be missed by a few bytes
+    if (bytes > s->peak)
+        s->peak = bytes;
+}
+
+/** @brief Allocate memory for a tag, like malloc() */
+void* mem_alloc(int tag, size_t size) {
+    mem_hdr_t *hdr = malloc(sizeof(mem_hdr_t) + size);
+
+    if (hdr == NULL)
+        return NULL;
+    hdr->h.size = size;
+    hdr->h.tag = tag;
+    account(tag, size, 1);
+    return hdr + 1;
+}
+
+/** @brief Resize memory, like realloc()
+ *
+ *  @param tag The tag of a new block, when ptr is NULL. A block keeps its tag
+ */
+void* mem_realloc(int tag, void *ptr, size_t size) {
+    mem_hdr_t *hdr;
+    size_t old;
+
+    if (ptr == NULL)
+        return mem_alloc(tag, size);
+    if (size == 0) {
+        mem_free(ptr);
+        return NULL;
+    }
+
+    hdr = (mem_hdr_t *)ptr - 1;
+    old = hdr->h.size;
+    if ((hdr = realloc(hdr, sizeof(mem_hdr_t) + size)) == NULL)
+        return NULL;
+    hdr->h.size = size;
+    account(hdr->h.tag, (long)size - (long)old, 0);
+    return hdr + 1;
+}
+
+/** @brief Free memory from mem_alloc() or mem_realloc() */
+void mem_free(void *ptr) {
+    mem_hdr_t *hdr;
+
+    if (ptr == NULL)
+        return;
+    hdr = (mem_hdr_t *)ptr - 1;
+    account(hdr->h.tag, -(long)hdr->h.size, -1);
+    free(hdr);
+}
+
+static void* tls_alloc(size_t size, const char *file, int line) {
+    return mem_alloc(MEM_TLS, size);
+}
+
+static void* tls_realloc(void *ptr, size_t size, const char *file, int line) {
+    return mem_realloc(MEM_TLS, ptr, size);
+}
+
+static void tls_free(void *ptr, const char *file, int line) {
+    mem_free(ptr);
+}
+
+/** @brief Have OpenSSL allocate under MEM_TLS
+ *
+ *  Must be called before anything else uses OpenSSL, which refuses to change
+ *  its allocator after its first allocation.
+ */
+void mem_init() {
+    CRYPTO_set_mem_functions(tls_alloc, tls_realloc, tls_free);
+}
+
+/** @brief Get the counters, an array of MEM_TAGS */
+mem_stats_t* mem_get_stats() {
+    return stats;
+}
+
+/** @brief The name of a tag */
+char* mem_tag_name(int tag) {
+    return tag_names[tag];
+}
@@ -0,0 +1,36 @@
+/** @file mem.h
+ *  @brief Allocations tagged by what they hold, counted per tag
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include <stddef.h>
+
+/* Tags */
+#define MEM_BUF 0           //buf_t and their data
+#define MEM_PIPE 1          //pipe_t, with their PIPE_BUFSIZE buffer
+#define MEM_CLIENT 2        //http_client_t
+#define MEM_REQUEST 3       //http_request_t
+#define MEM_HEADER 4        //request headers, their key and value
+#define MEM_CGI 5           //environments of CGI scripts
+#define MEM_TLS 6           //everything allocated by OpenSSL
+#define MEM_TAGS 7
+
+/** @brief Counters of a tag */
+typedef struct {
+    long bytes;             //<!live bytes
+    long count;             //<!live allocations
+    long allocs;            //<!allocations made
+    long peak;              //<!highest value of bytes
+} mem_stats_t;
+
+void mem_init();
+void* mem_alloc(int tag, size_t size);
+void* mem_realloc(int tag, void *ptr, size_t size);
+void mem_free(void *ptr);
+mem_stats_t* mem_get_stats();
+char* mem_tag_name(int tag);
+
+#endif
@@ -0,0 +1,309 @@
+/** @file metrics.c
+ *  @brief Counters and latency histograms, served on /server-status
+ *
+ *  The counters are plain integers updated by the server loop, an addition
+ *  per event. Latencies go to log-linear histograms: a value is counted in
+ *  its bucket with a shift and a mask, and percentiles are computed from the
+ *  buckets when the page is served.
+ *
+ *  Everything else on the page is read when it is served: the client table
+ *  is scanned for the connections by status, and the counters of the other
+ *  modules(CGI, TLS, buffers, io_uring, log, memory) are read from their
+ *  stats.
+ *
+ *  /server-status is for humans. /metrics has the same numbers in the
+ *  Prometheus text format, the histograms with power of 2 buckets.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdio.h>
+#include <string.h>
+#include "log.h"
+#include "http_client.h"
+#include "cgi_supervisor.h"
+#include "tls.h"
+#include "uring.h"
+#include "mem.h"
+#include "metrics.h"
+
+static metrics_t metrics;
+
+static char *method_names[METHODS] = { "GET", "HEAD", "POST", "OTHER" };
+
+/** @brief The bucket of a value */
+static int bucket(long long v) {
+    int e;
+
+    if (v < HIST_SUB)
+        return v < 0 ? 0 : v;
+    e = 63 - __builtin_clzll(v);
+    if (e >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB +
+           ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/** @brief The lowest value of a bucket */
+static long long bucket_low(int i) {
+    int e;
+
+    if (i < HIST_SUB)
+        return i;
+    e = i / HIST_SUB + HIST_SUB_BITS - 1;
+    return (long long)(HIST_SUB + i % HIST_SUB) << (e - HIST_SUB_BITS);
+}
+
+/** @brief Count a value in microseconds */
+void hist_record(hist_t *h, long long us) {
+    h->counts[bucket(us)] += 1;
+    h->count += 1;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+/** @brief Count the time from a to b */
+void hist_record_span(hist_t *h, struct timespec *from, struct timespec *to) {
+    hist_record(h, (to->tv_sec - from->tv_sec) * 1000000LL +
+                   (to->tv_nsec - from->tv_nsec) / 1000);
+}
+
+/** @brief The value below which a fraction p of the values are
+ *
+ *  @return The middle of the bucket, at most the max. 0 if the histogram is
+ *          empty
+ */
+long long hist_percentile(hist_t *h, double p) {
+    unsigned long rank, seen = 0;
+    long long mid;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = p * h->count;
+    if (rank >= h->count)
+        rank = h->count - 1;
+    for (i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank)
+            break;
+    }
+    if (i >= HIST_BUCKETS - 1)
+        return h->max;
+    mid = (bucket_low(i) + bucket_low(i + 1)) / 2;
+    return mid > h->max ? h->max : mid;
+}
+
+/** @brief A response has been sent
+ *
+ *  @param method M_GET... -1 if unknown
+ *  @param status HTTP status code. 0 if unknown
+ *  @param total_us Request line to last byte sent
+ */
+void metrics_response(int method, int status, long long total_us) {
+    if (method < 0 || method >= METHODS)
+        method = M_OTHER;
+    if (status < 0 || status >= 600)
+        status = 0;
+    metrics.requests[method][status] += 1;
+    hist_record(&metrics.total, total_us);
+}
+
+/** @brief Get the counters */
+metrics_t* metrics_get() {
+    return &metrics;
+}
+
+/** @brief Count the clients by status */
+static void count_clients(int counts[]) {
+    http_client_t *client;
+    int fd;
+
+    for (fd = 0; fd < FD_SETSIZE; ++fd) {
+        client = client_lookup(fd);
+        if (client != NULL && client->fd == fd && client->status >= 0 &&
+            client->status <= C_HANDSHAKE)
+            counts[client->status] += 1;
+    }
+}
+
+/** @brief Human readable page */
+void metrics_status(buf_t *out) {
+    hist_t *hists[] = { &metrics.parse, &metrics.handler, &metrics.total };
+    char *hist_names[] = { "parse", "handler", "total" };
+    int counts[C_HANDSHAKE + 1] = { 0 };
+    cgi_stats_t *cgi = cgi_get_stats();
+    tls_stats_t *tls = tls_get_stats();
+    buf_stats_t *bufs = buf_get_stats();
+    uring_stats_t *uring = uring_get_stats();
+    log_stats_t *log = log_get_stats();
+    mem_stats_t *mem = mem_get_stats();
+    hist_t *h;
+    int i, j;
+
+    count_clients(counts);
+    bprintf(out, "Connections: %lu accepted, %d active\n", metrics.accepted,
+            client_count());
+    for (i = 0; i <= C_HANDSHAKE; ++i)
+        bprintf(out, "  %-10s %d\n", client_status_name(i), counts[i]);
+
+    bprintf(out, "Requests:\n");
+    for (i = 0; i < METHODS; ++i)
+        for (j = 0; j < 600; ++j)
+            if (metrics.requests[i][j] != 0)
+                bprintf(out, "  %-5s %3d %lu\n", method_names[i], j,
+                        metrics.requests[i][j]);
+    bprintf(out, "Bytes: %llu in, %llu out\n", metrics.bytes_in,
+            metrics.bytes_out);
+
+    bprintf(out, "Latency(us) %10s %8s %8s %8s %8s %8s %8s\n", "count",
+            "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < 3; ++i) {
+        h = hists[i];
+        bprintf(out, "  %-9s %10lu %8lld %8lld %8lld %8lld %8lld %8lld\n",
+                hist_names[i], h->count, h->count ? h->sum / h->count : 0,
+                hist_percentile(h, 0.5), hist_percentile(h, 0.9),
+                hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+    }
+
+    bprintf(out, "CGI: %d running, %d queued, %ld launched, %ld rejected, "
+            "%ld timed out\n", cgi->running, cgi->queued, cgi->launched,
+            cgi->rejected, cgi->timed_out);
+    bprintf(out, "TLS: %ld full, %ld resumed, %ld failed, %ld kTLS\n",
+            tls->full, tls->resumed, tls->failed, tls->ktls);
+    bprintf(out, "Buffers: %ld bytes, %ld peak, %d paused, %ld pauses\n",
+            bufs->bytes, bufs->peak, bufs->paused, bufs->pauses);
+    if (uring->enters != 0)
+        bprintf(out, "io_uring: %ld enters, %ld submitted, %ld completed, "
+                "%ld accepts, %ld recvs, %ld sends\n", uring->enters,
+                uring->submitted, uring->completed, uring->accepts,
+                uring->recvs, uring->sends);
+    bprintf(out, "Log: %lu written, %lu dropped, %lu access records dropped, "
+            "%lu truncated\n", log->written, log->dropped,
+            log->access_dropped, log->truncated);
+
+    bprintf(out, "%-11s %10s %10s %12s %12s\n", "Memory", "bytes", "live",
+            "allocs", "peak");
+    for (i = 0; i < MEM_TAGS; ++i)
+        bprintf(out, "  %-9s %10ld %10ld %12ld %12ld\n", mem_tag_name(i),
+                mem[i].bytes, mem[i].count, mem[i].allocs, mem[i].peak);
+}
+
+/** @brief A histogram in the Prometheus format, in seconds
+ *
+ *  The buckets are the same at each scrape: powers of 2 from 16us to 67s.
+ */
+static void prometheus_hist(buf_t *out, char *name, char *help, hist_t *h) {
+    unsigned long cumulative = 0;
+    long long le;
+    int i = 0;
+
+    bprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (le = 1 << 4; le <= 1 << 26; le <<= 1) {
+        for (; i < HIST_BUCKETS && bucket_low(i) < le; ++i)
+            cumulative += h->counts[i];
+        bprintf(out, "%s_bucket{le=\"%.9g\"} %lu\n", name, le / 1e6, cumulative);
+    }
+    bprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, h->count);
+    bprintf(out, "%s_sum %g\n%s_count %lu\n", name, h->sum / 1e6, name,
+            h->count);
+}
+
+/** @brief One value in the Prometheus format */
+static void prometheus_value(buf_t *out, char *name, char *type, char *help,
+                             double val) {
+    bprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %.0f\n", name, help, name,
+            type, name, val);
+}
+
+/** @brief The Prometheus text format */
+void metrics_prometheus(buf_t *out) {
+    int counts[C_HANDSHAKE + 1] = { 0 };
+    cgi_stats_t *cgi = cgi_get_stats();
+    tls_stats_t *tls = tls_get_stats();
+    buf_stats_t *bufs = buf_get_stats();
+    uring_stats_t *uring = uring_get_stats();
+    log_stats_t *log = log_get_stats();
+    mem_stats_t *mem = mem_get_stats();
+    int i, j;
+
+    prometheus_value(out, "lisod_connections_accepted_total", "counter",
+                     "Connections accepted", metrics.accepted);
+    prometheus_value(out, "lisod_connections_active", "gauge",
+                     "Connections open", client_count());
+    count_clients(counts);
+    bprintf(out, "# HELP lisod_connections Connections by status\n"
+            "# TYPE lisod_connections gauge\n");
+    for (i = 0; i <= C_HANDSHAKE; ++i)
+        bprintf(out, "lisod_connections{status=\"%s\"} %d\n", client_status_name(i),
+                counts[i]);
+
+    bprintf(out, "# HELP lisod_requests_total Responses sent\n"
+            "# TYPE lisod_requests_total counter\n");
+    for (i = 0; i < METHODS; ++i)
+        for (j = 0; j < 600; ++j)
+            if (metrics.requests[i][j] != 0)
+                bprintf(out, "lisod_requests_total{method=\"%s\",code=\"%d\"} "
+                        "%lu\n", method_names[i], j, metrics.requests[i][j]);
+    prometheus_value(out, "lisod_received_bytes_total", "counter",
+                     "Bytes received from clients", metrics.bytes_in);
+    prometheus_value(out, "lisod_sent_bytes_total", "counter",
+                     "Bytes sent to clients", metrics.bytes_out);
+
+    prometheus_hist(out, "lisod_parse_seconds",
+                    "Request line to complete request", &metrics.parse);
+    prometheus_hist(out, "lisod_handler_seconds",
+                    "Time spent in the request handler", &metrics.handler);
+    prometheus_hist(out, "lisod_request_seconds",
+                    "Request line to last byte of the response sent",
+                    &metrics.total);
+
+    prometheus_value(out, "lisod_cgi_running", "gauge",
+                     "CGI processes running", cgi->running);
+    prometheus_value(out, "lisod_cgi_queued", "gauge",
+                     "CGI requests waiting for a slot", cgi->queued);
+    prometheus_value(out, "lisod_cgi_launched_total", "counter",
+                     "CGI processes launched", cgi->launched);
+    prometheus_value(out, "lisod_cgi_rejected_total", "counter",
+                     "CGI requests refused with 503", cgi->rejected);
+    prometheus_value(out, "lisod_cgi_timed_out_total", "counter",
+                     "CGI processes killed for running too long",
+                     cgi->timed_out);
+
+    bprintf(out, "# HELP lisod_tls_handshakes_total TLS handshakes\n"
+            "# TYPE lisod_tls_handshakes_total counter\n"
+            "lisod_tls_handshakes_total{type=\"full\"} %ld\n"
+            "lisod_tls_handshakes_total{type=\"resumed\"} %ld\n"
+            "lisod_tls_handshakes_total{type=\"failed\"} %ld\n",
+            tls->full, tls->resumed, tls->failed);
+    prometheus_value(out, "lisod_tls_ktls_total", "counter",
+                     "Connections encrypted by the kernel", tls->ktls);
+
+    prometheus_value(out, "lisod_buffer_bytes", "gauge",
+                     "Memory held by buffers and pipes", bufs->bytes);
+    prometheus_value(out, "lisod_buffer_peak_bytes", "gauge",
+                     "Highest memory held by buffers and pipes", bufs->peak);
+    prometheus_value(out, "lisod_clients_paused", "gauge",
+                     "Clients not read because of a buffer budget",
+                     bufs->paused);
+
+    prometheus_value(out, "lisod_uring_enters_total", "counter",
+                     "io_uring_enter() calls", uring->enters);
+    prometheus_value(out, "lisod_log_dropped_total", "counter",
+                     "Log messages dropped because the ring was full",
+                     log->dropped);
+    prometheus_value(out, "lisod_access_log_dropped_total", "counter",
+                     "Access log records dropped because their ring was full",
+                     log->access_dropped);
+
+    bprintf(out, "# HELP lisod_memory_bytes Memory allocated, by tag\n"
+            "# TYPE lisod_memory_bytes gauge\n");
+    for (i = 0; i < MEM_TAGS; ++i)
+        bprintf(out, "lisod_memory_bytes{tag=\"%s\"} %ld\n", mem_tag_name(i),
+                mem[i].bytes);
+    bprintf(out, "# HELP lisod_memory_allocations_total Allocations, by tag\n"
+            "# TYPE lisod_memory_allocations_total counter\n");
+    for (i = 0; i < MEM_TAGS; ++i)
+        bprintf(out, "lisod_memory_allocations_total{tag=\"%s\"} %ld\n",
+                mem_tag_name(i), mem[i].allocs);
+}
@@ -0,0 +1,53 @@
+/** @file metrics.h
+ *  @brief Counters and latency histograms, served on /server-status
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <time.h>
+#include "io.h"
+
+/*
+ * Histogram buckets. Values below 2^HIST_SUB_BITS have a bucket each. Above,
+ * each power of 2 is split in 2^HIST_SUB_BITS buckets, so a value is known
+ * within 12.5%, like HdrHistogram with one significant digit.
+ */
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40        //Values up to 2^40 us, about 12 days
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Methods counted apart. Others are M_OTHER */
+#define M_OTHER 3
+#define METHODS 4
+
+/** @brief A latency histogram in microseconds */
+typedef struct {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long count;
+    long long sum;
+    long long max;
+} hist_t;
+
+/** @brief Counters of the server */
+typedef struct {
+    unsigned long accepted;         //<!connections accepted
+    unsigned long long bytes_in;    //<!bytes received from clients
+    unsigned long long bytes_out;   //<!bytes sent to clients
+    unsigned long requests[METHODS][600];   //<!responses by method, status
+    hist_t parse;       //<!request line to request complete
+    hist_t handler;     //<!time spent in the handler
+    hist_t total;       //<!request line to last byte of the response sent
+} metrics_t;
+
+void hist_record(hist_t *h, long long us);
+void hist_record_span(hist_t *h, struct timespec *from, struct timespec *to);
+long long hist_percentile(hist_t *h, double p);
+void metrics_response(int method, int status, long long total_us);
+void metrics_status(buf_t *out);
+void metrics_prometheus(buf_t *out);
+metrics_t* metrics_get();
+
+#endif
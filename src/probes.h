@@ -0,0 +1,51 @@
+/** @file probes.h
+ *  @brief USDT probes on the phases of a connection and its requests
+ *
+ *  With <sys/sdt.h>(systemtap-sdt-dev) at build time, each PROBEn() is a nop
+ *  instruction and a note in the ELF file telling where its arguments are.
+ *  Nothing runs until a tracer attaches, bpftrace or perf then replace the nop
+ *  with a breakpoint. Without <sys/sdt.h>, probes compile to nothing.
+ *
+ *  The probes, all in the provider lisod:
+ *
+ *  accept(fd, ip)                          connection accepted
+ *  tls_done(fd, resumed)                   TLS handshake complete
+ *  request_line(fd, id, line)              request line read
+ *  headers(fd, id)                         headers read
+ *  handler_start(fd, id, uri)              request complete, handler called
+ *  handler_end(fd, id, status)             handler returned, 0 if it answered
+ *  first_byte(fd, id)                      first byte of the response sent
+ *  response_done(fd, id, status, bytes)    last byte of the response sent
+ *  close(fd, bytes)                        connection closed, bytes sent
+ *
+ *  id numbers the requests of the server from 1. It is 0 for an error
+ *  response to no request. For example, the handler time by status:
+ *
+ *  bpftrace -e 'usdt:./lisod:lisod:handler_start { @s[arg0] = nsecs; }
+ *      usdt:./lisod:lisod:handler_end /@s[arg0]/ {
+ *      @us[arg2] = hist((nsecs - @s[arg0]) / 1000); delete(@s[arg0]); }'
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/* USDT probes are available at build time. -DNO_SDT leaves them out */
+#if defined(__has_include) && !defined(NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#define USE_SDT
+#endif
+#endif
+
+#ifdef USE_SDT
+#include <sys/sdt.h>
+#define PROBE2(name, a, b) DTRACE_PROBE2(lisod, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(lisod, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(lisod, name, a, b, c, d)
+#else
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif
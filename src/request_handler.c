@@ -3,13 +3,20 @@
  *
  *  @author Chao Xin(cxin)
  */
+#define _GNU_SOURCE         // pipe2, clone
 #include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
@@ -18,6 +25,11 @@
 #include "request_handler.h"
 #include "http_client.h"
 #include "io.h"
+#include "fastcgi.h"
+#include "cgi_supervisor.h"
+#include "resolver.h"
+#include "metrics.h"
+#include "mem.h"
 
 static char* get_mimetype(char* path) {
     char* ext = path + strlen(path) - 1;
@@ -125,6 +137,7 @@ static int server_static_file(http_client_t *client) {
     char last_modifiled[128], date[128], mimetype[128];
     int size, fd;
     time_t current_time;
+    pipe_t *pipe;
 
     if ((fd = open_file(client->req->uri, &size, mimetype, last_modifiled)) < 0)
         return -fd;
@@ -149,33 +162,88 @@ static int server_static_file(http_client_t *client) {
     /**
      * A GET request should send the file content back to the client. Here, we
      * just pipe the file directly to the client socket. See io_pipe() in io.c
-     * for more information
+     * for more information. An empty file has nothing to pipe, and its pipe
+     * would hold the headers back, as they are sent with MSG_MORE
      */
-    if (client->req->method == M_GET) {
-        client->pipe = init_pipe();
-        client->pipe->from_fd = fd;
-        add_read_fd(fd);
+    if (client->req->method == M_GET && size > 0) {
+        pipe = init_pipe();
+        pipe->from_fd = fd;
+        pipe->file_left = size;
+        client_queue_pipe(client, pipe);
     }
     else
         close(fd);
+    access_close(client);
 
     return 0;
 }
 
-/** @brief */
-static char* create_string(char* format, ...) {
-    char buf[MAXBUF];
-    char *str;
+/** @brief Serve the counters of the server, see metrics.c
+ *
+ *  @param prometheus 1 for the Prometheus text format, 0 for humans
+ *  @return 0
+ */
+static int server_status_page(http_client_t *client, int prometheus) {
+    buf_t *body = init_buf();
+    char buf[32];
+
+    if (prometheus)
+        metrics_prometheus(body);
+    else
+        metrics_status(body);
+    sprintf(buf, "%d", body->datasize);
+
+    send_response_line(client, OK);
+    send_header(client, "Content-Type", prometheus ?
+                "text/plain; version=0.0.4" : "text/plain");
+    send_header(client, "Content-Length", buf);
+    send_header(client, "Cache-Control", "no-cache");
+    send_header(client, "Server", "Liso/1.0");
+    if (connection_close(client->req))
+        send_header(client, "Connection", "close");
+    else
+        send_header(client, "Connection", "keep-alive");
+    client_write_string(client, "\r\n");
+
+    if (client->req->method == M_GET)
+        client_write(client, body->buf, body->datasize);
+    deinit_buf(body);
+    access_close(client);
+
+    return 0;
+}
 
+/** @brief Arena holding the environment of a CGI script
+ *
+ *  The environment is built in two passes over the same code. The first pass
+ *  only measures(envp is NULL). Then the pointer array and all strings are
+ *  put in one block of memory, which is filled by the second pass. Thus the
+ *  environment costs a single allocation and can be freed at once.
+ */
+typedef struct {
+    char **envp;        //!<NULL while measuring
+    char *str;          //!<Where the next string goes
+    int count;          //!<Number of variables
+    int size;           //!<Total bytes of strings, including '\0'
+} env_arena_t;
+
+/** @brief Add a formatted "NAME=VALUE" string to the arena */
+static void env_add(env_arena_t *arena, char* format, ...) {
     va_list arguments;
+    int len;
+
     va_start(arguments, format);
-    vsprintf(buf, format, arguments);
+    if (arena->envp == NULL) {
+        len = vsnprintf(NULL, 0, format, arguments);
+    } else {
+        len = vsprintf(arena->str, format, arguments);
+        arena->envp[arena->count] = arena->str;
+        arena->str += len + 1;
+    }
     va_end(arguments);
 
-    str = malloc(sizeof(char) * (strlen(buf) + 1));
-    strcpy(str, buf);
-    str[strlen(buf) + 1] = '\0';
-    return str;
+    arena->count += 1;
+    arena->size += len + 1;
 }
 
 /** @brief Translate a http request header to a cgi environment variable
@@ -196,49 +264,43 @@ static void translate_header(char* http_header, char* cgi_var) {
     cgi_var[strlen(http_header)] = '\0';
 }
 
-/** @brief Setup and return environment variables for cgi script */
-static char** setup_envp(http_client_t* client) {
-    int RFC_VARS = 18;
-    char** envp;
+/** @brief Add all environment variables for a cgi script to the arena
+ *
+ *  @param host Host name of the client, the same in both passes
+ */
+static void fill_envp(http_client_t* client, const char *host,
+                      env_arena_t *arena) {
     char* tmp;
     char buf[MAXBUF];
     http_header_t *h;
-    int i;
     http_request_t *req = client->req;
 
-    envp = malloc(sizeof(char*) * (RFC_VARS + req->cnt_headers + 1));
     /* AUTH_TYPE */
-    envp[0] = create_string("AUTH_TYPE=");
+    env_add(arena, "AUTH_TYPE=");
     /* CONTENT_LENGTH */
     if (req->method == M_POST)
-        envp[1] = create_string("CONTENT_LENGTH=%d", req->content_length);
+        env_add(arena, "CONTENT_LENGTH=%d", req->content_length);
     else
-        envp[1] = create_string("CONTENT_LENGTH=");
+        env_add(arena, "CONTENT_LENGTH=");
     /* CONTENT_TYPE */
     tmp = get_request_header(req, "content-type");
-    if (tmp == NULL)
-        envp[2] = create_string("CONTENT_TYPE=");
-    else
-        envp[2] = create_string("CONTENT_TYPE=%s", tmp);
+    env_add(arena, "CONTENT_TYPE=%s", tmp == NULL ? "" : tmp);
     /* GATEWAY_INTERFACE */
-    envp[3] = create_string("GATEWAY_INTERFACE=CGI/1.1");
+    env_add(arena, "GATEWAY_INTERFACE=CGI/1.1");
     /* PATH_INFO */
-    envp[4] = create_string("PATH_INFO=%s", req->path);
+    env_add(arena, "PATH_INFO=%s", req->path);
     /* PATH_TRANSLATED */
-    envp[5] = create_string("PATH_TRANSLATED=");
+    env_add(arena, "PATH_TRANSLATED=");
     /* QUERY_STRING */
-    envp[6] = create_string("QUERY_STRING=%s", req->query);
+    env_add(arena, "QUERY_STRING=%s", req->query);
     /* REMOTE_ADDR */
-    envp[7] = create_string("REMOTE_ADDR=%s", client->remote_ip);
+    env_add(arena, "REMOTE_ADDR=%s", client->remote_ip);
     /* REMOTE_HOST */
-    if (client->remote_host == NULL)
-        envp[8] = create_string("REMOTE_HOST=");
-    else
-        envp[8] = create_string("REMOTE_HOST=%s", client->remote_host);
+    env_add(arena, "REMOTE_HOST=%s", host);
     /* REMOTE_IDENT */
-    envp[9] = create_string("REMOTE_IDENT=");
+    env_add(arena, "REMOTE_IDENT=");
     /* REMOTE_USER */
-    envp[10] = create_string("REMOTE_USER=");
+    env_add(arena, "REMOTE_USER=");
     /* REQUEST_METHOD */
     tmp = NULL;
     if (req->method == M_HEAD) tmp = "HEAD";
@@ -248,51 +310,75 @@ static char** setup_envp(http_client_t* client) {
         log_msg(L_ERROR, "Unexpected request method: %d\n", req->method);
         tmp = "";
     }
-    envp[11] = create_string("REQUEST_METHOD=%s", tmp);
+    env_add(arena, "REQUEST_METHOD=%s", tmp);
     /* SCRIPT_NAME */
-    envp[12] = create_string("SCRIPT_NAME=/cgi");
+    env_add(arena, "SCRIPT_NAME=/cgi");
     /* SERVER_NAME */
-    envp[13] = create_string("SERVER_NAME=Liso/1.0");
+    env_add(arena, "SERVER_NAME=Liso/1.0");
     /* SERVER_PORT */
-    envp[14] = create_string("SERVER_PORT=%d", http_port);
+    env_add(arena, "SERVER_PORT=%d", http_port);
     /* SERVER_PROTOCOL */
-    envp[15] = create_string("SERVER_PROTOCOL=%s", "HTTP/1.1");
+    env_add(arena, "SERVER_PROTOCOL=%s", "HTTP/1.1");
     /* SERVER_SOFTWARE */
-    envp[16] = create_string("SERVER_SOFTWARE=Liso/1.0");
+    env_add(arena, "SERVER_SOFTWARE=Liso/1.0");
     /* REQUEST_URI */
-    envp[17] = create_string("REQUEST_URI=%s", req->uri);
+    env_add(arena, "REQUEST_URI=%s", req->uri);
     /* HTTP request headers */
-    i = RFC_VARS; // Index in envp
     for (h = req->headers; h != NULL; h = h->next) {
         translate_header(h->key, buf);
-        envp[i++] = create_string("HTTP_%s=%s", buf, h->val);
+        env_add(arena, "HTTP_%s=%s", buf, h->val);
     }
+}
+
+/** @brief Setup and return environment variables for cgi script
+ *
+ *  @return A NULL terminated array, allocated in one block. Free it with
+ *          free_envp().
+ */
+char** setup_envp(http_client_t* client) {
+    env_arena_t arena = { NULL, NULL, 0, 0 };
+    char host[NI_MAXHOST];
+    int count;
+
+    /*
+     * Never wait for DNS. If the name is not cached yet, use the address as
+     * RFC 3875 allows; the lookup is started for the next request.
+     */
+    if (!resolver_lookup(client->remote_addr, host, sizeof(host)))
+        strcpy(host, client->remote_ip);
+
+    /* Measure */
+    fill_envp(client, host, &arena);
+
+    /* Fill. Strings follow the pointer array */
+    count = arena.count;
+    arena.envp = mem_alloc(MEM_CGI, sizeof(char*) * (count + 1) + arena.size);
+    arena.str = (char *)(arena.envp + count + 1);
+    arena.count = 0;
+    arena.size = 0;
+    fill_envp(client, host, &arena);
+
     // Terminate the array by NULL
-    envp[i] = NULL;
+    arena.envp[count] = NULL;
 
-    return envp;
+    return arena.envp;
 }
 
-/** @brief Handle a CGI request
- *
- *  Use fork() to create a new process to run cgi script. Use pipe to feed
- *  request body to stdin of the cgi script. Setup pipe for stdout of the
- *  cgi script.
+/** @brief Free environment variables created by setup_envp */
+void free_envp(char **envp) {
+    mem_free(envp);
+}
+
+/** @brief Resolve cgi_path and make sure the script can be executed
  *
- *  @return 0 if ok. HTTP status code if something goes wrong
+ *  @param path The buffer which stores the absolute path of the script
+ *  @return 0 if ok. HTTP status code if the script cannot be run
  */
-static int cgi_handler(http_client_t *client) {
-    pid_t pid;
-    char path[PATH_MAX * 2];
-    int stdin_pipe[2], stdout_pipe[2];
-    int bytes_left, n;
-    char **envp;
-    char* argv[] = { NULL, NULL };
-
+static int resolve_cgi_script(char *path) {
     /* Get the absolute path of cgi_path */
     if (realpath(cgi_path, path) == NULL) {
         log_error("cgi_handler error: realpath error");
-        return -INTERNAL_SERVER_ERROR;
+        return errno == ENOENT ? NOT_FOUND : INTERNAL_SERVER_ERROR;
     }
 
     /* Check whether the script exists. Check permission */
@@ -304,82 +390,243 @@ static int cgi_handler(http_client_t *client) {
             return INTERNAL_SERVER_ERROR;
     }
 
+    return 0;
+}
+
+/** @brief Spawn attributes shared by all CGI processes
+ *
+ *  SIGPIPE is ignored by the server and that would be inherited across
+ *  execve(). Restore its default action in the child.
+ *
+ *  @return A pointer to the attributes, initialized on first use
+ */
+static posix_spawnattr_t* cgi_spawnattr() {
+    static posix_spawnattr_t attr;
+    static int ready = 0;
+    sigset_t sigdefault;
+
+    if (!ready) {
+        posix_spawnattr_init(&attr);
+        sigemptyset(&sigdefault);
+        sigaddset(&sigdefault, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attr, &sigdefault);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+        ready = 1;
+    }
+
+    return &attr;
+}
+
+/** @brief What the child of spawn_limited() needs, in the memory it shares */
+typedef struct {
+    char *path;
+    int in_fd, out_fd;
+    char **argv, **envp;
+    sigset_t *mask;             //<!the signal mask to give the script
+    int err;                    //<!set by the child when execve() is not done
+} spawn_args_t;
+
+/** @brief The child of spawn_limited(), on its own stack
+ *
+ *  It runs in the memory of the server until execve(), so it only makes
+ *  system calls. Signals are blocked on entry. The handlers of the server
+ *  would run on its memory, so they are reset before the mask is restored.
+ */
+static int spawn_child(void *arg) {
+    spawn_args_t *a = arg;
+    struct rlimit cpu, mem;
+    struct sigaction sa;
+    int sig;
+
+    cpu.rlim_cur = cgi_cpu_limit;
+    cpu.rlim_max = cgi_cpu_limit + 1;   // SIGXCPU first, then SIGKILL
+    mem.rlim_cur = mem.rlim_max = (rlim_t)cgi_mem_limit << 20;
+
+    for (sig = 1; sig < NSIG; ++sig)
+        if (sigaction(sig, NULL, &sa) == 0 && sa.sa_handler != SIG_DFL &&
+            (sa.sa_handler != SIG_IGN || sig == SIGPIPE)) {
+            sa.sa_handler = SIG_DFL;
+            sigaction(sig, &sa, NULL);
+        }
+
+    if (dup2(a->in_fd, STDIN_FILENO) == -1 ||
+        dup2(a->out_fd, STDOUT_FILENO) == -1 ||
+        (cgi_cpu_limit > 0 && setrlimit(RLIMIT_CPU, &cpu) == -1) ||
+        (cgi_mem_limit > 0 && setrlimit(RLIMIT_AS, &mem) == -1))
+        a->err = errno;
+    else {
+        sigprocmask(SIG_SETMASK, a->mask, NULL);
+        execve(a->path, a->argv, a->envp);
+        a->err = errno;
+    }
+    _exit(127);
+}
+
+/** @brief Like posix_spawn(), with the resource limits of CGI scripts
+ *
+ *  The limits must hold from the first instruction of the script, so they are
+ *  set in the child before execve(), not on the server which has threads. As
+ *  posix_spawn() does, the child is a clone sharing the memory of the server
+ *  (CLONE_VM), and the server waits until it has called execve()
+ *  (CLONE_VFORK). No page table is copied, so starting a limited script does
+ *  not grow with the memory of the server either. Only the loop spawns
+ *  scripts, so the stack of the child is static.
+ *
+ *  @return 0 if ok. An errno value otherwise
+ */
+static int spawn_limited(pid_t *pid, char *path, int in_fd, int out_fd,
+                         char **argv, char **envp) {
+    static char stack[CGI_SPAWN_STACK] __attribute__((aligned(16)));
+    spawn_args_t args;
+    sigset_t all, mask;
+
+    args.path = path;
+    args.in_fd = in_fd;
+    args.out_fd = out_fd;
+    args.argv = argv;
+    args.envp = envp;
+    args.mask = &mask;
+    args.err = 0;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &mask);
+    *pid = clone(spawn_child, stack + sizeof(stack),
+                 CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    if (*pid == -1)
+        return errno;
+    if (args.err != 0)
+        waitpid(*pid, NULL, 0);
+    return args.err;
+}
+
+/** @brief Launch the CGI script for a request
+ *
+ *  Use posix_spawn() to create a new process to run cgi script. Unlike
+ *  fork(), it does not copy the page tables of the server, so the cost of
+ *  launching a script does not grow with the memory used by the server. The
+ *  environment and the file actions are prepared in the parent beforehand.
+ *  With --cgi-cpu or --cgi-mem, the script is started by spawn_limited(),
+ *  in the same way but with its limits set.
+ *
+ *  Use pipe to feed request body to stdin of the cgi script. Setup pipe for
+ *  stdout of the cgi script.
+ *
+ *  @param client A pointer to corresponding client object
+ *  @param pid_out The pointer to the variable which stores the child pid
+ *  @return 0 if ok. HTTP status code if something goes wrong
+ */
+int cgi_launch(http_client_t *client, pid_t *pid_out) {
+    pid_t pid;
+    char path[PATH_MAX * 2];
+    int stdin_pipe[2], stdout_pipe[2];
+    int bytes_left, n;
+    char **envp;
+    char* argv[] = { NULL, NULL };
+    posix_spawn_file_actions_t actions;
+    pipe_t *pipe;
+
+    if ((n = resolve_cgi_script(path)) != 0)
+        return n;
+
     argv[0] = path;
     /* Setup pipe */
-    /* 0 can be read from, 1 can be written to */
-    if (pipe(stdin_pipe) < 0) {
+    /* 0 can be read from, 1 can be written to. Neither leaks into the child */
+    if (pipe2(stdin_pipe, O_CLOEXEC) < 0) {
         log_error("launch_cgi setup stdin_pipe error");
         return INTERNAL_SERVER_ERROR;
     }
-    if (pipe(stdout_pipe) < 0) {
-        log_error("launch_cgi setup stdin_pipe error");
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0) {
+        log_error("launch_cgi setup stdout_pipe error");
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
         return INTERNAL_SERVER_ERROR;
     }
 
-    /* Create subprocess */
-    if ((pid = fork()) < 0) {
-        log_error("launch_cgi fork() error");
-        return INTERNAL_SERVER_ERROR;
-    }
+    /* The copies made by dup2 do not have FD_CLOEXEC */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], STDOUT_FILENO);
 
-    /* Subprocess invokes cgi script */
-    if (pid == 0) {
+    envp = setup_envp(client);
+
+    /* Create subprocess */
+    if (cgi_cpu_limit > 0 || cgi_mem_limit > 0)
+        n = spawn_limited(&pid, argv[0], stdin_pipe[0], stdout_pipe[1], argv,
+                          envp);
+    else
+        n = posix_spawn(&pid, argv[0], &actions, cgi_spawnattr(), argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    free_envp(envp);
+    close(stdin_pipe[0]);
+    close(stdout_pipe[1]);
+
+    if (n != 0) {
+        errno = n;
+        log_error("launch_cgi posix_spawn() error");
         close(stdin_pipe[1]);
         close(stdout_pipe[0]);
-
-        if (dup2(stdin_pipe[0], fileno(stdin)) == -1) {
-            log_error("dup2 stdin_pipe error");
-            exit(EXIT_FAILURE);
-        }
-        if (dup2(stdout_pipe[1], fileno(stdout)) == -1) {
-            log_error("dup2 stdout_pipe error");
-            exit(EXIT_FAILURE);
-        }
-
-        envp = setup_envp(client);
-        if (execve(argv[0], argv, envp)) {
-            log_error("exceve error");
-            exit(EXIT_FAILURE);
-        }
+        return INTERNAL_SERVER_ERROR;
     }
 
-    /* Main routine continues */
-    if (pid > 0) {
-        log_msg(L_INFO, "Start child process %d\n", pid);
+    log_msg(L_INFO, "Start child process %d\n", pid);
 
-        close(stdin_pipe[0]);
-        close(stdout_pipe[1]);
-
-        /* Write request body to subprocess */
-        if (client->req->method == M_POST) {
-            bytes_left = client->req->content_length;
-            /* We don't want to be block when passing data to subprocess */
-            fcntl(stdin_pipe[1], F_SETFL, O_NONBLOCK);
-            while ((n = write(stdin_pipe[1], client->req->body,
-                    bytes_left)) > 0)
-                bytes_left -= n;
-
-            // Error writing bytes to subprocess
-            if (bytes_left > 0 || n == -1) {
-                log_msg(L_ERROR, "fail to send request body to subprocess\n");
-                kill(pid, SIGKILL);
-                close(stdin_pipe[1]);
-                return INTERNAL_SERVER_ERROR;
-            }
-        }
+    /*
+     * Write request body to subprocess. What the pipe cannot take now is fed
+     * by the server loop, see client_feed_cgi()
+     */
+    bytes_left = 0;
+    if (client->req->method == M_POST) {
+        bytes_left = client->req->content_length;
+        /* We don't want to be block when passing data to subprocess */
+        fcntl(stdin_pipe[1], F_SETFL,
+              fcntl(stdin_pipe[1], F_GETFL) | O_NONBLOCK);
+        while (bytes_left > 0 && (n = write(stdin_pipe[1],
+                client->req->body + client->req->content_length - bytes_left,
+                bytes_left)) > 0)
+            bytes_left -= n;
+        // EPIPE, the script does not read its stdin
+        if (bytes_left > 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            bytes_left = 0;
+    }
+    if (bytes_left > 0) {
+        /* The body lives in the input buffer, which moves on */
+        client->cgi_body = init_buf();
+        buf_write(client->cgi_body, client->req->body +
+                  client->req->content_length - bytes_left, bytes_left);
+        client->cgi_in = stdin_pipe[1];
+        client_bind(client->cgi_in, client);
+        add_write_fd(client->cgi_in);
+    } else
         close(stdin_pipe[1]);
 
-        /* setup pipe from subprocess output */
-        client->pipe = init_pipe();
-        client->pipe->from_fd = stdout_pipe[0];
-        add_read_fd(stdout_pipe[0]);
+    /* setup pipe from subprocess output */
+    pipe = init_pipe();
+    pipe->from_fd = stdout_pipe[0];
+    pipe->ends_piping = 1;
+    client_queue_pipe(client, pipe);
 
-         return 0;
-    }
+    *pid_out = pid;
+    return 0;
+}
 
+/** @brief Handle a CGI request
+ *
+ *  The script is launched by the CGI supervisor, which may queue the request
+ *  until a slot is free. See cgi_supervisor.c
+ *
+ *  @return 0 if ok. HTTP status code if something goes wrong
+ */
+static int cgi_handler(http_client_t *client) {
+    char path[PATH_MAX * 2];
+    int ret;
 
-    log_msg(L_ERROR, "Control should never reach here!!!");
-    return -1;
+    /* Fail early, before the request waits in the queue */
+    if ((ret = resolve_cgi_script(path)) != 0)
+        return ret;
+
+    return cgi_submit(client);
 }
 
 /** @brief Internal handler
@@ -392,7 +639,18 @@ static int cgi_handler(http_client_t *client) {
  *  @return 0 if OK. Response status code on error
  */
 static int internal_handler(http_client_t *client) {
+    if (server_status && client->req->method != M_POST) {
+        if (strcmp(client->req->uri, "/server-status") == 0)
+            return server_status_page(client, 0);
+        if (strcmp(client->req->uri, "/metrics") == 0)
+            return server_status_page(client, 1);
+    }
+
     if (client->req->is_cgi) {
+        // The status comes with the output of the script
+        access_open(client, 0);
+        if (fcgi_socket != NULL)
+            return fcgi_handler(client);
         return cgi_handler(client);
     } else if (client->req->method != M_POST) {
         return server_static_file(client);
@@ -402,6 +660,28 @@ static int internal_handler(http_client_t *client) {
     return METHOD_NOT_ALLOWED;
 }
 
+/** @brief Check whether a POST request will be accepted
+ *
+ *  Called once the request line and headers are parsed but before the body
+ *  is received. Mirrors the checks done by internal_handler.
+ *
+ *  @param client A pointer to corresponding client object
+ *  @return 0 if the request will be accepted. Response status code if not.
+ */
+int precheck_post(http_client_t *client) {
+    char path[PATH_MAX * 2];
+
+    // POST to a static file is not allowed
+    if (!client->req->is_cgi)
+        return METHOD_NOT_ALLOWED;
+
+    // The FastCGI worker decides what to do with the script path
+    if (fcgi_socket != NULL)
+        return 0;
+
+    return resolve_cgi_script(path);
+}
+
 /** @brief Handle HTTP GET request
  *
  *  @param client A pointer to corresponding client object
@@ -413,10 +693,10 @@ int handle_get(http_client_t *client) {
     log_msg(L_INFO, "Handle GET request. URI: %s\n", client->req->uri);
 
     /*
-     * If internal_handler processes without error, the content of the static
-     * file will be pipe to client.
+     * The pipe of a static file is queued, so the next request can be parsed
+     * at once. A CGI script may still be queued or producing its response.
      */
-    if (ret == 0)
+    if (ret == 0 && client->req->is_cgi)
         client->status = C_PIPING;
     else
         client->status = C_IDLE;
@@ -432,7 +712,12 @@ int handle_head(http_client_t *client) {
     int ret = internal_handler(client);
 
     log_msg(L_INFO, "Handle HEAD request. URI: %s\n", client->req->uri);
-    client->status = C_IDLE;
+
+    /* A CGI script may still be queued or producing its response */
+    if (ret == 0 && client->req->is_cgi)
+        client->status = C_PIPING;
+    else
+        client->status = C_IDLE;
     return ret;
 }
 
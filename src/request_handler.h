@@ -12,5 +12,13 @@
 int handle_get(http_client_t *client);
 int handle_post(http_client_t *client);
 int handle_head(http_client_t *client);
+int precheck_post(http_client_t *client);
+
+/* CGI */
+#define CGI_SPAWN_STACK (64 * 1024)     //Stack of a limited script until execve
+
+char** setup_envp(http_client_t* client);
+void free_envp(char **envp);
+int cgi_launch(http_client_t *client, pid_t *pid_out);
 
 #endif
\ No newline at end of file
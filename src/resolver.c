@@ -0,0 +1,161 @@
+/** @file resolver.c
+ *  @brief Asynchronous reverse DNS with a cache
+ *
+ *  A reverse lookup may take seconds, so it never runs on the server loop.
+ *  resolver_lookup() only consults the cache. On a miss, it queues the address
+ *  for the resolver thread and returns at once. The thread calls
+ *  getnameinfo() and stores the answer, which later requests from the same
+ *  address will find.
+ *
+ *  The queue is bounded. When it is full, the lookup is simply not made.
+ *  Host names are kept for RESOLVER_TTL seconds, failures for
+ *  RESOLVER_NEG_TTL seconds.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include "log.h"
+#include "resolver.h"
+
+static resolver_entry_t cache[RESOLVER_CACHE_SIZE];
+static in_addr_t queue[RESOLVER_QUEUE_LEN];
+static int queue_head = 0, queue_len = 0;
+static int stopping = 0;
+static int started = 0;
+static pthread_t thread;
+/* Protects all of the above */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/** @brief The cache slot of an address */
+static resolver_entry_t* slot(in_addr_t addr) {
+    unsigned int h = addr;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3b;
+    h ^= h >> 16;
+    return cache + (h & (RESOLVER_CACHE_SIZE - 1));
+}
+
+/** @brief Main function of the resolver thread */
+static void* resolve_loop(void *arg) {
+    struct sockaddr_in sa;
+    char name[NI_MAXHOST];
+    resolver_entry_t *e;
+    in_addr_t addr;
+    int ret;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+
+    pthread_mutex_lock(&lock);
+    for (;;) {
+        while (queue_len == 0 && !stopping)
+            pthread_cond_wait(&cond, &lock);
+        if (stopping)
+            break;
+        addr = queue[queue_head];
+        queue_head = (queue_head + 1) % RESOLVER_QUEUE_LEN;
+        queue_len -= 1;
+        pthread_mutex_unlock(&lock);
+
+        sa.sin_addr.s_addr = addr;
+        ret = getnameinfo((struct sockaddr *)&sa, sizeof(sa), name,
+                          sizeof(name), NULL, 0, NI_NAMEREQD);
+
+        pthread_mutex_lock(&lock);
+        e = slot(addr);
+        // The slot may have been taken by another address meanwhile
+        if (e->addr != addr || e->state != R_PENDING)
+            continue;
+        e->state = R_DONE;
+        if (ret == 0) {
+            strcpy(e->name, name);
+            e->expires = time(NULL) + RESOLVER_TTL;
+        } else {
+            e->name[0] = '\0';
+            e->expires = time(NULL) + RESOLVER_NEG_TTL;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/** @brief Start the resolver thread
+ *
+ *  @return 0 if success. -1 if error
+ */
+int resolver_init() {
+    sigset_t all, old;
+    int ret;
+
+    /* A signal handled here would not end the wait of the serving loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    ret = pthread_create(&thread, NULL, resolve_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        log_msg(L_ERROR, "Error creating resolver thread.\n");
+        return -1;
+    }
+    started = 1;
+    return 0;
+}
+
+/** @brief Look up the host name of an address without blocking
+ *
+ *  If the name is not cached, a lookup is queued and the next call may find
+ *  it.
+ *
+ *  @param addr The address of the client
+ *  @param name The buffer which stores the host name
+ *  @param len Size of the buffer
+ *  @return 1 if the name is known. 0 if not(yet)
+ */
+int resolver_lookup(struct in_addr addr, char *name, int len) {
+    resolver_entry_t *e;
+    int found = 0;
+
+    if (!started)
+        return 0;
+
+    pthread_mutex_lock(&lock);
+    e = slot(addr.s_addr);
+    if (e->state == R_DONE && e->addr == addr.s_addr &&
+        e->expires > time(NULL)) {
+        if (e->name[0] != '\0') {
+            strncpy(name, e->name, len - 1);
+            name[len - 1] = '\0';
+            found = 1;
+        }
+    } else if (!(e->state == R_PENDING && e->addr == addr.s_addr) &&
+               queue_len < RESOLVER_QUEUE_LEN) {
+        e->addr = addr.s_addr;
+        e->state = R_PENDING;
+        queue[(queue_head + queue_len) % RESOLVER_QUEUE_LEN] = addr.s_addr;
+        queue_len += 1;
+        pthread_cond_signal(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+/** @brief Stop the resolver thread
+ *
+ *  A lookup in progress is not interrupted, so this may wait for it.
+ */
+void resolver_finalize() {
+    if (!started)
+        return;
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    started = 0;
+}
@@ -0,0 +1,35 @@
+/** @file resolver.h
+ *  @brief Asynchronous reverse DNS with a cache
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#define RESOLVER_CACHE_SIZE 1024    //Entries in the cache. A power of 2
+#define RESOLVER_QUEUE_LEN 64       //Lookups waiting for the resolver thread
+#define RESOLVER_TTL 300            //Seconds a host name is kept
+#define RESOLVER_NEG_TTL 60         //Seconds a failed lookup is kept
+
+/* State of a cache entry */
+#define R_EMPTY 0
+#define R_PENDING 1     //queued or being resolved
+#define R_DONE 2        //resolved, name is "" if the lookup failed
+
+/** @brief A cached reverse lookup. The cache is direct mapped */
+typedef struct {
+    in_addr_t addr;
+    int state;
+    time_t expires;
+    char name[NI_MAXHOST];
+} resolver_entry_t;
+
+int resolver_init();
+int resolver_lookup(struct in_addr addr, char *name, int len);
+void resolver_finalize();
+
+#endif
@@ -5,29 +5,49 @@
  *  Each time when it's okay to send data to the client, the server tries to
  *  send data from the output buffer of the client.
  *
+ *  select() only watches what a client can use: writing while there is
+ *  something to send, reading while the client is within its buffer budget.
+ *  Each round, only clients with a ready fd or woken by another module are
+ *  visited. They are found through the fd table in http_client.c.
+ *
+ *  A drain, started from the admin socket, closes the listening sockets and
+ *  each client once it has nothing in progress. The server exits when the
+ *  last one is gone.
+ *
  *  @author Chao Xin(cxin)
  */
+#define _GNU_SOURCE         // accept4
 #include <stdlib.h>
-#include <netdb.h>
 #include <sys/socket.h>
+#include <sys/select.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <signal.h>
 #include <openssl/ssl.h>
-#include <openssl/err.h>
 #include "server.h"
 #include "io.h"
 #include "log.h"
 #include "http_client.h"
 #include "http_parser.h"
+#include "fastcgi.h"
+#include "cgi_supervisor.h"
+#include "tls.h"
+#include "resolver.h"
+#include "timer.h"
+#include "metrics.h"
+#include "admin.h"
+#include "probes.h"
 
-int terminate = 0;
+volatile sig_atomic_t terminate = 0;
 
 static int http_fd, https_fd;
-static SSL_CTX *ssl_context;
+static int was_total_full;  //buffers were over the global budget last round
+static int draining;        //no new connections, clients closed when done
 
 /** @brief Create and config a socket on given port. */
 static int setup_server_socket(unsigned short port) {
@@ -35,7 +55,10 @@ static int setup_server_socket(unsigned short port) {
 	int server_fd;
 	static struct sockaddr_in server_addr;
 
-	if ((server_fd = socket(PF_INET, SOCK_STREAM, 0)) == -1) {
+	//Not inherited by CGI scripts. Non-blocking so the accept queue can be
+	//drained until EAGAIN
+	if ((server_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+							0)) == -1) {
 		log_error("Failed creating socket.");
 		return -1;
 	}
@@ -66,120 +89,286 @@ static int setup_server_socket(unsigned short port) {
 	return server_fd;
 }
 
-/** @brief Setup ssl_context, load private key, certificate
+/** @brief Called by the timer wheel when a client misses its deadline
  *
- *  @return 0 if success. -1 if erorr occurs
+ *  A client which is slow to send its request is answered with 408, then
+ *  closed once the response is sent. Otherwise the client is closed at once.
  */
-static int ssl_setup() {
-    SSL_load_error_strings();
-    SSL_library_init();
-
-    /* we want to use TLSv1 only */
-    if ((ssl_context = SSL_CTX_new(TLSv1_server_method())) == NULL)
-    {
-		log_msg(L_ERROR, "Error creating SSL context.\n");
-        return -1;
-    }
-
-    /* register private key */
-    if (SSL_CTX_use_PrivateKey_file(ssl_context, private_key_file,
-                                    SSL_FILETYPE_PEM) == 0)
-    {
-        SSL_CTX_free(ssl_context);
-        log_msg(L_ERROR, "Error associating private key.\n");
-        return -1;
-    }
-
-    /* register public key (certificate) */
-    if (SSL_CTX_use_certificate_file(ssl_context, certificate_file,
-                                     SSL_FILETYPE_PEM) == 0)
-    {
-        SSL_CTX_free(ssl_context);
-        log_msg(L_ERROR, "Error associating certificate.\n");
-        return -1;
-    }
-
-    return 0;
+static void client_timeout(timer_node_t *t) {
+	http_client_t *client = t->data;
+	static char *phases[] = { "none", "keep-alive", "header", "body", "write" };
+
+	log_msg(L_INFO, "Client %s timed out in %s phase\n", client->remote_ip,
+			phases[client->timer_phase]);
+
+	if ((client->timer_phase == T_HEADER && client->status != C_HANDSHAKE) ||
+		client->timer_phase == T_BODY) {
+		end_request(client, REQUEST_TIMEOUT);
+		remove_read_fd(client->fd);
+		// The 408 must still be sent within the write deadline
+		client->timer_phase = T_NONE;
+	} else
+		client->expired = 1;
+	client_wake(client);
 }
 
-/** @brief Wrap client socket with SSL
+/** @brief Arm the deadline of the phase a client is in
+ *
+ *  The header deadline runs from the first byte of a request. The body and
+ *  write deadlines are pushed back whenever data moves.
  *
- *  @return 0 if sucess. -1 if error
+ *  @param progress Were bytes received or sent in this round?
  */
-static int ssl_wrap(http_client_t *client) {
-	int ret, err;
+static void update_timer(http_client_t *client, int progress) {
+	static int *timeouts[] = { NULL, &keepalive_timeout, &header_timeout,
+							   &body_timeout, &write_timeout };
+	int phase;
+
+	if (client->status == C_HANDSHAKE)
+		// The handshake must be over within the header deadline from accept
+		phase = T_HEADER;
+	else if (client->out->pos < client->out->datasize ||
+			 (client->pipe != NULL && pipe_pending(client->pipe)))
+		phase = T_WRITE;
+	else if (client->status == C_PIPING || client->pipe != NULL ||
+			 !client->alive)
+		/*
+		 * Scripts are watched by the CGI supervisor, FastCGI requests have
+		 * their own deadline in fastcgi.c
+		 */
+		phase = T_NONE;
+	else if (client->status == C_PBODY)
+		phase = T_BODY;
+	else if (client->status == C_PHEADER ||
+			 client->in->pos < client->in->datasize)
+		phase = T_HEADER;
+	else
+		phase = T_IDLE;
+
+	if (phase == client->timer_phase &&
+		!(progress && (phase == T_BODY || phase == T_WRITE)))
+		return;
 
-	if ((client->ssl_context = SSL_new(ssl_context)) == NULL) {
-		log_msg(L_ERROR, "ssl_wrap SSL_new error.\n");
-		return -1;
+	client->timer_phase = phase;
+	if (phase == T_NONE)
+		timer_cancel(&client->timer);
+	else
+		timer_arm(&client->timer, *timeouts[phase] * 1000);
+}
+
+/** @brief Can the parser of a client go on?
+ *
+ *  A new request is not started while the response to the previous ones is
+ *  over the budget.
+ */
+static int can_parse(http_client_t *client) {
+	return client->alive && client->status != C_PIPING &&
+		   client->status != C_HANDSHAKE &&
+		   !(client->status == C_IDLE && client_out_full(client));
+}
+
+/** @brief Choose what select() watches for a client
+ *
+ *  Reading stops while the client is over its buffer budget, so a peer that
+ *  sends requests without reading the responses cannot make the server buffer
+ *  without limit. The kernel receive buffer fills up and TCP pushes back.
+ */
+static void update_interest(http_client_t *client) {
+	buf_stats_t *stats = buf_get_stats();
+	pipe_t *pipe = client->pipe;
+	int want_read, want_write;
+
+	if (client->status == C_HANDSHAKE) {
+		// A worker running a handshake step owns the socket
+		if (client->ssl_want == 0) return;
+		want_read = client->ssl_want == SSL_ERROR_WANT_READ;
+		want_write = client->ssl_want == SSL_ERROR_WANT_WRITE;
+	} else {
+		want_read = client->alive && !client_in_full(client);
+		want_write = client->out->pos < client->out->datasize ||
+					 (pipe != NULL && pipe_pending(pipe));
+		/*
+		 * A TLS record may need the other direction, e.g. SSL_read() sending
+		 * a KeyUpdate or renegotiation message. Wait for that one too
+		 */
+		want_read |= client->send_wants_read && want_write;
+		want_write |= client->recv_wants_write;
+
+		if (client->alive && want_read == client->read_paused) {
+			client->read_paused = !want_read;
+			stats->paused += want_read ? -1 : 1;
+			if (!want_read) {
+				stats->pauses += 1;
+				log_msg(L_IO_DEBUG, "Pause reading from %s, over buffer budget\n",
+						client->remote_ip);
+			}
+		}
+
+		/*
+		 * The source at the head of the response queue is read when the
+		 * client socket can take its data. The others wait their turn.
+		 */
+		if (pipe != NULL) {
+			if (client->out->pos >= client->out->datasize &&
+				!pipe_pending(pipe))
+				add_read_fd(pipe->from_fd);
+			else
+				remove_read_fd(pipe->from_fd);
+		}
 	}
 
-    if (SSL_set_fd(client->ssl_context, client->fd) == 0) {
-    	log_msg(L_ERROR, "ssl_wrap SSL_set_fd error.\n");
-    	return -1;
-    }
+	if (want_read)
+		add_read_fd(client->fd);
+	else
+		remove_read_fd(client->fd);
+	if (want_write)
+		add_write_fd(client->fd);
+	else
+		remove_write_fd(client->fd);
+
+	// Requests already buffered are parsed next round
+	if (client->parse_ready && can_parse(client) &&
+		client->in->pos < client->in->datasize)
+		client_wake(client);
+}
+
+/** @brief Resume clients paused by the global budget once it is met again
+ *
+ *  Clients paused by their own budget resume when they are visited for
+ *  writing. Those paused by the global one have no fd to wake them.
+ */
+static void wake_paused() {
+	http_client_t *client;
+	int fd, full = total_full();
+
+	if (was_total_full && !full && buf_get_stats()->paused > 0)
+		for (fd = 0; fd < FD_SETSIZE; ++fd) {
+			client = client_lookup(fd);
+			if (client != NULL && client->fd == fd && client->read_paused)
+				client_wake(client);
+		}
+	was_total_full = full;
+}
+
+/** @brief Timeout for select(): the nearest CGI or client deadline
+ *
+ *  Zero if a client is woken already, e.g. it has buffered requests to parse,
+ *  since no fd may become ready for it.
+ *
+ *  @return timeout. NULL if there is no deadline
+ */
+static struct timeval* next_timeout(struct timeval *timeout) {
+	struct timeval t;
+	int has_timeout;
 
-    if ((ret = SSL_accept(client->ssl_context)) <= 0) {
-    	err = SSL_get_error(client->ssl_context, ret);
-    	log_msg(L_ERROR, "ssl_wrap SSL_accept returns %d: %s\n", err,
-    		    ERR_reason_error_string(err));
+	if (client_any_ready()) {
+		timerclear(timeout);
+		return timeout;
+	}
 
-    	return -1;
-    }
+	has_timeout = cgi_next_timeout(timeout);
 
-    return 0;
+	if (timer_next_timeout(&t) && (!has_timeout || timercmp(&t, timeout, <))) {
+		*timeout = t;
+		has_timeout = 1;
+	}
+	return has_timeout ? timeout : NULL;
 }
 
 /** @brief Accept connection from server_fd. If sucess, construct a client
- *	  	   struct and append it to the client linked list started with
- *   	   client_head
+ *	  	   struct, which is visited in this round
+ *
+ *  The client socket is non-blocking, and is not inherited by CGI scripts.
  *
  *  @param server_fd The server file descriptor which will be passed into
  * 		   accept()
- *  @param client_head The pointer to the head of a client linked list
- *  @return A pointer to the newly created client struct. NULL if error
+ *  @return A pointer to the newly created client struct. NULL if error or no
+ *          pending connection
  */
-static http_client_t* accept_connection(int server_fd,
-										http_client_t **client_head) {
+static http_client_t* accept_connection(int server_fd) {
 	int client_fd;
 	socklen_t client_addr_len;
 	struct sockaddr_in client_addr;
-	struct hostent *host;
 	http_client_t *client;
+	int one = 1;
 
 	client_addr_len = sizeof(client_addr);
-	if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr,
-							(socklen_t *)&client_addr_len)) == -1) {
-		log_error("Error accepting connection");
+	if ((client_fd = io_accept(server_fd, (struct sockaddr *)&client_addr,
+							   &client_addr_len)) == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			log_error("Error accepting connection");
 		return NULL;
 	}
-	// Add socket to fd list
+	metrics_get()->accepted += 1;
+	/*
+	 * Without Nagle, a TLS record or the next pipelined response does not
+	 * wait for the delayed ACK of the previous one. Headers still share a
+	 * segment with the body through MSG_MORE
+	 */
+	setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	// OpenSSL reads and writes TLS sockets itself
+	if (server_fd == http_fd)
+		io_stream_fd(client_fd);
+	// Add socket to fd list. Writing is watched once there is a response
 	add_read_fd(client_fd);
-	add_write_fd(client_fd);
-	//Insert into client list
+	//Enter into the fd table
 	client = new_client(client_fd);
-	// Record ip address
-	if (inet_ntop(AF_INET, &client_addr, client->remote_ip,
+	client->timer.fn = client_timeout;
+	// Record ip address. The host name is looked up later, only for CGI
+	client->remote_addr = client_addr.sin_addr;
+	if (inet_ntop(AF_INET, &client_addr.sin_addr, client->remote_ip,
 				  INET_ADDRSTRLEN) == NULL)
 		log_error("Record client IP address error");
 
-	// Get host name
-	host = gethostbyaddr(&(client_addr.sin_addr), sizeof(struct in_addr), AF_INET);
-	if (host == NULL)
-		log_error("Record client host name error");
-	client->remote_host = host->h_name;
-
 	log_msg(L_INFO, "Incoming request from %s\n", client->remote_ip);
+	PROBE2(accept, client_fd, client->remote_ip);
+
+	client_wake(client);
+	return client;
+}
 
-	// Put at the head of client list
-	if (*client_head == NULL)
-		*client_head = client;
-	else {
-		client->next = (*client_head)->next;
-		(*client_head)->next = client;
+/** @brief Has a client nothing in progress, so that a drain may close it? */
+static int drain_idle(http_client_t *client) {
+	return client->status == C_IDLE && client->pipe == NULL &&
+		   client->out->pos >= client->out->datasize &&
+		   client->in->pos >= client->in->datasize;
+}
+
+/** @brief Start a drain
+ *
+ *  New connections are refused. Clients are closed between two requests, a
+ *  response in progress is finished first. Idle ones are closed in this
+ *  round.
+ *
+ *  @return Number of clients left
+ */
+int server_drain() {
+	http_client_t *client;
+	int fd;
+
+	if (!draining) {
+		draining = 1;
+		remove_read_fd(http_fd);
+		remove_read_fd(https_fd);
+		io_release_fd(http_fd);
+		io_release_fd(https_fd);
+		close(http_fd);
+		close(https_fd);
+		http_fd = https_fd = -1;
+		log_msg(L_INFO, "Draining %d connections\n", client_count());
 	}
 
-	return client;
+	for (fd = 0; fd < FD_SETSIZE; ++fd) {
+		client = client_lookup(fd);
+		if (client != NULL && client->fd == fd)
+			client_wake(client);
+	}
+	return client_count();
+}
+
+/** @brief Is a drain in progress? */
+int server_draining() {
+	return draining;
 }
 
 /** @brief Finalize the server
@@ -187,31 +376,46 @@ static http_client_t* accept_connection(int server_fd,
  *  Free all memory and close all sockets.
  */
 void finalize() {
-	http_client_t *client, *next;
+	http_client_t *client;
+	int fd;
 
-	close(http_fd);
-	close(https_fd);
-	SSL_CTX_free(ssl_context);
+	if (http_fd != -1) close(http_fd);
+	if (https_fd != -1) close(https_fd);
+	ssl_finalize();
 
-	for (client = client_head; client != NULL; client = next) {
-		next = client->next;
-		deinit_client(client);
+	for (fd = 0; fd < FD_SETSIZE; ++fd) {
+		client = client_lookup(fd);
+		if (client != NULL && client->fd == fd)
+			deinit_client(client);
 	}
+	fcgi_finalize();
+	admin_finalize();
+	resolver_finalize();
+	finalize_select_context();
 }
 
 /** @brief Create a concurrent server to serve on given port
  *
  *  The server will serve on both http_port and https_port(see config.h).
- *  Use select() to handle multiple socket. Each time a new connection
- *  established, the newly created socket will be made non-blocking so that the
- *  server can read as much data as possible each time by polling the socket.
+ *  Use select() to handle multiple socket. When a listening socket is ready,
+ *  up to ACCEPT_BUDGET pending connections are accepted at once, so a burst is
+ *  absorbed in one pass. Client sockets are non-blocking; a send or recv that
+ *  would block is retried when select() reports the socket ready again.
  *
- *  @return Should never return
+ *  @return Once a drain is over
  */
 void serve() {
-	http_client_t *client,
-				  *prev; //previous item in linked list when iterating
-	int nbytes, bad;
+	http_client_t *client;
+	int nbytes, bad, ret, i, progress, pos, status, was_sending, writable,
+		nready, *ready_fds;
+	off_t sent;
+	struct timeval timeout;
+
+	//Reverse DNS for REMOTE_HOST. Without it, REMOTE_HOST is the address
+	resolver_init();
+
+	//initialize fd lists. TLS workers and FastCGI add their fds in setup
+	init_select_context(strcmp(io_engine, "uring") == 0);
 
 	if ((http_fd = setup_server_socket(http_port)) == -1) return;
 	if ((https_fd = setup_server_socket(https_port)) == -1) {
@@ -223,102 +427,215 @@ void serve() {
 		close(https_fd);
 		return;
 	}
+	if (fcgi_socket != NULL && fcgi_init() == -1) {
+		close(http_fd);
+		close(https_fd);
+		return;
+	}
+	if (admin_socket != NULL && admin_init() == -1) {
+		close(http_fd);
+		close(https_fd);
+		return;
+	}
 
-	//initialize fd lists
-	init_select_context();
+	io_listen_fd(http_fd);
+	io_listen_fd(https_fd);
 	add_read_fd(http_fd);
 	add_read_fd(https_fd);
 
-	client_head = NULL;
-
 	/*===============Start accepting requests================*/
 	while (!terminate) {
-		if (io_select() == -1) {
+		//Wake up in time for CGI and client deadlines
+		ret = io_select(next_timeout(&timeout));
+		//Before the supervisor, whose waitpid() sets errno
+		if (ret == -1 && errno != EINTR)
 			log_error("select error");
+
+		//Reap CGI processes and start queued ones
+		cgi_supervise();
+
+		//Mark clients which missed their deadline
+		timer_run();
+
+		if (ret == -1)
 			continue;
-		}
 
 		//New http request!
-		if (test_read_fd(http_fd))
-			client = accept_connection(http_fd, &client_head);
+		//Drain the accept queue, up to ACCEPT_BUDGET connections
+		if (http_fd != -1 && test_read_fd(http_fd))
+			for (i = 0; i < ACCEPT_BUDGET; ++i)
+				if (accept_connection(http_fd) == NULL)
+					break;
 
 		//New https request!
-		if (test_read_fd(https_fd)) {
-			if ((client = accept_connection(https_fd, &client_head)))
-				if (ssl_wrap(client) == -1)
+		if (https_fd != -1 && test_read_fd(https_fd))
+			for (i = 0; i < ACCEPT_BUDGET; ++i) {
+				if ((client = accept_connection(https_fd)) == NULL)
+					break;
+				if (ssl_wrap(client) == -1) {
+					client->status = C_IDLE;
 					client->alive = 0;
-		}
+				}
+			}
+
+		//Records from FastCGI workers
+		fcgi_process();
+
+		//Handshakes finished by TLS workers
+		tls_process();
+
+		//Commands on the admin socket
+		admin_process();
+
+		//Visit the owners of ready fds, besides the clients woken above
+		nready = io_ready_fds(&ready_fds);
+		for (i = 0; i < nready; ++i)
+			if ((client = client_lookup(ready_fds[i])) != NULL)
+				client_wake(client);
+
+		client_take_ready();
+		while ((client = client_next_ready()) != NULL) {
+
+			/* A TLS worker runs a handshake step, tls_process() wakes it */
+			if (client->status == C_HANDSHAKE && client->ssl_want == 0)
+				continue;
 
-		prev = NULL;
-		for (client = client_head; client != NULL; ) {
 			/*
 			 * Normally, bad will be 0 normally. When erro occurs, bad will
 			 * be set to 1. And corresponding socket will be closed.
 			 */
-			bad = 0;
+			bad = client->expired;
+			progress = 0;
+			was_sending = client->out->pos < client->out->datasize;
+
+			// Continue the TLS handshake when the socket is ready for it
+			if (client->status == C_HANDSHAKE) {
+				if ((client->ssl_want == SSL_ERROR_WANT_READ &&
+					 test_read_fd(client->fd)) ||
+					(client->ssl_want == SSL_ERROR_WANT_WRITE &&
+					 test_write_fd(client->fd)))
+					bad = ssl_handshake(client) == -1;
+			}
 
 			// New data arrived!
-			if (client->alive && test_read_fd(client->fd)) {
+			if (!bad && client->alive && client->status != C_HANDSHAKE &&
+					(test_read_fd(client->fd) ||
+					 (client->recv_wants_write && test_write_fd(client->fd)))) {
 				nbytes = io_recv(client->fd, client->in, client->ssl_context);
+				client->recv_wants_write = nbytes == IO_AGAIN &&
+					client->ssl_context != NULL &&
+					SSL_want_write(client->ssl_context);
 				if (nbytes == -1) bad = 1;
+				if (nbytes > 0) {
+					progress = 1;
+					metrics_get()->bytes_in += nbytes;
+				}
+				// Peer closed. Finish the current response, then close
+				if (nbytes == 0) {
+					client->alive = 0;
+					remove_read_fd(client->fd);
+				}
 			}
 
-			// Parse data
-			if (!bad && client->alive && client->status != C_PIPING) {
+			// A CGI script can take more of its request body
+			if (client->cgi_in != -1 && test_write_fd(client->cgi_in))
+				client_feed_cgi(client);
+
+			/*
+			 * Parse data. Pipelined requests are parsed ahead while the
+			 * responses before them are still queued, until the parser needs
+			 * more data, the queue is full or a CGI response is in progress.
+			 */
+			while (!bad && can_parse(client)) {
+				pos = client->in->pos;
+				status = client->status;
 				if (http_parse(client) == -1) {
 					/*
-					 * Something goes wrong and beyond repair. Send error code
-					 * to client before closing the connection
+					 * Something goes wrong and beyond repair. Send the error
+					 * code, after the responses queued before it, then close.
+					 * A send by io_uring completion is not over at once
 					 */
-					io_send(client->fd, client->out, client->ssl_context);
-					bad = 1;	// End the connection
+					client->alive = 0;
+					break;
 				}
 
-				// Free part of the buffer if a lot of data has been processed
-				if (empty(client->in)) io_shrink(client->in);
+				// Stopped by something else than missing data? Resume later
+				client->parse_ready = client->in->pos != pos ||
+									  client->status != status;
+				if (!client->parse_ready) break;
 			}
 
-			// Send data to client
-			if (!bad && test_write_fd(client->fd)) {
-				// Send data from buffer
-				if (client->out->pos < client->out->datasize) {
-					nbytes = io_send(client->fd, client->out,
-									 client->ssl_context);
+			// Free part of the buffer if a lot of data has been processed
+			if (empty(client->in)) io_shrink(client->in);
 
+			/*
+			 * Send data to client: the output buffer, then the queued pipes
+			 * in order, back to back. A response produced in this round is
+			 * tried at once, the socket is not watched for it yet.
+			 */
+			writable = test_write_fd(client->fd) || !was_sending ||
+					   (client->send_wants_read && test_read_fd(client->fd));
+			while (!bad) {
+				if (client->out->pos < client->out->datasize) {
+					if (!writable) break;
+					// Headers go out in the same segment as the file after them
+					nbytes = io_send_more(client->fd, client->out,
+										  client->ssl_context,
+										  client->pipe != NULL);
+					client->send_wants_read = nbytes == 0 &&
+						client->ssl_context != NULL &&
+						SSL_want_read(client->ssl_context);
 					if (nbytes == -1) bad = 1;
-				} else if (!bad && client->status == C_PIPING &&
-						test_read_fd(client->pipe->from_fd)) {
+					if (nbytes > 0) {
+						progress = 1;
+						access_sent(client, nbytes);
+					}
+					if (client->out->pos < client->out->datasize) break;
+				} else if (client->pipe != NULL &&
+						   (pipe_pending(client->pipe) ? writable :
+							test_read_fd(client->pipe->from_fd))) {
 					// Need to pipe data to client from some fd
+					sent = client->pipe->sent;
 					nbytes = io_pipe(client->fd, client->pipe,
 									 client->ssl_context);
-					// Piping complete
-					if (nbytes == 1)
-						client->status = C_IDLE;
+					client->send_wants_read = nbytes == 0 &&
+						client->ssl_context != NULL &&
+						SSL_want_read(client->ssl_context);
+					progress = 1;
+					// The status line of a CGI response
+					if (sent == 0 && client->pipe->file_left < 0)
+						access_sniff(client, client->pipe->buf,
+									 client->pipe->datasize);
+					access_sent(client, client->pipe->sent - sent);
+					if (nbytes == 0) break;
 					if (nbytes == -1) bad = 1;
-					// Deinit client pipe
-					if (nbytes != 0) {
-						free(client->pipe);
-						client->pipe = NULL;
-					}
-				}
+					// Piping complete or failed, the fd is closed
+					client_pipe_done(client);
+				} else
+					break;
 			}
 
-			if (bad || (client->status == C_IDLE && !client->alive)) { //Delete client
-				//Remove from the linked list
-				if (prev == NULL)
-					client_head = client->next;
-				else
-					prev->next = client->next;
+			if (bad || (client->status == C_IDLE && !client->alive &&
+						client->pipe == NULL &&
+						client->out->pos >= client->out->datasize) ||
+				(draining && drain_idle(client))) //Delete client
 				deinit_client(client);
-
-				if (prev == NULL)
-					client = client_head;
-				else
-					client = prev->next;
-			} else {
-				prev = client;
-				client = client->next;
+			else {
+				update_timer(client, progress);
+				update_interest(client);
 			}
 		} // End for client
+
+		//Clients paused by the global budget
+		wake_paused();
+
+		//Stop reading FastCGI output that clients cannot take yet
+		fcgi_update_interest();
+
+		if (draining && client_count() == 0)
+			terminate = 1;
 	}
+
+	log_msg(L_INFO, "Server %s. Bye~\n", draining ? "drained" : "terminated");
+	finalize();
 }
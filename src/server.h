@@ -6,10 +6,12 @@
 #ifndef __SERVER_H__
 #define __SERVER_H__
 
+#include <signal.h>
 #include "config.h"
 #include "io.h"
 
 #define DEFAULT_BACKLOG 1024    //The second argument passed into listen()
+#define ACCEPT_BUDGET 64        //Max connections accepted per port per loop
 
 /**
  * In the serving loop, everytime before calling select(), this variable will
@@ -17,10 +19,13 @@
  * This variable is initially 0. By setting it to a non-zero value, the server
  * will be terminated.
  */
-int terminate;
+volatile sig_atomic_t terminate;
 
 void serve();
 
+int server_drain();
+int server_draining();
+
 void finalize();
 
 #endif
\ No newline at end of file
@@ -0,0 +1,190 @@
+/** @file timer.c
+ *  @brief Hierarchical timing wheel
+ *
+ *  Time is counted in ticks of TIMER_TICK_MS. The wheel has TIMER_LEVELS
+ *  levels of TIMER_SLOTS slots. Level 0 holds timers which expire in less than
+ *  TIMER_SLOTS ticks, one slot per tick. Level n holds timers further away,
+ *  one slot per TIMER_SLOTS^n ticks. Each time the low bits of the current
+ *  tick wrap to 0, the next slot of the level above is cascaded: its timers
+ *  are put back into the wheel, now closer to level 0.
+ *
+ *  Arming and cancelling are O(1). Running the wheel costs O(1) per tick plus
+ *  the timers that fire or cascade.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stddef.h>
+#include <time.h>
+#include "timer.h"
+
+static timer_node_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+static unsigned long current = 0;   //<!first tick not processed yet
+static int started = 0;
+static int count = 0;               //<!number of armed timers
+
+/** @brief Milliseconds on the monotonic clock */
+static unsigned long long now_ms() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/** @brief The current tick */
+static unsigned long now_tick() {
+    unsigned long tick = now_ms() / TIMER_TICK_MS;
+
+    if (!started) {
+        current = tick;
+        started = 1;
+    }
+    return tick;
+}
+
+/** @brief Put an armed timer into the slot of its expiry */
+static void place(timer_node_t *t) {
+    unsigned long delta, max;
+    timer_node_t **slot;
+    int level;
+
+    if (t->expires < current)
+        t->expires = current;
+    delta = t->expires - current;
+
+    for (level = 0; level < TIMER_LEVELS - 1; ++level)
+        if (delta < 1UL << (TIMER_SLOT_BITS * (level + 1)))
+            break;
+    // Beyond the range of the wheel. Fire at the furthest tick
+    max = 1UL << (TIMER_SLOT_BITS * TIMER_LEVELS);
+    if (delta >= max)
+        t->expires = current + max - 1;
+
+    slot = &wheel[level][(t->expires >> (TIMER_SLOT_BITS * level)) &
+                         TIMER_MASK];
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = *slot;
+    if (*slot != NULL)
+        (*slot)->prev = t;
+    *slot = t;
+}
+
+/** @brief Remove a timer from its slot */
+static void unlink_timer(timer_node_t *t) {
+    if (t->prev != NULL)
+        t->prev->next = t->next;
+    else
+        *t->slot = t->next;
+    if (t->next != NULL)
+        t->next->prev = t->prev;
+    t->prev = t->next = NULL;
+    t->slot = NULL;
+}
+
+/** @brief Initialize a timer. It is not armed */
+void timer_setup(timer_node_t *t, void (*fn)(timer_node_t *t), void *data) {
+    t->armed = 0;
+    t->fn = fn;
+    t->data = data;
+    t->slot = NULL;
+    t->prev = t->next = NULL;
+}
+
+/** @brief Arm a timer to fire in ms milliseconds, replacing its expiry */
+void timer_arm(timer_node_t *t, int ms) {
+    unsigned long ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    timer_cancel(t);
+    // At least one tick, so a timer armed by its own callback fires later
+    t->expires = now_tick() + (ticks > 0 ? ticks : 1);
+    t->armed = 1;
+    count += 1;
+    place(t);
+}
+
+/** @brief Cancel a timer. Nothing happens if it is not armed */
+void timer_cancel(timer_node_t *t) {
+    if (!t->armed)
+        return;
+    unlink_timer(t);
+    t->armed = 0;
+    count -= 1;
+}
+
+/** @brief Move the timers of a slot closer to level 0
+ *
+ *  @return The index of the slot
+ */
+static int cascade(int level) {
+    int index = (current >> (TIMER_SLOT_BITS * level)) & TIMER_MASK;
+    timer_node_t *t = wheel[level][index], *next;
+
+    wheel[level][index] = NULL;
+    for (; t != NULL; t = next) {
+        next = t->next;
+        place(t);
+    }
+    return index;
+}
+
+/** @brief Fire all timers which have expired
+ *
+ *  Called by the server loop after each select(). Callbacks may arm and
+ *  cancel timers.
+ */
+void timer_run() {
+    unsigned long now = now_tick();
+    timer_node_t *t, **slot;
+    int level;
+
+    while (current <= now) {
+        if (count == 0) {
+            // Nothing to fire or cascade. Jump ahead
+            current = now + 1;
+            break;
+        }
+
+        if ((current & TIMER_MASK) == 0)
+            for (level = 1; level < TIMER_LEVELS; ++level)
+                if (cascade(level) != 0)
+                    break;
+
+        slot = &wheel[0][current & TIMER_MASK];
+        while ((t = *slot) != NULL) {
+            timer_cancel(t);
+            t->fn(t);
+        }
+        current += 1;
+    }
+}
+
+/** @brief Time until the wheel needs to run again
+ *
+ *  That is the nearest expiry in level 0, or the next cascade if sooner.
+ *
+ *  @param timeout The struct which stores the time left
+ *  @return 1 if a timer is armed. 0 if none
+ */
+int timer_next_timeout(struct timeval *timeout) {
+    unsigned long tick, boundary;
+    long long ms;
+    int i;
+
+    if (count == 0)
+        return 0;
+
+    boundary = (current | TIMER_MASK) + 1;
+    tick = boundary;
+    for (i = 0; i < TIMER_SLOTS && current + i < boundary; ++i)
+        if (wheel[0][(current + i) & TIMER_MASK] != NULL) {
+            tick = current + i;
+            break;
+        }
+
+    ms = (long long)tick * TIMER_TICK_MS - (long long)now_ms();
+    if (ms < 0)
+        ms = 0;
+    timeout->tv_sec = ms / 1000;
+    timeout->tv_usec = ms % 1000 * 1000;
+    return 1;
+}
@@ -0,0 +1,37 @@
+/** @file timer.h
+ *  @brief Hierarchical timing wheel
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <sys/time.h>
+
+#define TIMER_TICK_MS 100       //Resolution of the wheel
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4          //Covers 64^4 ticks, about 19 days
+
+/** @brief A timer, embedded in the object it belongs to
+ *
+ *  Timers in the same slot form a doubly linked list, so a timer can be
+ *  armed and cancelled in O(1).
+ */
+typedef struct timer_node {
+    unsigned long expires;      //<!tick at which the timer fires
+    int armed;
+    void (*fn)(struct timer_node *t);   //<!called when the timer fires
+    void *data;                 //<!for fn
+    struct timer_node **slot;   //<!head of the list the timer is in
+    struct timer_node *prev, *next;
+} timer_node_t;
+
+void timer_setup(timer_node_t *t, void (*fn)(timer_node_t *t), void *data);
+void timer_arm(timer_node_t *t, int ms);
+void timer_cancel(timer_node_t *t);
+void timer_run();
+int timer_next_timeout(struct timeval *timeout);
+
+#endif
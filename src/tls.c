@@ -0,0 +1,544 @@
+/** @file tls.c
+ *  @brief TLS context, handshake and session resumption
+ *
+ *  The server accepts TLS 1.2 and TLS 1.3. A reconnecting client can skip the
+ *  full handshake(and the private key operation) in two ways:
+ *
+ *  1. Session cache. The server keeps up to tls_cache_size sessions, looked
+ *     up by session id.
+ *  2. Session tickets. The session state is encrypted and handed to the
+ *     client, so the server keeps nothing. Tickets are protected by a key
+ *     which is replaced every tls_ticket_rotate seconds. Tickets made with
+ *     the previous key are still accepted, and are renewed with the current
+ *     one.
+ *
+ *  Full and resumed handshakes are counted separately.
+ *
+ *  With tls_workers > 0, the SSL_accept() steps(and their private key
+ *  operations) run on a pool of worker threads instead of the server loop.
+ *  The loop still waits for the socket: when it is ready in the direction the
+ *  handshake wants, the client is queued to the workers, and the loop does
+ *  not touch it until a worker has run one SSL_accept() step. The worker then
+ *  puts it on a done list and writes a byte to a pipe watched by select().
+ *  tls_process() hands the client back to the loop, which waits for the
+ *  socket again if the handshake is not over. A stalled peer thus holds no
+ *  worker. Counters and logging stay on the loop thread.
+ *
+ *  Either way, the handshake must be over within header_timeout from the
+ *  accept, see update_timer().
+ *
+ *  When both OpenSSL and the kernel support it, the record layer is handed to
+ *  the kernel(kTLS) after the handshake. Static files can then be sent with
+ *  SSL_sendfile(), see io_pipe(). Otherwise OpenSSL encrypts as before.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#define _GNU_SOURCE         // pipe2
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#else
+#include <openssl/hmac.h>
+#endif
+#include "config.h"
+#include "log.h"
+#include "http_client.h"
+#include "tls.h"
+#include "probes.h"
+
+static SSL_CTX *ssl_context = NULL;
+/* keys[0] is the current ticket key, keys[1] the previous one */
+static ticket_key_t keys[2];
+static tls_stats_t stats;
+/* Serializes the use and rotation of the ticket keys among the workers */
+static pthread_mutex_t keys_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Handshake workers */
+static pthread_t *workers;
+static int nworkers = 0;
+static volatile int workers_stopping = 0;
+static int notify_fd[2];            //<!workers -> loop wake up pipe
+static tls_job_t *jobs_head = NULL, *jobs_tail = NULL;   //<!to the workers
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_cond = PTHREAD_COND_INITIALIZER;
+static tls_job_t *done_head = NULL;                      //<!back to the loop
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Fill a ticket key with random bytes
+ *
+ *  @return 0 if success. -1 if error
+ */
+static int new_ticket_key(ticket_key_t *key) {
+    if (RAND_bytes(key->name, TICKET_NAME_LEN) <= 0 ||
+        RAND_bytes(key->aes_key, TICKET_SECRET_LEN) <= 0 ||
+        RAND_bytes(key->hmac_key, TICKET_SECRET_LEN) <= 0) {
+        log_msg(L_ERROR, "Error generating session ticket key.\n");
+        return -1;
+    }
+    key->created = time(NULL);
+    return 0;
+}
+
+/** @brief Replace the current ticket key when it gets too old */
+static void rotate_ticket_key() {
+    ticket_key_t key;
+
+    if (time(NULL) - keys[0].created < tls_ticket_rotate)
+        return;
+    if (new_ticket_key(&key) == -1)
+        return;
+
+    keys[1] = keys[0];
+    keys[0] = key;
+    log_msg(L_INFO, "Session ticket key rotated\n");
+}
+
+/** @brief Find the ticket key with the given name
+ *
+ *  @return The key. NULL if unknown or expired
+ */
+static ticket_key_t* find_ticket_key(unsigned char *name) {
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        if (keys[i].created == 0) continue;
+        if (time(NULL) - keys[i].created >= 2 * tls_ticket_rotate) continue;
+        if (memcmp(keys[i].name, name, TICKET_NAME_LEN) == 0)
+            return keys + i;
+    }
+    return NULL;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX ticket_hmac_t;
+
+static int set_hmac_key(ticket_hmac_t *hctx, ticket_key_t *key) {
+    OSSL_PARAM params[3];
+
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY,
+                                                  key->hmac_key,
+                                                  TICKET_SECRET_LEN);
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST,
+                                                 "sha256", 0);
+    params[2] = OSSL_PARAM_construct_end();
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+typedef HMAC_CTX ticket_hmac_t;
+
+static int set_hmac_key(ticket_hmac_t *hctx, ticket_key_t *key) {
+    return HMAC_Init_ex(hctx, key->hmac_key, TICKET_SECRET_LEN, EVP_sha256(),
+                        NULL);
+}
+#endif
+
+/** @brief Set up the cipher and the HMAC of a session ticket */
+static int use_ticket_key(unsigned char *name, unsigned char *iv,
+                          EVP_CIPHER_CTX *ctx, ticket_hmac_t *hctx, int enc) {
+    ticket_key_t *key;
+
+    if (enc) {
+        rotate_ticket_key();
+        key = keys;
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+            return -1;
+        memcpy(name, key->name, TICKET_NAME_LEN);
+        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key,
+                               iv) != 1 || set_hmac_key(hctx, key) != 1)
+            return -1;
+        return 1;
+    }
+
+    if ((key = find_ticket_key(name)) == NULL)
+        return 0;
+    if (set_hmac_key(hctx, key) != 1 ||
+        EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->aes_key,
+                           iv) != 1)
+        return -1;
+
+    return key == keys ? 1 : 2;
+}
+
+/*
+ * Encrypt(enc == 1) or decrypt a session ticket. See
+ * SSL_CTX_set_tlsext_ticket_key_evp_cb(3)
+ *
+ * Return -1 on error, 0 to fall back to a full handshake, 1 on success and 2
+ * if the ticket should be renewed.
+ *
+ * A TLS 1.3 ticket is always renewed: clients use a ticket once(RFC 8446,
+ * C.4), and without a new one their next connection would be a full handshake.
+ */
+static int ticket_key_cb(SSL *s, unsigned char *name, unsigned char *iv,
+                         EVP_CIPHER_CTX *ctx, ticket_hmac_t *hctx, int enc) {
+    int ret;
+
+    pthread_mutex_lock(&keys_lock);
+    ret = use_ticket_key(name, iv, ctx, hctx, enc);
+    pthread_mutex_unlock(&keys_lock);
+    if (!enc && ret == 1 && SSL_version(s) == TLS1_3_VERSION)
+        ret = 2;
+    return ret;
+}
+
+/** @brief The handshake of a client has completed */
+static void handshake_done(http_client_t *client) {
+    int resumed, ktls = 0;
+
+    client->status = C_IDLE;
+    client->ssl_want = 0;
+
+    resumed = SSL_session_reused(client->ssl_context);
+    PROBE2(tls_done, client->fd, resumed);
+    if (resumed)
+        stats.resumed += 1;
+    else
+        stats.full += 1;
+#ifdef USE_KTLS
+    if ((ktls = BIO_get_ktls_send(SSL_get_wbio(client->ssl_context))))
+        stats.ktls += 1;
+#endif
+    log_msg(L_INFO, "TLS handshake done with %s, %s %s%s\n",
+            client->remote_ip, SSL_get_version(client->ssl_context),
+            resumed ? "resumed" : "full", ktls ? ", kTLS" : "");
+}
+
+/** @brief Run one SSL_accept() step on a worker thread
+ *
+ *  The socket is non-blocking and was ready, so the step does not wait for
+ *  the peer. When SSL_accept() needs the peer again, the job goes back to the
+ *  loop with the direction to wait for.
+ */
+static void offload_handshake(tls_job_t *job) {
+    SSL *ssl = job->client->ssl_context;
+    int ret;
+
+    if ((ret = SSL_accept(ssl)) == 1) {
+        job->ret = 0;
+        return;
+    }
+
+    job->err = SSL_get_error(ssl, ret);
+    if (job->err == SSL_ERROR_WANT_READ || job->err == SSL_ERROR_WANT_WRITE)
+        job->ret = 1;
+    else {
+        job->reason = ERR_get_error();
+        job->ret = -1;
+    }
+}
+
+/** @brief Main function of a handshake worker */
+static void* tls_worker(void *arg) {
+    tls_job_t *job;
+
+    for (;;) {
+        pthread_mutex_lock(&jobs_lock);
+        while (jobs_head == NULL && !workers_stopping)
+            pthread_cond_wait(&jobs_cond, &jobs_lock);
+        if (workers_stopping) {
+            pthread_mutex_unlock(&jobs_lock);
+            return NULL;
+        }
+        job = jobs_head;
+        jobs_head = job->next;
+        if (jobs_head == NULL)
+            jobs_tail = NULL;
+        pthread_mutex_unlock(&jobs_lock);
+
+        offload_handshake(job);
+
+        pthread_mutex_lock(&done_lock);
+        job->next = done_head;
+        done_head = job;
+        pthread_mutex_unlock(&done_lock);
+        // Wake up the server loop
+        if (write(notify_fd[1], "", 1) == -1 && errno != EAGAIN)
+            log_error("tls_worker notify error");
+    }
+}
+
+/** @brief Start the handshake workers
+ *
+ *  @return 0 if success. -1 if error
+ */
+static int start_workers() {
+    sigset_t all, old;
+    int i;
+
+    if (pipe2(notify_fd, O_CLOEXEC | O_NONBLOCK) == -1) {
+        log_error("tls pipe2 error");
+        return -1;
+    }
+    workers = malloc(sizeof(pthread_t) * tls_workers);
+    /* SIGTERM and SIGCHLD are left to the serving loop */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for (i = 0; i < tls_workers; ++i)
+        if (pthread_create(workers + i, NULL, tls_worker, NULL) != 0) {
+            log_msg(L_ERROR, "Error creating TLS handshake worker.\n");
+            break;
+        }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    nworkers = i;
+    if (nworkers == 0) {
+        free(workers);
+        close(notify_fd[0]);
+        close(notify_fd[1]);
+        return -1;
+    }
+
+    add_read_fd(notify_fd[0]);
+    log_msg(L_INFO, "%d TLS handshake workers started\n", nworkers);
+    return 0;
+}
+
+/** @brief Hand the next handshake step of a client to the workers */
+static void submit_handshake(http_client_t *client) {
+    tls_job_t *job = malloc(sizeof(tls_job_t));
+
+    job->client = client;
+    job->next = NULL;
+    // The loop leaves the client alone until the job comes back
+    client->ssl_want = 0;
+    remove_read_fd(client->fd);
+    remove_write_fd(client->fd);
+
+    pthread_mutex_lock(&jobs_lock);
+    if (jobs_tail == NULL)
+        jobs_head = job;
+    else
+        jobs_tail->next = job;
+    jobs_tail = job;
+    pthread_cond_signal(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+}
+
+/** @brief Make progress on the TLS handshake of a client
+ *
+ *  The socket is non-blocking. SSL_accept() returns
+ *  SSL_ERROR_WANT_READ/WANT_WRITE when it needs the peer, and is called again
+ *  when the socket is ready in that direction. With workers, the step is
+ *  queued to them instead, see tls_process().
+ *
+ *  @return 0 if the handshake is done or to be continued. -1 if error
+ */
+int ssl_handshake(http_client_t *client) {
+    int ret, err;
+
+    if (nworkers > 0) {
+        submit_handshake(client);
+        return 0;
+    }
+
+    if ((ret = SSL_accept(client->ssl_context)) == 1) {
+        handshake_done(client);
+        return 0;
+    }
+
+    err = SSL_get_error(client->ssl_context, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+        client->ssl_want = err;
+        return 0;
+    }
+
+    stats.failed += 1;
+    log_msg(L_ERROR, "ssl_handshake SSL_accept returns %d: %s\n", err,
+            ERR_reason_error_string(ERR_get_error()));
+    return -1;
+}
+
+/** @brief Take back the clients whose handshake step a worker has run
+ *
+ *  Called by the server loop after each select(). A client whose handshake
+ *  wants the peer is watched again, one whose handshake failed is marked dead
+ *  and is closed by the loop.
+ */
+void tls_process() {
+    tls_job_t *job, *next;
+    char drain[64];
+
+    if (nworkers == 0 || !test_read_fd(notify_fd[0]))
+        return;
+    while (read(notify_fd[0], drain, sizeof(drain)) > 0)
+        ;
+
+    pthread_mutex_lock(&done_lock);
+    job = done_head;
+    done_head = NULL;
+    pthread_mutex_unlock(&done_lock);
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        // The loop chooses what to watch for the client again
+        client_wake(job->client);
+        if (job->ret == 0)
+            handshake_done(job->client);
+        else if (job->ret == 1)
+            job->client->ssl_want = job->err;
+        else {
+            stats.failed += 1;
+            log_msg(L_ERROR, "TLS handshake with %s failed, error %d: %s\n",
+                    job->client->remote_ip, job->err,
+                    job->reason ? ERR_reason_error_string(job->reason) :
+                                  "connection lost");
+            job->client->status = C_IDLE;
+            job->client->alive = 0;
+        }
+        free(job);
+    }
+}
+
+/** @brief Stop the handshake workers and wait for them */
+static void stop_workers() {
+    tls_job_t *job;
+    int i;
+
+    if (nworkers == 0)
+        return;
+
+    pthread_mutex_lock(&jobs_lock);
+    workers_stopping = 1;
+    pthread_cond_broadcast(&jobs_cond);
+    pthread_mutex_unlock(&jobs_lock);
+    for (i = 0; i < nworkers; ++i)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    nworkers = 0;
+
+    for (; jobs_head != NULL; jobs_head = job) {
+        job = jobs_head->next;
+        free(jobs_head);
+    }
+    for (; done_head != NULL; done_head = job) {
+        job = done_head->next;
+        free(done_head);
+    }
+    close(notify_fd[0]);
+    close(notify_fd[1]);
+}
+
+/** @brief Setup ssl_context, load private key, certificate
+ *
+ *  @return 0 if success. -1 if erorr occurs
+ */
+int ssl_setup() {
+    OPENSSL_init_ssl(OPENSSL_INIT_LOAD_SSL_STRINGS |
+                     OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL);
+
+    /* Version-flexible method, TLS 1.2 and above */
+    if ((ssl_context = SSL_CTX_new(TLS_server_method())) == NULL ||
+        SSL_CTX_set_min_proto_version(ssl_context, TLS1_2_VERSION) == 0)
+    {
+        log_msg(L_ERROR, "Error creating SSL context.\n");
+        SSL_CTX_free(ssl_context);
+        return -1;
+    }
+    SSL_CTX_set_options(ssl_context, SSL_OP_NO_COMPRESSION |
+                                     SSL_OP_CIPHER_SERVER_PREFERENCE);
+    /*
+     * Free the read/write buffers of idle connections. Allow SSL_write() to
+     * send part of the data, and to be retried after io_shrink() moved the
+     * output buffer.
+     */
+    SSL_CTX_set_mode(ssl_context, SSL_MODE_RELEASE_BUFFERS |
+                                  SSL_MODE_ENABLE_PARTIAL_WRITE |
+                                  SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef USE_KTLS
+    /* Only takes effect if the kernel has the tls module */
+    SSL_CTX_set_options(ssl_context, SSL_OP_ENABLE_KTLS);
+#endif
+
+    /* register private key */
+    if (SSL_CTX_use_PrivateKey_file(ssl_context, private_key_file,
+                                    SSL_FILETYPE_PEM) == 0)
+    {
+        SSL_CTX_free(ssl_context);
+        log_msg(L_ERROR, "Error associating private key.\n");
+        return -1;
+    }
+
+    /* register public key (certificate) */
+    if (SSL_CTX_use_certificate_file(ssl_context, certificate_file,
+                                     SSL_FILETYPE_PEM) == 0)
+    {
+        SSL_CTX_free(ssl_context);
+        log_msg(L_ERROR, "Error associating certificate.\n");
+        return -1;
+    }
+
+    /* Server side session cache */
+    SSL_CTX_set_session_id_context(ssl_context, (unsigned char *)"lisod", 5);
+    SSL_CTX_set_session_cache_mode(ssl_context, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ssl_context, tls_cache_size);
+    /* As long as a ticket made with the previous key is accepted */
+    SSL_CTX_set_timeout(ssl_context, 2 * tls_ticket_rotate);
+
+    /* Session tickets with rotating keys */
+    if (new_ticket_key(keys) == -1) {
+        SSL_CTX_free(ssl_context);
+        return -1;
+    }
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ssl_context, ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ssl_context, ticket_key_cb);
+#endif
+
+    // Without workers, handshakes run in the loop
+    if (tls_workers > 0 && start_workers() == -1)
+        log_msg(L_ERROR, "No TLS handshake worker, handshake in the loop\n");
+
+    return 0;
+}
+
+/** @brief Wrap client socket with SSL and start the handshake
+ *
+ *  The handshake steps run on a worker if there are any, in the loop
+ *  otherwise.
+ *
+ *  @return 0 if sucess. -1 if error
+ */
+int ssl_wrap(http_client_t *client) {
+    if ((client->ssl_context = SSL_new(ssl_context)) == NULL) {
+        log_msg(L_ERROR, "ssl_wrap SSL_new error.\n");
+        return -1;
+    }
+
+    if (SSL_set_fd(client->ssl_context, client->fd) == 0) {
+        log_msg(L_ERROR, "ssl_wrap SSL_set_fd error.\n");
+        return -1;
+    }
+
+    client->status = C_HANDSHAKE;
+
+    if (nworkers > 0) {
+        // The client speaks first, a worker runs once its hello is there
+        client->ssl_want = SSL_ERROR_WANT_READ;
+        return 0;
+    }
+    return ssl_handshake(client);
+}
+
+/** @brief Stop the workers, free the SSL context and forget the ticket keys */
+void ssl_finalize() {
+    stop_workers();
+    SSL_CTX_free(ssl_context);
+    ssl_context = NULL;
+    OPENSSL_cleanse(keys, sizeof(keys));
+}
+
+/** @brief Get the handshake counters */
+tls_stats_t* tls_get_stats() {
+    return &stats;
+}
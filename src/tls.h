@@ -0,0 +1,50 @@
+/** @file tls.h
+ *  @brief TLS context, handshake and session resumption
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <time.h>
+#include <openssl/ssl.h>
+#include "http_client.h"
+
+/* Length of the fields of a session ticket key */
+#define TICKET_NAME_LEN 16
+#define TICKET_SECRET_LEN 32
+
+/** @brief A key used to encrypt and authenticate session tickets */
+typedef struct {
+    unsigned char name[TICKET_NAME_LEN];
+    unsigned char aes_key[TICKET_SECRET_LEN];
+    unsigned char hmac_key[TICKET_SECRET_LEN];
+    time_t created;
+} ticket_key_t;
+
+/** @brief Handshake counters */
+typedef struct {
+    long full;          //<!handshakes with a full key exchange
+    long resumed;       //<!handshakes resuming a previous session
+    long failed;        //<!handshakes ending in error
+    long ktls;          //<!connections encrypted by the kernel
+} tls_stats_t;
+
+/** @brief A handshake step handed to a worker thread */
+typedef struct tls_job {
+    http_client_t *client;
+    int ret;                //<!0 if the handshake is done. 1 if it wants the
+                            //<!peer, see err. -1 if failed
+    int err;                //<!last SSL_get_error() code
+    unsigned long reason;   //<!OpenSSL error
+    struct tls_job *next;
+} tls_job_t;
+
+int ssl_setup();
+int ssl_wrap(http_client_t *client);
+int ssl_handshake(http_client_t *client);
+void tls_process();
+void ssl_finalize();
+tls_stats_t* tls_get_stats();
+
+#endif
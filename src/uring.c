@@ -0,0 +1,874 @@
+/** @file uring.c
+ *  @brief io_uring engine for the select context
+ *
+ *  Readiness. The fds watched by the select context are polled with one-shot
+ *  IORING_OP_POLL_ADD requests instead of select(). Changes of interest are
+ *  queued as submissions and sent to the kernel together with the wait, so a
+ *  round of the server loop costs one io_uring_enter() however many fds
+ *  changed, and the kernel only reports the fds which are ready instead of
+ *  scanning all of them.
+ *
+ *  A poll request completes once. The fd is polled again at the next wait if
+ *  it is still watched, and the kernel checks readiness at that time, so the
+ *  engine behaves like select(): level triggered.
+ *
+ *  Completions. The listening sockets and the plain HTTP client sockets do not
+ *  wait for readiness, the I/O itself goes through the ring:
+ *
+ *  - A listening socket has a multishot IORING_OP_ACCEPT in flight. Accepted
+ *    sockets are queued until uring_accept() takes them. The kernel accepts
+ *    the whole backlog at once, so the queue grows as needed, but the accept
+ *    is stopped while URING_ACCEPT_QUEUE sockets wait, so the backlog still
+ *    pushes back.
+ *  - A socket watched for reading has an IORING_OP_RECV in flight. The kernel
+ *    picks a buffer from a ring of provided buffers, so idle connections tie
+ *    up no memory. The chunk waits there until uring_recv() copies it to the
+ *    input buffer, then the buffer goes back to the ring.
+ *  - uring_send() copies the data and submits an IORING_OP_SEND. The output
+ *    buffer may move, see io_shrink(), while the kernel sends. The next
+ *    uring_send() returns the result, like a send() which returned late.
+ *
+ *  A completion makes its fd ready: a received chunk or a queued connection
+ *  for reading, a finished send for writing. server.c runs the same code with
+ *  both engines, but accept4(), recv() and send() are no longer called for
+ *  these fds: they are submitted with the wait, in one io_uring_enter() per
+ *  round. TLS sockets, whose reads and writes are done by OpenSSL, pipes and
+ *  sendfile() still wait for readiness.
+ *
+ *  Each request carries the fd, the kind of request and a generation number
+ *  in user_data. The generation of polls is bumped whenever a poll is
+ *  cancelled, the one of completions when the fd is released before its
+ *  close. A completion of an old request, possibly on a closed fd whose
+ *  number is reused, is ignored.
+ *
+ *  The rings are mapped by hand with the raw system calls, there is no
+ *  liburing dependency. Without provided buffer rings(Linux 5.19), the engine
+ *  only polls.
+ *
+ *  @author Chao Xin(cxin)
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include "log.h"
+#include "mem.h"
+#include "uring.h"
+
+static uring_stats_t stats;
+
+#ifdef USE_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define TAG_REMOVE (~0ULL)      //user_data of cancellations
+#define URING_BGID 0            //group of the provided buffers
+
+/* Kinds of requests, in user_data */
+#define OP_POLL 0
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_ACCEPT 3
+
+/* How an fd is served */
+#define KIND_POLL 0             //readiness only
+#define KIND_STREAM 1           //recv and send by completion
+#define KIND_LISTEN 2           //accept by completion
+
+static int ring_fd = -1;
+static void *sq_ptr, *cq_ptr;
+static size_t sq_size, cq_size;
+static struct io_uring_sqe *sqes;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+
+static short want[FD_SETSIZE];      //<!events the select context watches
+static short armed[FD_SETSIZE];     //<!events of the poll in flight
+static unsigned gen[FD_SETSIZE];    //<!generation of the poll in flight
+static short got[FD_SETSIZE];       //<!events polled, not reported yet
+static int rearm[FD_SETSIZE];       //<!fds to poll again at the next wait
+static char queued[FD_SETSIZE];     //<!fd is in rearm[]
+static int nrearm = 0;
+static int touched[FD_SETSIZE];     //<!fds which may be ready
+static char is_touched[FD_SETSIZE]; //<!fd is in touched[]
+static int ntouched = 0;
+
+/* Completions */
+static int completions = 0;         //<!provided buffers are set up
+static char kind[FD_SETSIZE];
+static unsigned cgen[FD_SETSIZE];   //<!generation of completion requests
+static char recv_busy[FD_SETSIZE], recv_done[FD_SETSIZE];
+static int recv_res[FD_SETSIZE];    //<!bytes received, 0 at EOF, -errno
+static int recv_bid[FD_SETSIZE];    //<!buffer of the chunk. -1 if none
+static int recv_off[FD_SETSIZE];    //<!bytes of the chunk already taken
+static char send_busy[FD_SETSIZE], send_done[FD_SETSIZE];
+static int send_res[FD_SETSIZE];    //<!bytes sent, -errno
+static char *stage[FD_SETSIZE];     //<!copy of the data being sent
+static uring_listener_t listeners[URING_LISTENERS];
+
+static struct io_uring_buf_ring *buf_ring;
+static char *buf_mem;
+static unsigned short buf_tail;
+
+static unsigned long long tag(int op, unsigned g, int fd) {
+    return ((unsigned long long)g << 32) | (op << 16) | fd;
+}
+
+/** @brief Submit the queued requests without waiting */
+static void flush() {
+    unsigned pending = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+
+    stats.enters += 1;
+    if (syscall(__NR_io_uring_enter, ring_fd, pending, 0, 0, NULL, 0) == -1)
+        log_error("io_uring_enter error");
+}
+
+/** @brief Get a free submission entry. Submit the queue if it is full */
+static struct io_uring_sqe* get_sqe() {
+    struct io_uring_sqe *sqe;
+    unsigned tail = *sq_tail;
+
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+        flush();
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+            log_msg(L_ERROR, "io_uring submission queue full\n");
+            return NULL;
+        }
+    }
+
+    sqe = &sqes[tail & *sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array[tail & *sq_mask] = tail & *sq_mask;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    stats.submitted += 1;
+    return sqe;
+}
+
+/** @brief Cancel the request with the given user_data */
+static void cancel(unsigned long long key) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = key;
+        sqe->user_data = TAG_REMOVE;
+    }
+}
+
+/** @brief Poll fd for events */
+static void arm(int fd, short events) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    sqe->user_data = tag(OP_POLL, gen[fd], fd);
+    armed[fd] = events;
+}
+
+/** @brief Cancel the poll in flight for fd */
+static void disarm(int fd) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) != NULL) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = tag(OP_POLL, gen[fd], fd);
+        sqe->user_data = TAG_REMOVE;
+    }
+    armed[fd] = 0;
+    gen[fd] += 1;
+}
+
+/** @brief Look at fd again at the next wait */
+static void queue_rearm(int fd) {
+    if (queued[fd]) return;
+    queued[fd] = 1;
+    rearm[nrearm++] = fd;
+}
+
+/** @brief fd may be ready, see what it has at the next wait */
+static void touch(int fd) {
+    if (is_touched[fd]) return;
+    is_touched[fd] = 1;
+    touched[ntouched++] = fd;
+}
+
+/** @brief Queue an accepted socket, the queue grows when full */
+static void enqueue(uring_listener_t *l, int fd) {
+    int *queue, i;
+
+    if (l->count == l->size) {
+        if ((queue = malloc(2 * l->size * sizeof(int))) == NULL) {
+            log_msg(L_ERROR, "io_uring accept queue full\n");
+            close(fd);
+            return;
+        }
+        for (i = 0; i < l->count; ++i)
+            queue[i] = l->queue[(l->head + i) % l->size];
+        free(l->queue);
+        l->queue = queue;
+        l->size *= 2;
+        l->head = 0;
+    }
+    l->queue[(l->head + l->count) % l->size] = fd;
+    l->count += 1;
+}
+
+static uring_listener_t* find_listener(int fd) {
+    int i;
+
+    for (i = 0; i < URING_LISTENERS; ++i)
+        if (listeners[i].fd == fd)
+            return listeners + i;
+    return NULL;
+}
+
+/** @brief Give a provided buffer back to the kernel */
+static void recycle(int bid) {
+    struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (URING_BUFS - 1)];
+
+    buf->addr = (unsigned long)(buf_mem + bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    buf_tail += 1;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+/** @brief Set up the ring of provided buffers
+ *
+ *  @return 0 if ok. -1 if the kernel does not have them
+ */
+static int setup_buffers() {
+    struct io_uring_buf_reg reg;
+    int i;
+
+    if (posix_memalign((void **)&buf_ring, sysconf(_SC_PAGESIZE),
+                       URING_BUFS * sizeof(struct io_uring_buf)) != 0)
+        return -1;
+    if ((buf_mem = malloc(URING_BUFS * URING_BUF_SIZE)) == NULL) {
+        free(buf_ring);
+        return -1;
+    }
+    memset(buf_ring, 0, URING_BUFS * sizeof(struct io_uring_buf));
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)buf_ring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+                &reg, 1) == -1) {
+        log_error("io_uring provided buffers error");
+        free(buf_ring);
+        free(buf_mem);
+        return -1;
+    }
+
+    buf_tail = 0;
+    for (i = 0; i < URING_BUFS; ++i)
+        recycle(i);
+    return 0;
+}
+
+/** @brief Receive on fd into a provided buffer */
+static void submit_recv(int fd) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = tag(OP_RECV, cgen[fd], fd);
+    recv_busy[fd] = 1;
+}
+
+/** @brief Send a copy of the data on fd */
+static void submit_send(int fd, char *buf, int len, int more) {
+    struct io_uring_sqe *sqe;
+
+    if (len > URING_SEND_MAX)
+        len = URING_SEND_MAX;
+    if ((sqe = get_sqe()) == NULL)
+        return;
+    stage[fd] = mem_alloc(MEM_BUF, len);
+    memcpy(stage[fd], buf, len);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)stage[fd];
+    sqe->len = len;
+    sqe->msg_flags = more ? MSG_MORE : 0;
+    sqe->user_data = tag(OP_SEND, cgen[fd], fd);
+    send_busy[fd] = 1;
+}
+
+/** @brief Accept connections on a listening socket until cancelled */
+static void submit_accept(uring_listener_t *l) {
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = get_sqe()) == NULL)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag(OP_ACCEPT, cgen[l->fd], l->fd);
+    l->armed = 1;
+}
+
+/** @brief Events to poll fd for. The completions cover the others */
+static short poll_events(int fd) {
+    short events = want[fd];
+
+    if (kind[fd] == KIND_LISTEN)
+        return 0;
+    if (kind[fd] == KIND_STREAM) {
+        events &= ~POLLIN;
+        if (send_busy[fd] || send_done[fd])
+            events &= ~POLLOUT;
+    }
+    return events;
+}
+
+/** @brief Does fd have a result the loop has not taken yet? */
+static int has_result(int fd) {
+    uring_listener_t *l;
+
+    if (kind[fd] == KIND_LISTEN)
+        return (l = find_listener(fd)) != NULL && l->count > 0;
+    return recv_done[fd] || send_done[fd];
+}
+
+/** @brief Have the requests in flight for fd match what is watched */
+static void update(int fd) {
+    short events = poll_events(fd);
+    uring_listener_t *l;
+
+    if (armed[fd] != 0 && armed[fd] != events)
+        disarm(fd);
+    if (armed[fd] == 0 && events != 0)
+        arm(fd, events);
+
+    if (kind[fd] == KIND_STREAM && (want[fd] & POLLIN) && !recv_busy[fd] &&
+        !recv_done[fd])
+        submit_recv(fd);
+    if (kind[fd] == KIND_LISTEN && (want[fd] & POLLIN) &&
+        (l = find_listener(fd)) != NULL && !l->armed &&
+        l->count < URING_ACCEPT_QUEUE / 2)
+        submit_accept(l);
+}
+
+/** @brief Set up the ring
+ *
+ *  @return 0 if ok. -1 if io_uring is not usable, e.g. an old kernel or a
+ *          sandbox which forbids it
+ */
+int uring_init() {
+    struct io_uring_params p;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    if ((ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) == -1) {
+        log_error("io_uring_setup error");
+        return -1;
+    }
+    /* The timeout of the wait is passed with IORING_ENTER_EXT_ARG */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        log_msg(L_ERROR, "io_uring without IORING_FEAT_EXT_ARG\n");
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ptr = sq_ptr;
+    else if ((cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring_fd,
+                            IORING_OFF_CQ_RING)) == MAP_FAILED)
+        goto fail;
+    sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd,
+                IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+        goto fail;
+
+    sq_head = sq_ptr + p.sq_off.head;
+    sq_tail = sq_ptr + p.sq_off.tail;
+    sq_mask = sq_ptr + p.sq_off.ring_mask;
+    sq_array = sq_ptr + p.sq_off.array;
+    sq_entries = p.sq_entries;
+    cq_head = cq_ptr + p.cq_off.head;
+    cq_tail = cq_ptr + p.cq_off.tail;
+    cq_mask = cq_ptr + p.cq_off.ring_mask;
+    cqes = cq_ptr + p.cq_off.cqes;
+
+    for (i = 0; i < URING_LISTENERS; ++i)
+        listeners[i].fd = -1;
+    completions = setup_buffers() == 0;
+    if (!completions)
+        log_msg(L_ERROR, "io_uring without provided buffers, polling only\n");
+
+    log_msg(L_INFO, "io_uring engine, %u entries%s\n", p.sq_entries,
+            completions ? ", accept/recv/send by completion" : "");
+    return 0;
+
+fail:
+    log_error("io_uring mmap error");
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+/** @brief The select context changed the events watched for fd
+ *
+ *  @param events POLLIN, POLLOUT or both. 0 to stop watching
+ */
+void uring_watch(int fd, int events) {
+    int gained;
+
+    if (fd < 0 || fd >= FD_SETSIZE || want[fd] == events)
+        return;
+
+    gained = events & ~want[fd];
+    want[fd] = events;
+    update(fd);
+    // A result which came while it was not watched is reported now
+    if (gained && has_result(fd))
+        touch(fd);
+}
+
+/** @brief Accept connections on the listening socket fd by completion
+ *
+ *  Call before watching fd. Connections are then taken with uring_accept().
+ */
+void uring_listen(int fd) {
+    int i;
+
+    if (!completions || fd < 0 || fd >= FD_SETSIZE)
+        return;
+    for (i = 0; i < URING_LISTENERS; ++i)
+        if (listeners[i].fd == -1) {
+            if ((listeners[i].queue = malloc(URING_ACCEPT_QUEUE *
+                                             sizeof(int))) == NULL)
+                return;
+            listeners[i].fd = fd;
+            listeners[i].armed = listeners[i].cancelling = 0;
+            listeners[i].size = URING_ACCEPT_QUEUE;
+            listeners[i].head = listeners[i].count = 0;
+            kind[fd] = KIND_LISTEN;
+            update(fd);
+            return;
+        }
+}
+
+/** @brief Receive and send on the socket fd by completion
+ *
+ *  Call before watching fd. The socket is then only read with uring_recv()
+ *  and written with uring_send().
+ */
+void uring_stream(int fd) {
+    if (!completions || fd < 0 || fd >= FD_SETSIZE)
+        return;
+    kind[fd] = KIND_STREAM;
+    recv_bid[fd] = -1;
+    update(fd);
+}
+
+/** @brief Forget fd before it is closed
+ *
+ *  The requests in flight are cancelled, a received chunk is dropped and
+ *  connections not taken yet are closed. A send in flight keeps its copy
+ *  until it completes, a new one on the same fd number waits for that.
+ */
+void uring_release(int fd) {
+    uring_listener_t *l;
+
+    if (fd < 0 || fd >= FD_SETSIZE || kind[fd] == KIND_POLL)
+        return;
+
+    if (recv_busy[fd])
+        cancel(tag(OP_RECV, cgen[fd], fd));
+    if (send_busy[fd])
+        cancel(tag(OP_SEND, cgen[fd], fd));
+    if (recv_done[fd] && recv_bid[fd] != -1)
+        recycle(recv_bid[fd]);
+    recv_done[fd] = send_done[fd] = 0;
+
+    if ((l = find_listener(fd)) != NULL) {
+        if (l->armed)
+            cancel(tag(OP_ACCEPT, cgen[fd], fd));
+        for (; l->count > 0; --l->count) {
+            close(l->queue[l->head]);
+            l->head = (l->head + 1) % l->size;
+        }
+        free(l->queue);
+        l->fd = -1;
+    }
+
+    cgen[fd] += 1;
+    kind[fd] = KIND_POLL;
+}
+
+/** @brief Is fd served by completion? */
+int uring_completes(int fd) {
+    return fd >= 0 && fd < FD_SETSIZE && kind[fd] != KIND_POLL;
+}
+
+/** @brief Take a connection accepted on the listening socket fd
+ *
+ *  @return The connected socket, non-blocking. -1 and errno EAGAIN if none
+ */
+int uring_accept(int fd) {
+    uring_listener_t *l = find_listener(fd);
+    int client_fd;
+
+    if (l == NULL || l->count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    client_fd = l->queue[l->head];
+    l->head = (l->head + 1) % l->size;
+    l->count -= 1;
+    if (!l->armed)
+        queue_rearm(fd);
+    return client_fd;
+}
+
+/** @brief Take received data, like recv() on a non-blocking socket
+ *
+ *  @return Bytes copied to buf. 0 at EOF. -1 on error, errno is EAGAIN if
+ *          nothing was received yet
+ */
+int uring_recv(int fd, char *buf, int len) {
+    int n;
+
+    if (!recv_done[fd]) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (recv_res[fd] <= 0) {
+        recv_done[fd] = 0;
+        queue_rearm(fd);
+        if (recv_res[fd] == 0)
+            return 0;
+        errno = -recv_res[fd];
+        return -1;
+    }
+
+    n = recv_res[fd] - recv_off[fd];
+    if (n > len)
+        n = len;
+    memcpy(buf, buf_mem + recv_bid[fd] * URING_BUF_SIZE + recv_off[fd], n);
+    recv_off[fd] += n;
+    if (recv_off[fd] < recv_res[fd])
+        touch(fd);      // The rest is reported at the next wait
+    else {
+        recycle(recv_bid[fd]);
+        recv_done[fd] = 0;
+        queue_rearm(fd);
+    }
+    return n;
+}
+
+/** @brief Send data, like send() on a non-blocking socket
+ *
+ *  The data is copied and sent by the kernel. Until that send completes, the
+ *  caller gets EAGAIN and must call again with the same data: the bytes sent
+ *  are then returned, and the rest is submitted at once.
+ *
+ *  @param more More data follows at once, see MSG_MORE
+ *  @return Bytes of buf sent. -1 on error, errno is EAGAIN if the send is not
+ *          over
+ */
+int uring_send(int fd, char *buf, int len, int more) {
+    int n = -1;
+
+    if (send_busy[fd]) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (send_done[fd]) {
+        send_done[fd] = 0;
+        queue_rearm(fd);
+        if (send_res[fd] < 0) {
+            errno = -send_res[fd];
+            return -1;
+        }
+        n = send_res[fd];
+        buf += n;
+        len -= n;
+    }
+
+    if (len > 0) {
+        submit_send(fd, buf, len, more);
+        update(fd);
+    }
+    if (n == -1)
+        errno = EAGAIN;
+    return n;
+}
+
+/** @brief Note the completion of a request on a completion fd */
+static void complete(int op, unsigned g, int fd, struct io_uring_cqe *cqe) {
+    uring_listener_t *l;
+    int bid = -1;
+
+    switch (op) {
+    case OP_RECV:
+        stats.recvs += 1;
+        recv_busy[fd] = 0;
+        queue_rearm(fd);
+        if (cqe->flags & IORING_CQE_F_BUFFER)
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (g != cgen[fd] || cqe->res == -ENOBUFS || cqe->res <= 0) {
+            if (bid != -1)
+                recycle(bid);
+            bid = -1;
+            if (g != cgen[fd])
+                return;     // Released, maybe the fd was closed and reused
+            if (cqe->res == -ENOBUFS) {
+                log_msg(L_ERROR, "io_uring out of receive buffers\n");
+                return;
+            }
+        }
+        recv_done[fd] = 1;
+        recv_res[fd] = cqe->res;
+        recv_bid[fd] = bid;
+        recv_off[fd] = 0;
+        touch(fd);
+        break;
+
+    case OP_SEND:
+        stats.sends += 1;
+        send_busy[fd] = 0;
+        mem_free(stage[fd]);
+        stage[fd] = NULL;
+        queue_rearm(fd);
+        if (g != cgen[fd])
+            return;
+        send_done[fd] = 1;
+        send_res[fd] = cqe->res;
+        touch(fd);
+        break;
+
+    case OP_ACCEPT:
+        if ((l = find_listener(fd)) == NULL || g != cgen[fd]) {
+            if (cqe->res >= 0)
+                close(cqe->res);
+            return;
+        }
+        if (cqe->res >= 0) {
+            stats.accepts += 1;
+            enqueue(l, cqe->res);
+        } else if (cqe->res != -ECANCELED) {
+            errno = -cqe->res;
+            log_error("io_uring accept error");
+        }
+
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            l->armed = l->cancelling = 0;
+            queue_rearm(fd);
+        } else if (l->count >= URING_ACCEPT_QUEUE && !l->cancelling) {
+            // The loop is behind, leave connections in the backlog
+            cancel(tag(OP_ACCEPT, g, fd));
+            l->cancelling = 1;
+        }
+        touch(fd);
+        break;
+    }
+}
+
+/** @brief Submit the changes and wait for ready fds
+ *
+ *  @param timeout Like select(). NULL to wait without timeout
+ *  @param read_fds, write_fds Filled with the ready fds
+ *  @param ready_fds, nready The ready fds, listed from the completions. An fd
+ *                           is listed once
+ *  @return Number of ready fds in both sets. -1 on error, errno is EINTR if a
+ *          signal arrived
+ */
+int uring_wait(struct timeval *timeout, fd_set *read_fds, fd_set *write_fds,
+               int *ready_fds, int *nready) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    unsigned head, tail, pending, g;
+    int i, fd, op, readable, writable, ready = 0;
+    uring_listener_t *l;
+    long ret;
+
+    // Look again at the fds which completed last time
+    for (i = 0; i < nrearm; ++i) {
+        fd = rearm[i];
+        queued[fd] = 0;
+        update(fd);
+    }
+    nrearm = 0;
+    // Connections left by the accept budget of the loop
+    for (i = 0; i < URING_LISTENERS; ++i) {
+        l = listeners + i;
+        if (l->fd != -1 && l->count > 0)
+            touch(l->fd);
+    }
+
+    memset(&arg, 0, sizeof(arg));
+    arg.sigmask_sz = _NSIG / 8;
+    if (timeout != NULL) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_usec * 1000;
+        arg.ts = (unsigned long long)&ts;
+    }
+
+    // Do not sleep when results are already waiting
+    pending = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    stats.enters += 1;
+    ret = syscall(__NR_io_uring_enter, ring_fd, pending, ntouched > 0 ? 0 : 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg));
+    if (ret == -1 && errno != ETIME && errno != EINTR)
+        return -1;
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        cqe = &cqes[head & *cq_mask];
+        stats.completed += 1;
+        if (cqe->user_data == TAG_REMOVE)
+            continue;
+
+        fd = cqe->user_data & 0xffff;
+        op = (cqe->user_data >> 16) & 0xffff;
+        g = cqe->user_data >> 32;
+        if (op != OP_POLL) {
+            complete(op, g, fd, cqe);
+            continue;
+        }
+        if (g != gen[fd])
+            continue;   // Cancelled, maybe the fd was closed and reused
+        armed[fd] = 0;
+        queue_rearm(fd);
+        // An error is reported as ready, the I/O call will find it
+        got[fd] |= cqe->res < 0 ? POLLERR : cqe->res;
+        touch(fd);
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    FD_ZERO(read_fds);
+    FD_ZERO(write_fds);
+    for (i = 0; i < ntouched; ++i) {
+        fd = touched[i];
+        is_touched[fd] = 0;
+        readable = (want[fd] & POLLIN) &&
+                   ((got[fd] & (POLLIN | POLLERR | POLLHUP)) ||
+                    (kind[fd] == KIND_STREAM && recv_done[fd]) ||
+                    (kind[fd] == KIND_LISTEN && has_result(fd)));
+        writable = (want[fd] & POLLOUT) &&
+                   ((got[fd] & (POLLOUT | POLLERR | POLLHUP)) ||
+                    (kind[fd] == KIND_STREAM && send_done[fd]));
+        got[fd] = 0;
+        if (readable)
+            FD_SET(fd, read_fds);
+        if (writable)
+            FD_SET(fd, write_fds);
+        if (readable || writable)
+            ready_fds[(*nready)++] = fd;
+        ready += readable + writable;
+    }
+    ntouched = 0;
+
+    // Interrupted by a signal before anything was ready, like select()
+    if (ret == -1 && errno == EINTR && ready == 0)
+        return -1;
+    return ready;
+}
+
+/** @brief Close the ring */
+void uring_finalize() {
+    if (ring_fd == -1)
+        return;
+    munmap(sqes, sq_entries * sizeof(struct io_uring_sqe));
+    if (cq_ptr != sq_ptr)
+        munmap(cq_ptr, cq_size);
+    munmap(sq_ptr, sq_size);
+    close(ring_fd);
+    ring_fd = -1;
+    if (completions) {
+        free(buf_ring);
+        free(buf_mem);
+        completions = 0;
+    }
+}
+
+#else
+
+int uring_init() {
+    log_msg(L_ERROR, "Built without io_uring\n");
+    return -1;
+}
+
+void uring_watch(int fd, int events) {
+}
+
+int uring_wait(struct timeval *timeout, fd_set *read_fds, fd_set *write_fds,
+               int *ready_fds, int *nready) {
+    errno = ENOSYS;
+    return -1;
+}
+
+void uring_finalize() {
+}
+
+void uring_listen(int fd) {
+}
+
+void uring_stream(int fd) {
+}
+
+void uring_release(int fd) {
+}
+
+int uring_completes(int fd) {
+    return 0;
+}
+
+int uring_accept(int fd) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_recv(int fd, char *buf, int len) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int uring_send(int fd, char *buf, int len, int more) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
+
+/** @brief Get the counters */
+uring_stats_t* uring_get_stats() {
+    return &stats;
+}
@@ -0,0 +1,65 @@
+/** @file uring.h
+ *  @brief io_uring engine for the select context
+ *
+ *  @author Chao Xin(cxin)
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <sys/select.h>
+#include <sys/time.h>
+
+/* io_uring is available at build time */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define USE_URING
+#endif
+#endif
+
+#define URING_ENTRIES 1024      //Submission queue size
+/*
+ * Provided buffers for receiving. An fd has at most one receive in flight or
+ * one received chunk waiting, so one buffer per fd never runs out
+ */
+#define URING_BUFS FD_SETSIZE
+#define URING_BUF_SIZE 4096
+#define URING_SEND_MAX (64 * 1024)  //Largest send submitted at once
+#define URING_LISTENERS 4           //Listening sockets accepting by completion
+#define URING_ACCEPT_QUEUE 256      //Stop accepting with this many not taken
+
+/** @brief Counters, to compare with select() */
+typedef struct {
+    long enters;                //<!io_uring_enter() calls
+    long submitted;             //<!requests submitted
+    long completed;             //<!completions reaped
+    long accepts;               //<!connections accepted by the ring
+    long recvs;                 //<!receives completed by the ring
+    long sends;                 //<!sends completed by the ring
+} uring_stats_t;
+
+/** @brief A listening socket with a multishot accept */
+typedef struct {
+    int fd;                     //<!-1 if the slot is free
+    int armed;                  //<!the accept is in flight
+    int cancelling;             //<!the accept is being stopped, queue is full
+    int *queue;                 //<!accepted sockets, a circular array
+    int size, head, count;
+} uring_listener_t;
+
+int uring_init();
+void uring_watch(int fd, int events);
+int uring_wait(struct timeval *timeout, fd_set *read_fds, fd_set *write_fds,
+               int *ready_fds, int *nready);
+void uring_finalize();
+uring_stats_t* uring_get_stats();
+
+/* Completion based I/O, see uring.c */
+void uring_listen(int fd);
+void uring_stream(int fd);
+void uring_release(int fd);
+int uring_completes(int fd);
+int uring_accept(int fd);
+int uring_recv(int fd, char *buf, int len);
+int uring_send(int fd, char *buf, int len, int more);
+
+#endif